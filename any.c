@@ -0,0 +1,97 @@
+/* any.c -- find out quickly whether there is any new mail at all
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ */
+
+/* With -q (--any), nothing is counted or printed.  The mailboxes are checked
+ * by a few threads at once, each one stopping at the first new or unread
+ * message, and the answer is the exit status: 0 if there is mail, 1 if not.
+ * As soon as one mailbox has mail the others are abandoned: local checks
+ * notice the stop flag, and remote ones end with the process, which leaves
+ * with _exit() so that no atexit() handler (OpenSSL's, stdio's) runs under
+ * them. */
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include "mailcheck.h"
+
+#define ANY_THREADS (8)
+
+struct any {
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  struct plan *plan;
+  int next;    /* next mailbox to check */
+  int running; /* threads still working */
+  int found;   /* set once, read without the lock by has_mail() */
+};
+
+/* A daemon started with -c knows the answer already. */
+static void note_status(const struct mail_status *status, void *arg) {
+  if (status->new > 0 || status->unread > 0)
+    *(int *)arg = 1;
+}
+
+static void *any_thread(void *arg) {
+  struct any *a = arg;
+  struct mailbox *mb;
+  int found;
+
+  pthread_mutex_lock(&a->lock);
+  while (!a->found && a->next < a->plan->count) {
+    mb = &a->plan->box[a->next];
+    a->next += mb->group;
+    pthread_mutex_unlock(&a->lock);
+
+    found = has_mail(mb, &a->found);
+
+    pthread_mutex_lock(&a->lock);
+    if (found) {
+      __atomic_store_n(&a->found, 1, __ATOMIC_RELAXED);
+      pthread_cond_signal(&a->done);
+    }
+  }
+  if (--a->running == 0)
+    pthread_cond_signal(&a->done);
+  pthread_mutex_unlock(&a->lock);
+  return NULL;
+}
+
+int check_any(void) {
+  static struct any a = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+  pthread_t tid;
+  int i, found = 0;
+
+  /* Unread mail counts, as with -c. */
+  Options.advanced_count = 1;
+  if (Options.rcfile_path == NULL && query_daemon(note_status, &found) == 0)
+    return found ? 0 : 1;
+
+  a.plan = plan_load();
+  if (a.plan->count == 0)
+    return 1;
+
+  pthread_mutex_lock(&a.lock);
+  for (i = 0; i < ANY_THREADS && i < a.plan->count; i++) {
+    if (pthread_create(&tid, NULL, any_thread, &a) != 0)
+      break;
+    pthread_detach(tid);
+    a.running++;
+  }
+  if (a.running == 0) { /* no threads, check here */
+    a.running = 1;
+    pthread_mutex_unlock(&a.lock);
+    any_thread(&a);
+    return a.found ? 0 : 1;
+  }
+
+  while (!a.found && a.running > 0)
+    pthread_cond_wait(&a.done, &a.lock);
+  found = a.found;
+  pthread_mutex_unlock(&a.lock);
+
+  /* Threads may still be busy with other mailboxes: see main(). */
+  return found ? 0 : 1;
+}
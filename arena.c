@@ -0,0 +1,162 @@
+/* arena.c -- bump allocation for memory that lives as long as a run
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ */
+
+/* The bookkeeping of a run (jobs, queues, results, histories) is allocated
+ * from an arena: blocks taken from the heap, handed out front to back and
+ * only given back all at once.  A block that is full is followed by one
+ * twice its size.  When the arena is reset, the blocks are replaced by a
+ * single one that holds as much as the last run used, so that the daemon and
+ * repeated runs reach a steady state in which they don't call malloc() at
+ * all, and memory stays flat however long they run.
+ *
+ * To tell how close a run comes to that, every call to the heap is counted
+ * (-t, and the benchmarks), by wrapping the allocator: glibc exports its own
+ * under other names. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ALIGN (sizeof(max_align_t))
+#define MIN_BLOCK (4096)
+
+struct arena_block {
+  struct arena_block *next; /* older block */
+  size_t size;
+  size_t used;
+  max_align_t data[];
+};
+
+static unsigned long heap_calls;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size) {
+  __atomic_add_fetch(&heap_calls, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  __atomic_add_fetch(&heap_calls, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  __atomic_add_fetch(&heap_calls, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) { __libc_free(ptr); }
+#endif /* __GLIBC__ */
+
+unsigned long heap_allocs(void) {
+  return __atomic_load_n(&heap_calls, __ATOMIC_RELAXED);
+}
+
+static struct arena_block *new_block(struct arena *a, size_t size) {
+  struct arena_block *b;
+
+  if ((b = malloc(sizeof(*b) + size)) == NULL) {
+    fprintf(stderr, "mailcheck: out of memory\n");
+    exit(1);
+  }
+  b->size = size;
+  b->used = 0;
+  b->next = NULL;
+  a->mallocs++;
+  return b;
+}
+
+void *arena_alloc(struct arena *a, size_t size) {
+  struct arena_block *b;
+  size_t want;
+  void *p;
+
+  size = (size + ALIGN - 1) & ~(ALIGN - 1);
+  pthread_mutex_lock(&a->lock);
+  if ((b = a->block) == NULL || b->size - b->used < size) {
+    want = b ? 2 * b->size : a->hint > MIN_BLOCK ? a->hint : MIN_BLOCK;
+    if (want < size)
+      want = size;
+    b = new_block(a, want);
+    b->next = a->block;
+    a->block = b;
+  }
+  p = (char *)b->data + b->used;
+  b->used += size;
+  a->used += size;
+  a->allocs++;
+  pthread_mutex_unlock(&a->lock);
+
+  memset(p, 0, size);
+  return p;
+}
+
+void *arena_grow(struct arena *a, const void *old, size_t old_size,
+                 size_t new_size) {
+  void *p = arena_alloc(a, new_size);
+
+  if (old)
+    memcpy(p, old, old_size < new_size ? old_size : new_size);
+  return p;
+}
+
+char *arena_strndup(struct arena *a, const char *s, size_t len) {
+  char *p = arena_alloc(a, len + 1);
+
+  memcpy(p, s, len);
+  return p;
+}
+
+/* Give back all blocks older than B. */
+static void free_older(struct arena_block *b) {
+  struct arena_block *next;
+
+  for (b = b->next; b; b = next) {
+    next = b->next;
+    free(b);
+  }
+}
+
+void arena_reset(struct arena *a) {
+  struct arena_block *b;
+  size_t size, used;
+
+  pthread_mutex_lock(&a->lock);
+  used = a->used;
+  a->used = 0;
+  a->allocs = 0;
+  a->mallocs = 0;
+  if ((b = a->block) != NULL) {
+    if (b->next) { /* it took several: one that holds it all next time */
+      size = used > b->size ? used : b->size;
+      free_older(b);
+      free(b);
+      b = a->block = new_block(a, size);
+    }
+    b->used = 0;
+  }
+  pthread_mutex_unlock(&a->lock);
+}
+
+void arena_free(struct arena *a) {
+  pthread_mutex_lock(&a->lock);
+  if (a->block) {
+    free_older(a->block);
+    free(a->block);
+  }
+  a->block = NULL;
+  a->used = 0;
+  a->allocs = 0;
+  pthread_mutex_unlock(&a->lock);
+}
@@ -0,0 +1,51 @@
+/* arena.h -- bump allocation for memory that lives as long as a run
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_ 1
+
+#include <pthread.h>
+#include <stddef.h>
+
+struct arena_block;
+
+struct arena {
+  pthread_mutex_t lock;
+  struct arena_block *block; /* the one being filled, then older ones */
+  size_t hint;               /* size of the first block */
+  size_t used;               /* bytes handed out since the last reset */
+  unsigned long allocs;      /* arena_alloc() calls since the last reset */
+  unsigned long mallocs;     /* blocks taken from the heap since then */
+};
+
+#define ARENA_INITIALIZER(hint)                                               \
+  { PTHREAD_MUTEX_INITIALIZER, NULL, (hint), 0, 0, 0 }
+
+/* Get SIZE zeroed bytes, which stay valid until the next arena_reset() or
+ * arena_free().  Exits if out of memory.  May be called from several
+ * threads. */
+void *arena_alloc(struct arena *a, size_t size);
+
+/* Get NEW_SIZE bytes that start with the OLD_SIZE bytes at OLD, to grow an
+ * array.  The old copy is only reused after the next reset. */
+void *arena_grow(struct arena *a, const void *old, size_t old_size,
+                 size_t new_size);
+
+/* Copy the LEN bytes at S, adding a '\0'. */
+char *arena_strndup(struct arena *a, const char *s, size_t len);
+
+/* Forget everything allocated.  A single block is kept, large enough for all
+ * that was allocated since the last reset, so that a run like the last one
+ * needs no more memory from the heap. */
+void arena_reset(struct arena *a);
+
+void arena_free(struct arena *a);
+
+/* Calls to malloc(), calloc() and realloc() so far, by anything in the
+ * process; 0 where they can't be counted. */
+unsigned long heap_allocs(void);
+
+#endif /* _ARENA_H_ */
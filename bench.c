@@ -0,0 +1,494 @@
+/* bench.c -- microbenchmarks for the parsing hot paths
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ */
+
+/* Built and run by "make bench".  Every benchmark works on inputs made in
+ * memory from a fixed seed, so runs are repeatable and touch no disk (the
+ * .netrc is a memfd).  Each one is timed in several samples of about
+ * BENCH_SAMPLE_MS; the median and the median absolute deviation (MAD) of
+ * the samples are reported in ns per operation, together with the number
+ * of allocations per operation, as counted by heap_allocs().
+ *
+ * The exception is the page cache report: an mbox of CACHE_MBOX_PASSES
+ * copies of the generated one is written to an unlinked file in the current
+ * directory, and scanned from a cold cache with plain stdio and with
+ * mbox_open(), to show how much of it stays cached afterwards.  It is not
+ * compared with the baseline.
+ *
+ * Results are compared with a baseline file (-b), and the run fails if a
+ * benchmark got slower by more than both 5% and three times the combined
+ * noise of the two runs, or makes more allocations.  A missing baseline is
+ * written from the current run, and -s replaces it. */
+
+#define _GNU_SOURCE /* fmemopen(), memfd_create() */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "mailcheck.h"
+#include "netrc.h"
+
+#define BENCH_SAMPLES (9)
+#define BENCH_SAMPLE_MS (40)
+#define CACHE_MBOX_PASSES (32)
+
+/* Fixed seed generator for the inputs. */
+static unsigned long long seed = 42;
+
+static unsigned rnd(unsigned n) {
+  seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (seed >> 33) % n;
+}
+
+/* Keep the compiler from discarding results. */
+static volatile long sink;
+
+/* --- inputs --- */
+
+static char *mbox_data;
+static size_t mbox_len;
+static long mbox_lines;
+
+static void make_mbox(void) {
+  static const char *status[] = {"", "Status: RO\n", "Status: O\n",
+                                 "Status: OR\n"};
+  size_t size = 1 << 20;
+  int i, j;
+
+  mbox_data = malloc(size);
+  for (i = 0; i < 2000 && mbox_len + 4096 < size; i++) {
+    mbox_len += sprintf(mbox_data + mbox_len,
+                        "From user%u@example.com Mon Jan  1 00:00:00 2024\n"
+                        "Subject: message %d\nFrom: <user%u@example.com>\n%s"
+                        "\n",
+                        rnd(100), i, rnd(100), status[rnd(4)]);
+    for (j = rnd(12); j > 0; j--)
+      mbox_len += sprintf(mbox_data + mbox_len, "body line %u of the text\n",
+                          rnd(1000));
+    mbox_len += sprintf(mbox_data + mbox_len, "\n");
+  }
+  for (j = 0; (size_t)j < mbox_len; j++)
+    mbox_lines += mbox_data[j] == '\n';
+}
+
+#define NAMES (4096)
+static char *maildir_names[NAMES];
+
+static void make_maildir_names(void) {
+  static const char *flags[] = {"", "S", "RS", "FS", "DFRS", "T", "F"};
+  char buf[128];
+  int i;
+
+  for (i = 0; i < NAMES; i++) {
+    if (rnd(10) == 0)
+      snprintf(buf, sizeof(buf), "17%08u.M%uP%u.host", rnd(100000000),
+               rnd(1000000), rnd(100000));
+    else
+      snprintf(buf, sizeof(buf), "17%08u.M%uP%u.host,S=%u:2,%s",
+               rnd(100000000), rnd(1000000), rnd(100000), rnd(100000),
+               flags[rnd(7)]);
+    maildir_names[i] = strdup(buf);
+  }
+}
+
+static char netrc_path[64];
+static netrc_entry *netrc_list;
+static char *netrc_hosts[NAMES];
+
+static void make_netrc(void) {
+  FILE *fp;
+  char buf[64];
+  int fd, i;
+
+  if ((fd = memfd_create("netrc", 0)) == -1 ||
+      (fp = fdopen(dup(fd), "w")) == NULL) {
+    perror("mailcheck-bench: memfd");
+    exit(1);
+  }
+  for (i = 0; i < 200; i++)
+    fprintf(fp, "machine mail%d.example.com login user%u password pw%u\n", i,
+            rnd(1000), rnd(1000000));
+  fprintf(fp, "default login anonymous password me@example.com\n");
+  fclose(fp);
+  snprintf(netrc_path, sizeof(netrc_path), "/proc/self/fd/%d", fd);
+
+  netrc_list = parse_netrc(netrc_path);
+  for (i = 0; i < NAMES; i++) {
+    snprintf(buf, sizeof(buf), "mail%u.example.com", rnd(250));
+    netrc_hosts[i] = strdup(buf);
+  }
+}
+
+static char *urls[NAMES];
+
+static void make_urls(void) {
+  static const char *proto[] = {"pop3", "pop3s", "imap", "imaps"};
+  char buf[256];
+  int i;
+
+  for (i = 0; i < NAMES; i++) {
+    switch (rnd(4)) {
+    case 0:
+      snprintf(buf, sizeof(buf), "%s://mail%u.example.com", proto[rnd(4)],
+               rnd(100));
+      break;
+    case 1:
+      snprintf(buf, sizeof(buf), "%s://user%u@mail%u.example.com:%u",
+               proto[rnd(4)], rnd(100), rnd(100), 1000 + rnd(9000));
+      break;
+    default:
+      snprintf(buf, sizeof(buf), "%s://user%u@mail%u.example.com/Folder%u/%s",
+               proto[rnd(4)], rnd(100), rnd(100), rnd(100),
+               rnd(2) ? "INBOX" : "*");
+    }
+    urls[i] = strdup(buf);
+  }
+}
+
+static char *paths[NAMES];
+
+static void make_paths(void) {
+  static const char *vars[] = {"$(HOME)", "$(USER)", "$(MAILDIR)",
+                               "$(UNSET_VARIABLE)"};
+  char buf[256];
+  int i, j, n;
+
+  setenv("USER", "benchuser", 1);
+  setenv("MAILDIR", "/var/mail/benchuser/Maildir", 1);
+  for (i = 0; i < NAMES; i++) {
+    n = snprintf(buf, sizeof(buf), "/srv");
+    for (j = rnd(4); j > 0; j--)
+      n += snprintf(buf + n, sizeof(buf) - n, "/%s/dir%u", vars[rnd(4)],
+                    rnd(100));
+    snprintf(buf + n, sizeof(buf) - n, "/mbox%u", rnd(100));
+    paths[i] = strdup(buf);
+  }
+}
+
+/* --- benchmarks: each runs N operations --- */
+
+static void bench_mbox(long n) {
+  int new, read, unread;
+  long done;
+  FILE *fp;
+
+  /* one operation is one line; whole passes over the mbox */
+  for (done = 0; done < n; done += mbox_lines) {
+    fp = fmemopen(mbox_data, mbox_len, "r");
+    count_mbox(fp, &new, &read, &unread);
+    fclose(fp);
+    sink += new + read + unread;
+  }
+}
+
+static void bench_maildir_flags(long n) {
+  long i;
+
+  for (i = 0; i < n; i++)
+    sink += maildir_flags(maildir_names[i % NAMES]);
+}
+
+static void bench_parse_netrc(long n) {
+  long i;
+
+  for (i = 0; i < n; i++)
+    free_netrc(parse_netrc(netrc_path));
+}
+
+static void bench_search_netrc(long n) {
+  netrc_entry *a;
+  long i;
+
+  for (i = 0; i < n; i++) {
+    a = search_netrc(netrc_list, netrc_hosts[i % NAMES], "user1");
+    sink += a != NULL;
+  }
+}
+
+static void bench_parse_url(long n) {
+  char host[BUF_SIZE], box[BUF_SIZE], user[128];
+  int tls;
+  long i;
+
+  for (i = 0; i < n; i++)
+    sink += parse_url(urls[i % NAMES], host, box, user, &tls);
+}
+
+static void bench_expand_path(long n) {
+  char buf[BUF_SIZE];
+  long i;
+
+  for (i = 0; i < n; i++) {
+    expand_path(paths[i % NAMES], buf, sizeof(buf), NULL);
+    sink += buf[1];
+  }
+}
+
+struct bench {
+  const char *name;
+  void (*run)(long n);
+  long step; /* operations are done in multiples of this */
+  double ns[BENCH_SAMPLES];
+  double median, mad, allocs;
+};
+
+static struct bench benches[] = {
+    {"mbox_line", bench_mbox, 0},
+    {"maildir_flags", bench_maildir_flags, 1},
+    {"parse_netrc", bench_parse_netrc, 1},
+    {"search_netrc", bench_search_netrc, 1},
+    {"parse_url", bench_parse_url, 1},
+    {"expand_path", bench_expand_path, 1},
+};
+#define NBENCH (sizeof(benches) / sizeof(benches[0]))
+
+static double now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static double median(double *v, int n) {
+  qsort(v, n, sizeof(*v), cmp_double);
+  return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+static void run_bench(struct bench *b) {
+  double t, dev[BENCH_SAMPLES];
+  unsigned long a;
+  long n = b->step;
+  int i;
+
+  /* find an operation count that takes about one sample time */
+  for (;;) {
+    t = now_ns();
+    b->run(n);
+    t = now_ns() - t;
+    if (t > BENCH_SAMPLE_MS * 1e6 / 4)
+      break;
+    n *= 4;
+  }
+  n = n * (BENCH_SAMPLE_MS * 1e6 / t) / b->step * b->step;
+  if (n < b->step)
+    n = b->step;
+
+  for (i = 0; i < BENCH_SAMPLES; i++) {
+    a = heap_allocs();
+    t = now_ns();
+    b->run(n);
+    t = now_ns() - t;
+    b->ns[i] = t / n;
+    b->allocs = (double)(heap_allocs() - a) / n;
+  }
+
+  b->median = median(b->ns, BENCH_SAMPLES);
+  for (i = 0; i < BENCH_SAMPLES; i++)
+    dev[i] = fabs(b->ns[i] - b->median);
+  b->mad = median(dev, BENCH_SAMPLES);
+}
+
+static int save_baseline(const char *file) {
+  FILE *fp;
+  size_t i;
+
+  if ((fp = fopen(file, "w")) == NULL) {
+    perror(file);
+    return 1;
+  }
+  fprintf(fp, "# name ns/op mad allocs/op\n");
+  for (i = 0; i < NBENCH; i++)
+    fprintf(fp, "%s %.3f %.3f %.4f\n", benches[i].name, benches[i].median,
+            benches[i].mad, benches[i].allocs);
+  fclose(fp);
+  printf("baseline saved to %s\n", file);
+  return 0;
+}
+
+/* Compare with the baseline in FP.  Returns the number of regressions. */
+static int compare(FILE *fp) {
+  char line[256], name[64];
+  double base, mad, allocs, noise, diff;
+  int bad = 0;
+  size_t i;
+
+  printf("\n%-16s %12s %12s %8s\n", "", "baseline", "now", "");
+  while (fgets(line, sizeof(line), fp)) {
+    if (sscanf(line, "%63s %lf %lf %lf", name, &base, &mad, &allocs) != 4 ||
+        name[0] == '#')
+      continue;
+    for (i = 0; i < NBENCH && strcmp(benches[i].name, name); i++)
+      ;
+    if (i == NBENCH || benches[i].median == 0) /* not run (-f) */
+      continue;
+
+    /* MAD * 1.4826 estimates the standard deviation */
+    noise = 3 * 1.4826 * sqrt(mad * mad + benches[i].mad * benches[i].mad);
+    if (noise < 0.05 * base)
+      noise = 0.05 * base;
+    diff = benches[i].median - base;
+
+    printf("%-16s %9.1f ns %9.1f ns %+7.1f%%", name, base, benches[i].median,
+           100 * diff / base);
+    if (benches[i].allocs > allocs + 0.0005) {
+      printf("  MORE ALLOCATIONS (%.3f -> %.3f)", allocs, benches[i].allocs);
+      bad++;
+    }
+    if (diff > noise) {
+      printf("  SLOWER");
+      bad++;
+    } else if (-diff > noise) {
+      printf("  faster");
+    }
+    printf("\n");
+  }
+  return bad;
+}
+
+/* KiB of file FD in the page cache. */
+static long cached_kib(int fd) {
+  long page = sysconf(_SC_PAGESIZE), pages, i, n = 0;
+  unsigned char *vec;
+  struct stat st;
+  void *map;
+
+  if (fstat(fd, &st) != 0 || st.st_size == 0 ||
+      (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) ==
+          MAP_FAILED)
+    return -1;
+  pages = (st.st_size + page - 1) / page;
+  if ((vec = malloc(pages)) != NULL && mincore(map, st.st_size, vec) == 0)
+    for (i = 0; i < pages; i++)
+      n += vec[i] & 1;
+  else
+    n = -1;
+  free(vec);
+  munmap(map, st.st_size);
+  return n < 0 ? -1 : n * page / 1024;
+}
+
+/* Scan PATH with count_mbox() through stdio or mbox_open(), starting with
+ * the file cached or not. */
+static void cache_scan(const char *path, int fd, int use_mbox_open, int warm) {
+  int new, read, unread;
+  double t;
+  FILE *fp;
+
+  if (warm) {
+    fp = fopen(path, "r");
+    count_mbox(fp, &new, &read, &unread);
+    fclose(fp);
+  } else {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  }
+  printf("%-16s %-5s %8ld KiB", use_mbox_open ? "mbox_open" : "stdio",
+         warm ? "warm" : "cold", cached_kib(fd));
+
+  t = now_ns();
+  fp = use_mbox_open ? mbox_open(path, 1) : fopen(path, "r");
+  count_mbox(fp, &new, &read, &unread);
+  fclose(fp);
+  t = now_ns() - t;
+  printf(" %8ld KiB %9.1f ms\n", cached_kib(fd), t / 1e6);
+}
+
+static void report_cache(void) {
+  char file[] = "mailcheck-bench.XXXXXX", path[64];
+  int fd, i;
+
+  if ((fd = mkstemp(file)) == -1) {
+    perror("mailcheck-bench: mkstemp");
+    return;
+  }
+  unlink(file);
+  for (i = 0; i < CACHE_MBOX_PASSES; i++)
+    if (write(fd, mbox_data, mbox_len) != (ssize_t)mbox_len) {
+      perror("mailcheck-bench: write");
+      close(fd);
+      return;
+    }
+  fsync(fd); /* only clean pages can be dropped */
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+
+  printf("\npage cache, scanning %.1f MB:\n%-22s %12s %12s %12s\n",
+         CACHE_MBOX_PASSES * mbox_len / 1e6, "", "before", "after", "time");
+  cache_scan(path, fd, 0, 0);
+  cache_scan(path, fd, 1, 0);
+  cache_scan(path, fd, 0, 1);
+  cache_scan(path, fd, 1, 1);
+  close(fd);
+}
+
+int main(int argc, char *argv[]) {
+  const char *baseline = NULL, *only = NULL;
+  int opt, save = 0, bad = 0;
+  size_t i;
+  FILE *fp;
+
+  while ((opt = getopt(argc, argv, "b:f:s")) != -1) {
+    switch (opt) {
+    case 'b':
+      baseline = optarg;
+      break;
+    case 'f':
+      only = optarg;
+      break;
+    case 's':
+      save = 1;
+      break;
+    default:
+      fprintf(stderr, "Usage: mailcheck-bench [-s] [-b baseline] [-f name]\n");
+      return 2;
+    }
+  }
+
+  Homedir = "/nonexistent";
+  make_mbox();
+  make_maildir_names();
+  make_netrc();
+  make_urls();
+  make_paths();
+  benches[0].step = mbox_lines;
+
+  printf("%-16s %12s %10s %10s\n", "benchmark", "ns/op", "+-mad", "allocs/op");
+  for (i = 0; i < NBENCH; i++) {
+    if (only && !strstr(benches[i].name, only))
+      continue;
+    run_bench(&benches[i]);
+    printf("%-16s %12.2f %10.2f %10.3f\n", benches[i].name, benches[i].median,
+           benches[i].mad, benches[i].allocs);
+  }
+  if (!only || strstr("page_cache", only))
+    report_cache();
+
+  if (!baseline)
+    return 0;
+  if (save && only) {
+    fprintf(stderr, "mailcheck-bench: can't save a partial baseline\n");
+    return 2;
+  }
+  if (save || (fp = fopen(baseline, "r")) == NULL)
+    return save_baseline(baseline);
+  bad = compare(fp);
+  fclose(fp);
+  if (bad)
+    printf("\n%d regression%s against %s\n", bad, bad > 1 ? "s" : "",
+           baseline);
+  return bad ? 1 : 0;
+}
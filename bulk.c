@@ -0,0 +1,280 @@
+/* bulk.c -- check many remote accounts listed in a manifest
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ */
+
+/* With -B FILE ("-" for standard input), no rc file is read.  Every line of
+ * FILE names a POP3, IMAP or JMAP account by URL, as in the rc file,
+ * optionally followed by white space and the password; without one,
+ * ~/.netrc is consulted as usual.  Empty lines and lines starting with '#' are skipped.
+ *
+ * The accounts are checked by up to -j threads (BULK_JOBS by default), with
+ * no more than -m connections to any one server, and a record is printed
+ * for each mailbox as soon as it is checked:
+ *
+ *   ok <TAB> URL <TAB> new <TAB> saved
+ *   error <TAB> URL
+ *
+ * The manifest is read only as far as there is room in a buffer of
+ * PENDING_PER_JOB accounts per thread, so memory use doesn't grow with its
+ * size: the accounts come from a pool allocated up front, with room for the
+ * buffer and one being checked by each thread.  Accounts on a server that is
+ * at its limit wait in the buffer while others are checked. */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mailcheck.h"
+
+#define BULK_JOBS (16)
+#define PENDING_PER_JOB (4)
+
+struct account {
+  struct mailbox mb;
+  char pass[128];
+  char server[160];          /* "host:port" */
+  struct account *next_free; /* in the pool */
+};
+
+/* A server with connections open, and how many. */
+struct server {
+  char name[160];
+  int conns;
+};
+
+struct bulk {
+  pthread_mutex_t lock;
+  pthread_cond_t work;  /* an account was queued, or a server freed */
+  pthread_cond_t space; /* an account was taken from the queue */
+  struct account **pending;
+  int npending;
+  int size;
+  int eof;
+  struct account *pool; /* size + one per thread */
+  struct account *free;
+  struct server *server; /* one per thread at most */
+  int nservers;
+  int running;
+};
+
+static struct server *find_server(struct bulk *b, const char *name) {
+  int i;
+
+  for (i = 0; i < b->nservers; i++)
+    if (strcmp(b->server[i].name, name) == 0)
+      return &b->server[i];
+  return NULL;
+}
+
+/* Take the first pending account whose server has a connection to spare.
+ * Called with the lock held. */
+static struct account *take_account(struct bulk *b) {
+  struct server *s;
+  struct account *a;
+  int i;
+
+  for (i = 0; i < b->npending; i++) {
+    a = b->pending[i];
+    if ((s = find_server(b, a->server)) == NULL) {
+      s = &b->server[b->nservers++];
+      strcpy(s->name, a->server);
+      s->conns = 0;
+    } else if (s->conns >= (int)Options.per_server) {
+      continue;
+    }
+    s->conns++;
+    memmove(&b->pending[i], &b->pending[i + 1],
+            (b->npending - i - 1) * sizeof(*b->pending));
+    b->npending--;
+    pthread_cond_signal(&b->space);
+    return a;
+  }
+  return NULL;
+}
+
+static void release_server(struct bulk *b, const char *name) {
+  struct server *s = find_server(b, name);
+
+  if (s && --s->conns == 0)
+    *s = b->server[--b->nservers];
+  pthread_cond_broadcast(&b->work);
+}
+
+/* One printf() per record, so that records of different threads don't mix. */
+static void print_status(const struct mail_status *status, void *arg) {
+  printf("ok\t%s\t%d\t%d\n", status->path, status->new, status->saved);
+  fflush(stdout);
+  (*(int *)arg)++;
+}
+
+static void print_error(const char *path) {
+  printf("error\t%s\n", path);
+  fflush(stdout);
+}
+
+static void *bulk_thread(void *arg) {
+  struct bulk *b = arg;
+  struct account *a;
+  int reported;
+
+  pthread_mutex_lock(&b->lock);
+  for (;;) {
+    if ((a = take_account(b)) == NULL) {
+      if (b->eof && b->npending == 0)
+        break;
+      pthread_cond_wait(&b->work, &b->lock);
+      continue;
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    /* check_imap() only says if all went well, so a wildcard account may
+     * give some results and an error */
+    reported = 0;
+    check_mailbox(&a->mb, print_status, &reported);
+    if (reported == 0)
+      print_error(a->mb.path);
+
+    pthread_mutex_lock(&b->lock);
+    release_server(b, a->server);
+    a->next_free = b->free;
+    b->free = a;
+  }
+  if (--b->running == 0)
+    pthread_cond_signal(&b->space);
+  pthread_mutex_unlock(&b->lock);
+  return NULL;
+}
+
+/* Make A the account of manifest line LINE.  Returns -1, after saying why,
+ * if it isn't one. */
+static int parse_account(struct account *a, char *line, int lineno) {
+  char host[BUF_SIZE], box[BUF_SIZE], user[128] = "";
+  char *url, *pass;
+  int port, tls;
+
+  url = line + strspn(line, " \t");
+  pass = url + strcspn(url, " \t");
+  if (*pass) {
+    *pass++ = '\0';
+    pass += strspn(pass, " \t");
+  }
+  if (!is_remote(url) || strlen(url) >= BUF_SIZE ||
+      (port = parse_url(url, host, box, user, &tls)) == 0) {
+    fprintf(stderr, "mailcheck: line %d of manifest: not an account URL\n",
+            lineno);
+    print_error(url);
+    return -1;
+  }
+  memset(a, 0, sizeof(*a));
+  strcpy(a->mb.path, url);
+  a->mb.type = remote_type(url);
+  a->mb.group = 1;
+  a->mb.id = lineno;
+  if (*pass) {
+    strncpy(a->pass, pass, sizeof(a->pass) - 1);
+    a->mb.pass = a->pass;
+  }
+  snprintf(a->server, sizeof(a->server), "%.127s:%d", host, port);
+  return 0;
+}
+
+/* Check the accounts of the manifest Options.bulk_path.  Returns the exit
+ * status: 1 if the manifest can't be read, 0 otherwise. */
+int check_bulk(void) {
+  static struct bulk b = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                          PTHREAD_COND_INITIALIZER};
+  char line[BUF_SIZE + 256], *p;
+  struct account *a;
+  pthread_t tid;
+  int jobs = Options.jobs ? Options.jobs : BULK_JOBS, lineno = 0, i, c;
+  size_t len;
+  FILE *fp;
+
+  if (strcmp(Options.bulk_path, "-") == 0)
+    fp = stdin;
+  else if ((fp = fopen(Options.bulk_path, "r")) == NULL) {
+    perror(Options.bulk_path);
+    return 1;
+  }
+
+  b.size = jobs * PENDING_PER_JOB;
+  b.pending = malloc(b.size * sizeof(*b.pending));
+  b.server = malloc(jobs * sizeof(*b.server));
+  b.pool = malloc((b.size + jobs) * sizeof(*b.pool));
+  if (!b.pending || !b.server || !b.pool) {
+    fprintf(stderr, "mailcheck: out of memory\n");
+    exit(1);
+  }
+  for (i = 0; i < b.size + jobs; i++) {
+    b.pool[i].next_free = b.free;
+    b.free = &b.pool[i];
+  }
+
+  for (i = 0; i < jobs; i++) {
+    if (pthread_create(&tid, NULL, bulk_thread, &b) != 0)
+      break;
+    pthread_detach(tid);
+    b.running++;
+  }
+  if (b.running == 0) {
+    fprintf(stderr, "mailcheck: couldn't start any threads\n");
+    return 1;
+  }
+
+  while (fgets(line, sizeof(line), fp)) {
+    lineno++;
+    len = strlen(line);
+    if (len > 0 && line[len - 1] == '\n') {
+      line[--len] = '\0';
+    } else if (!feof(fp)) { /* too long: skip the rest */
+      while ((c = getc(fp)) != EOF && c != '\n')
+        ;
+      fprintf(stderr, "mailcheck: line %d of manifest is too long\n",
+              lineno);
+      continue;
+    }
+    if (len > 0 && line[len - 1] == '\r')
+      line[--len] = '\0';
+    p = line + strspn(line, " \t");
+    if (*p == '\0' || *p == '#')
+      continue;
+
+    /* while the buffer has room, so has the pool */
+    pthread_mutex_lock(&b.lock);
+    while (b.npending == b.size)
+      pthread_cond_wait(&b.space, &b.lock);
+    a = b.free;
+    b.free = a->next_free;
+    pthread_mutex_unlock(&b.lock);
+
+    if (parse_account(a, line, lineno) != 0) {
+      pthread_mutex_lock(&b.lock);
+      a->next_free = b.free;
+      b.free = a;
+      pthread_mutex_unlock(&b.lock);
+      continue;
+    }
+
+    pthread_mutex_lock(&b.lock);
+    b.pending[b.npending++] = a;
+    pthread_cond_signal(&b.work);
+    pthread_mutex_unlock(&b.lock);
+  }
+  if (fp != stdin)
+    fclose(fp);
+
+  pthread_mutex_lock(&b.lock);
+  b.eof = 1;
+  pthread_cond_broadcast(&b.work);
+  while (b.running > 0)
+    pthread_cond_wait(&b.space, &b.lock);
+  pthread_mutex_unlock(&b.lock);
+
+  free(b.pending);
+  free(b.server);
+  free(b.pool);
+  return 0;
+}
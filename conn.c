@@ -0,0 +1,267 @@
+/* conn.c -- buffered, optionally TLS protected server connections
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ */
+
+/* TLS sessions (or TLS 1.3 tickets) are kept per server in
+ * ~/.mailcheck/tls/<host>:<port>, so that the next check of the same server
+ * can skip the full handshake.  Certificates are verified against the default
+ * CA store, which may be overridden with the SSL_CERT_FILE and SSL_CERT_DIR
+ * environment variables. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#endif
+
+#include "conn.h"
+#include "mailcheck.h"
+#include "metrics.h"
+#include "probes.h"
+
+#ifdef HAVE_OPENSSL
+static SSL_CTX *ssl_ctx;
+
+/* Path of the session cache file for C. */
+static int session_file(struct conn *c, char *buf, size_t len) {
+  char name[300];
+
+  snprintf(name, sizeof(name), "%s:%d", c->host, c->port);
+  return state_file(buf, len, "tls", name);
+}
+
+/* Called by OpenSSL whenever the server hands out a new session or ticket. */
+static int save_session(SSL *ssl, SSL_SESSION *sess) {
+  struct conn *c = SSL_get_app_data(ssl);
+  char file[BUF_SIZE], tmp[BUF_SIZE + 8];
+  FILE *fp;
+
+  if (!c || session_file(c, file, sizeof(file)) != 0 ||
+      (fp = state_create(file, tmp, sizeof(tmp))) == NULL)
+    return 0;
+  state_commit(fp, tmp, file, !PEM_write_SSL_SESSION(fp, sess));
+
+  return 0; /* we did not keep a reference */
+}
+
+static SSL_SESSION *load_session(struct conn *c) {
+  char file[BUF_SIZE];
+  SSL_SESSION *sess;
+  FILE *fp;
+
+  if (session_file(c, file, sizeof(file)) != 0 ||
+      (fp = fopen(file, "r")) == NULL)
+    return NULL;
+  sess = PEM_read_SSL_SESSION(fp, NULL, NULL, NULL);
+  fclose(fp);
+
+  if (sess && !SSL_SESSION_is_resumable(sess)) {
+    SSL_SESSION_free(sess);
+    sess = NULL;
+  }
+  return sess;
+}
+
+static void new_ssl_ctx(void) {
+  if ((ssl_ctx = SSL_CTX_new(TLS_client_method())) == NULL)
+    return;
+  SSL_CTX_set_min_proto_version(ssl_ctx, TLS1_2_VERSION);
+  SSL_CTX_set_default_verify_paths(ssl_ctx);
+  SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_PEER, NULL);
+  SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_CLIENT |
+                                              SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ssl_ctx, save_session);
+}
+
+/* Servers may be checked from several threads (see any.c). */
+static int init_ssl_ctx(void) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+  pthread_once(&once, new_ssl_ctx);
+  return ssl_ctx ? 0 : -1;
+}
+#endif /* HAVE_OPENSSL */
+
+int conn_starttls(struct conn *c) {
+#ifdef HAVE_OPENSSL
+  SSL_SESSION *sess;
+  SSL *ssl;
+  long verify;
+  long long t0 = probe_ns();
+
+  if (init_ssl_ctx() != 0 || (ssl = SSL_new(ssl_ctx)) == NULL) {
+    fprintf(stderr, "mailcheck: couldn't initialize TLS\n");
+    return -1;
+  }
+  SSL_set_app_data(ssl, c);
+  SSL_set_fd(ssl, c->fd);
+  SSL_set_tlsext_host_name(ssl, c->host);
+  SSL_set1_host(ssl, c->host);
+
+  if ((sess = load_session(c)) != NULL) {
+    SSL_set_session(ssl, sess);
+    SSL_SESSION_free(sess);
+  }
+  PROBE2(cache, "tls", sess != NULL);
+  metrics_cache(CACHE_TLS, sess != NULL);
+
+  if (SSL_connect(ssl) != 1) {
+    verify = SSL_get_verify_result(ssl);
+    if (verify != X509_V_OK)
+      fprintf(stderr, "mailcheck: TLS certificate of '%s:%d' rejected: %s\n",
+              c->host, c->port, X509_verify_cert_error_string(verify));
+    else
+      fprintf(stderr, "mailcheck: TLS handshake with '%s:%d' failed\n",
+              c->host, c->port);
+    ERR_clear_error();
+    SSL_free(ssl);
+    metrics_error(ERROR_TLS);
+    return -1;
+  }
+
+  c->ssl = ssl;
+  c->resumed = SSL_session_reused(ssl);
+  c->in.start = c->in.end = 0;
+  t0 = probe_ns() - t0;
+  PROBE4(tls_handshake, c->host, c->port, c->resumed, t0);
+  metrics_phase(PHASE_TLS, t0);
+  if (Options.verbose)
+    fprintf(stderr, "mailcheck: %s:%d: %s, %s\n", c->host, c->port,
+            SSL_get_version(ssl),
+            c->resumed ? "session resumed" : "full handshake");
+  return 0;
+#else
+  fprintf(stderr, "mailcheck: no TLS support, can't secure '%s:%d'\n",
+          c->host, c->port);
+  return -1;
+#endif /* HAVE_OPENSSL */
+}
+
+struct conn *conn_open(const char *host, int port, int tls) {
+  struct conn *c;
+
+  if ((c = calloc(1, sizeof(*c))) == NULL)
+    return NULL;
+  strncpy(c->host, host, sizeof(c->host) - 1);
+  c->port = port;
+
+  if (health_check(c->host, port) != 0) {
+    free(c);
+    return NULL;
+  }
+  if ((c->fd = sock_connect(c->host, port)) < 0) {
+    health_failed(c->host, port,
+                  c->fd == -2 ? HEALTH_DNS : health_cause(errno));
+    fprintf(stderr, "mailcheck: Not Connected To Server '%s:%d'\n", host,
+            port);
+    free(c);
+    return NULL;
+  }
+  health_ok(c->host, port);
+
+  if (tls && conn_starttls(c) != 0) {
+    close(c->fd);
+    free(c);
+    return NULL;
+  }
+  return c;
+}
+
+ssize_t conn_fill(struct conn *c) {
+  size_t space;
+  char *p;
+  ssize_t n;
+
+  p = rbuf_reserve(&c->in, &space);
+  if (space == 0)
+    return -1;
+#ifdef HAVE_OPENSSL
+  if (c->ssl) {
+    n = SSL_read(c->ssl, p, space);
+    if (n <= 0)
+      return SSL_get_error(c->ssl, n) == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+  } else
+#endif
+    do {
+      n = read(c->fd, p, space);
+    } while (n == -1 && errno == EINTR);
+
+  if (n > 0)
+    rbuf_commit(&c->in, n);
+  return n;
+}
+
+int conn_wait(struct conn *c, int timeout) {
+  struct pollfd pfd;
+  int n;
+
+  if (c->in.start != c->in.end)
+    return 1;
+#ifdef HAVE_OPENSSL
+  if (c->ssl && SSL_pending(c->ssl) > 0)
+    return 1;
+#endif
+  pfd.fd = c->fd;
+  pfd.events = POLLIN;
+  do {
+    n = poll(&pfd, 1, timeout);
+  } while (n == -1 && errno == EINTR);
+  return n;
+}
+
+int conn_printf(struct conn *c, const char *fmt, ...) {
+  char buf[BUF_SIZE];
+  va_list ap;
+  int len, off, n;
+
+  va_start(ap, fmt);
+  len = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  if (len < 0 || len >= (int)sizeof(buf))
+    return -1;
+  c->sent = probe_ns();
+  PROBE3(command, c->host, c->port, len);
+
+  for (off = 0; off < len; off += n) {
+#ifdef HAVE_OPENSSL
+    if (c->ssl)
+      n = SSL_write(c->ssl, buf + off, len - off);
+    else
+#endif
+      n = write(c->fd, buf + off, len - off);
+    if (n <= 0) {
+      if (n == -1 && errno == EINTR && !c->ssl) {
+        n = 0;
+        continue;
+      }
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void conn_close(struct conn *c) {
+  if (!c)
+    return;
+#ifdef HAVE_OPENSSL
+  if (c->ssl) {
+    SSL_shutdown(c->ssl);
+    SSL_free(c->ssl);
+  }
+#endif
+  close(c->fd);
+  free(c);
+}
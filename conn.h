@@ -0,0 +1,47 @@
+/* conn.h -- buffered, optionally TLS protected server connections
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ */
+
+#ifndef _CONN_H_
+#define _CONN_H_ 1
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "proto.h"
+
+struct conn {
+  int fd;
+  void *ssl;    /* SSL *, if TLS is active */
+  int resumed;  /* TLS session was resumed from the cache */
+  char host[256];
+  int port;
+  long long sent;   /* when the last command was sent, see probes.h */
+  struct rbuf in;
+};
+
+/* Connect to HOST:PORT, starting TLS right away if TLS is set.  Returns NULL
+ * (after printing a message) on failure. */
+struct conn *conn_open(const char *host, int port, int tls);
+
+/* Start TLS on an established cleartext connection (STARTTLS/STLS). */
+int conn_starttls(struct conn *c);
+
+/* Read more data from the server into c->in.  Returns the number of bytes
+ * read, 0 on EOF and -1 on error. */
+ssize_t conn_fill(struct conn *c);
+
+/* Wait up to TIMEOUT milliseconds for data from the server.  Returns 1 if
+ * there is some (already buffered, or ready to be read), 0 on timeout and -1
+ * on error. */
+int conn_wait(struct conn *c, int timeout);
+
+/* Send a formatted command.  Returns -1 on error. */
+int conn_printf(struct conn *c, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+void conn_close(struct conn *c);
+
+#endif /* _CONN_H_ */
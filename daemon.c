@@ -0,0 +1,798 @@
+/* daemon.c -- serve cached mailbox status over a UNIX domain socket
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ */
+
+/* In daemon mode (-d, or when invoked as mailcheckd), mailcheck checks the
+ * mailboxes listed in the rc file every few seconds (-i) and keeps the
+ * results in memory.  Other mailcheck processes ask for them on a UNIX domain
+ * socket, which costs a connect and a read instead of a walk over the
+ * mailboxes.  A few threads answer them, so that a client that is slow to
+ * send its request or read the answer does not hold up the others.
+ *
+ * The protocol is line based.  The client sends
+ *
+ *   LIST <advanced>\n
+ *
+ * where <advanced> is 1 if it was started with -c.  The daemon answers with
+ * "OK\n", one line per mailbox and a terminating ".\n":
+ *
+ *   S <type> <counted> <new> <unread> <saved> <path>\n
+ *
+ * If the counting method of the daemon does not match, it answers "ERR\n"
+ * and the client checks the mailboxes itself.  The same results are also
+ * written to the snapshot file after every refresh (see snapshot.c).
+ *
+ * Each mailbox (or group of IMAP mailboxes, see struct mailbox) is checked
+ * on its own schedule, worked out from its history (see history.c): every
+ * -i seconds while mail keeps arriving, less and less often while it is
+ * quiet.  A random tenth either way keeps mailboxes on the same server from
+ * being checked in step.  The deadlines are kept in a heap, and a single
+ * timerfd wakes the refresh thread for the earliest one.  The rc file is
+ * looked at every -i seconds; if the plan changed, everything is checked
+ * again at once.
+ *
+ * An IMAP account whose server supports NOTIFY (RFC 5465) is not polled
+ * after its first check: a thread keeps a connection open on which the
+ * server announces changes to all of its mailboxes (see watch_imap()), and
+ * wakes the refresh thread through an eventfd when counts come in.  If the
+ * connection breaks, the account is polled until its next scheduled check,
+ * after which it is watched again.
+ */
+
+#define _GNU_SOURCE /* struct ucred */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "history.h"
+#include "mailcheck.h"
+#include "metrics.h"
+#include "probes.h"
+
+/* Answer to LIST, rebuilt after every refresh. */
+struct reply_buf {
+  char *data;
+  size_t len;
+  size_t size;
+};
+
+enum watch_state { WATCH_RUNNING, WATCH_DEAD, WATCH_UNSUPPORTED };
+
+/* An IMAP account watched with NOTIFY by its own thread.  The thread and
+ * the refresh thread share it under lock; whichever lets go of it last, the
+ * thread on return or the refresh thread after telling it to stop, frees
+ * it. */
+struct watch {
+  pthread_mutex_t lock;
+  struct mailbox *box;        /* copy of the group */
+  int count;
+  struct mail_status *seen;   /* latest status of each mailbox */
+  int nseen;
+  int size;
+  int dirty;                  /* seen changed since it was last looked at */
+  int stop;                   /* set by the refresh thread */
+  int state;                  /* see enum watch_state */
+};
+
+/* A group of the plan and its place in the schedule. */
+struct unit {
+  int box;                /* first mailbox of the group in plan->box */
+  long long due;          /* deadline, CLOCK_MONOTONIC nanoseconds */
+  struct history *hist;   /* NULL if out of memory */
+  struct reply_buf lines; /* "S" lines of the last check */
+  int reported;           /* tallied by unit_status() */
+  int new;
+  int total;
+  struct watch *watch;    /* NULL unless watched with NOTIFY */
+  long long watch_after;  /* don't watch again before this */
+  int no_notify;          /* the server can't be watched */
+};
+
+/* The current answer, shared by the clients being served: each holds a
+ * reference while it writes, so that a slow one holds up nobody else. */
+struct answer {
+  struct reply_buf rb;
+  int refs;
+};
+
+/* Clients accepted, waiting for a server thread. */
+#define SERVE_THREADS (4)
+#define SERVE_QUEUE (64)
+
+static pthread_mutex_t reply_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct answer *reply;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static int queue[SERVE_QUEUE];
+static int queue_head, queue_len;
+static char sockpath[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+/* Only used by the refresh thread, after run_daemon() has set them up. */
+static struct plan *plan;
+static struct unit *units;
+static int *heap; /* indexes into units, earliest deadline first */
+static int nunits, nheap;
+static struct histfile *histories;
+static struct arena history_mem = ARENA_INITIALIZER(0); /* never reset */
+static char histpath[BUF_SIZE];
+static struct snapshot *snap;
+static unsigned int seed;
+static int watch_fd = -1; /* eventfd written by watching threads */
+
+/* Find the path of the daemon socket.  Returns -1 if it does not fit. */
+int daemon_socket_path(char *buf, size_t len) {
+  char *dir = getenv("XDG_RUNTIME_DIR");
+  int n;
+
+  if (dir && *dir)
+    n = snprintf(buf, len, "%s/mailcheck.sock", dir);
+  else
+    n = snprintf(buf, len, "%s/.mailcheck.sock", Homedir);
+
+  return (n < 0 || (size_t)n >= len) ? -1 : 0;
+}
+
+static void reply_append(struct reply_buf *rb, const char *s, size_t len) {
+  if (rb->len + len > rb->size) {
+    size_t size = rb->size ? rb->size * 2 : 4096;
+    char *p;
+
+    while (size < rb->len + len)
+      size *= 2;
+    if ((p = realloc(rb->data, size)) == NULL) {
+      fprintf(stderr, "mailcheck: out of memory\n");
+      exit(1);
+    }
+    rb->data = p;
+    rb->size = size;
+  }
+  memcpy(rb->data + rb->len, s, len);
+  rb->len += len;
+}
+
+static void append_status(const struct mail_status *status, void *arg) {
+  char line[BUF_SIZE + 64];
+  int n;
+
+  n = snprintf(line, sizeof(line), "S %d %d %d %d %d %s\n", status->type,
+               status->counted, status->new, status->unread, status->saved,
+               status->path);
+  if (n > 0 && (size_t)n < sizeof(line))
+    reply_append(arg, line, n);
+}
+
+/* Parse a status LINE of the answer, without its newline.  Returns -1 if it
+ * isn't one. */
+static int parse_status(const char *line, struct mail_status *status) {
+  int len;
+
+  memset(status, 0, sizeof(*status));
+  status->size = -1;
+  if (sscanf(line, "S %d %d %d %d %d %n", &status->type, &status->counted,
+             &status->new, &status->unread, &status->saved, &len) != 5)
+    return -1;
+  strncpy(status->path, line + len, sizeof(status->path) - 1);
+  return 0;
+}
+
+static void remove_socket(int sig) {
+  unlink(sockpath);
+  _exit(sig == SIGTERM || sig == SIGINT ? 0 : 1);
+}
+
+static void heap_push(int u) {
+  int i, parent;
+
+  for (i = nheap++; i > 0; i = parent) {
+    parent = (i - 1) / 2;
+    if (units[heap[parent]].due <= units[u].due)
+      break;
+    heap[i] = heap[parent];
+  }
+  heap[i] = u;
+}
+
+static int heap_pop(void) {
+  int top = heap[0], last = heap[--nheap];
+  int i = 0, child;
+
+  while ((child = 2 * i + 1) < nheap) {
+    if (child + 1 < nheap && units[heap[child + 1]].due < units[heap[child]].due)
+      child++;
+    if (units[last].due <= units[heap[child]].due)
+      break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  if (nheap > 0)
+    heap[i] = last;
+  return top;
+}
+
+static void watch_free(struct watch *w) {
+  pthread_mutex_destroy(&w->lock);
+  free(w->box);
+  free(w->seen);
+  free(w);
+}
+
+/* Remember the status of one watched mailbox, and wake the refresh thread. */
+static void watch_status(const struct mail_status *status, void *arg) {
+  struct watch *w = arg;
+  struct mail_status *seen;
+  uint64_t one = 1;
+  int i;
+
+  pthread_mutex_lock(&w->lock);
+  for (i = 0; i < w->nseen; i++)
+    if (strcmp(w->seen[i].path, status->path) == 0)
+      break;
+  if (i == w->size) {
+    w->size = w->size ? 2 * w->size : 8;
+    if ((seen = realloc(w->seen, w->size * sizeof(*seen))) == NULL) {
+      fprintf(stderr, "mailcheck: out of memory\n");
+      exit(1);
+    }
+    w->seen = seen;
+  }
+  if (i == w->nseen)
+    w->nseen++;
+  w->seen[i] = *status;
+  w->dirty = 1;
+  pthread_mutex_unlock(&w->lock);
+
+  write(watch_fd, &one, sizeof(one));
+}
+
+static void *watch_thread(void *arg) {
+  struct watch *w = arg;
+  struct mail_status status;
+  uint64_t one = 1;
+  int r, stopped;
+
+  memset(&status, 0, sizeof(status));
+  status.type = MB_IMAP;
+  status.size = -1;
+  r = watch_imap(w->box, w->count, &status, watch_status, w, &w->stop);
+
+  pthread_mutex_lock(&w->lock);
+  w->state = r == 1 ? WATCH_UNSUPPORTED : WATCH_DEAD;
+  stopped = w->stop;
+  pthread_mutex_unlock(&w->lock);
+  if (stopped)
+    watch_free(w);
+  else
+    write(watch_fd, &one, sizeof(one));
+  return NULL;
+}
+
+/* Start watching the account of U, whose "S" lines are the counts to start
+ * from. */
+static void watch_start(struct unit *u) {
+  const struct mailbox *mb = &plan->box[u->box];
+  struct mail_status status;
+  struct watch *w;
+  const char *line, *end;
+  char buf[BUF_SIZE + 64];
+  pthread_attr_t attr;
+  pthread_t tid;
+
+  if ((w = calloc(1, sizeof(*w))) == NULL ||
+      (w->box = malloc(mb->group * sizeof(*w->box))) == NULL) {
+    fprintf(stderr, "mailcheck: out of memory\n");
+    exit(1);
+  }
+  pthread_mutex_init(&w->lock, NULL);
+  memcpy(w->box, mb, mb->group * sizeof(*w->box));
+  w->count = mb->group;
+  w->state = WATCH_RUNNING;
+
+  for (line = u->lines.data; line && line < u->lines.data + u->lines.len;
+       line = end + 1) {
+    end = memchr(line, '\n', u->lines.data + u->lines.len - line);
+    if ((size_t)(end - line) < sizeof(buf)) {
+      memcpy(buf, line, end - line);
+      buf[end - line] = '\0';
+      if (parse_status(buf, &status) == 0)
+        watch_status(&status, w);
+    }
+  }
+  w->dirty = 0;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&tid, &attr, watch_thread, w) != 0) {
+    watch_free(w);
+    w = NULL;
+  }
+  pthread_attr_destroy(&attr);
+  u->watch = w;
+  if (w && Options.verbose)
+    fprintf(stderr, "mailcheck: %s: watching with NOTIFY\n", mb->path);
+}
+
+/* Tell the thread watching W to let go of it. */
+static void watch_stop(struct watch *w) {
+  int done;
+
+  pthread_mutex_lock(&w->lock);
+  w->stop = 1;
+  done = w->state != WATCH_RUNNING;
+  pthread_mutex_unlock(&w->lock);
+  if (done)
+    watch_free(w);
+}
+
+/* Take in what the watch of U has seen, and drop the watch if its thread
+ * has given up by NOW: U is then polled again from its next deadline on. */
+static void watch_collect(struct unit *u, long long now) {
+  struct watch *w = u->watch;
+  int i, state;
+
+  pthread_mutex_lock(&w->lock);
+  state = w->state;
+  if (w->dirty) {
+    u->lines.len = 0;
+    for (i = 0; i < w->nseen; i++)
+      append_status(&w->seen[i], &u->lines);
+    w->dirty = 0;
+  }
+  pthread_mutex_unlock(&w->lock);
+  if (state == WATCH_RUNNING)
+    return;
+
+  if (state == WATCH_UNSUPPORTED)
+    u->no_notify = 1;
+  if (Options.verbose)
+    fprintf(stderr, "mailcheck: %s: %s, polling\n", plan->box[u->box].path,
+            state == WATCH_UNSUPPORTED ? "no NOTIFY" : "watch lost");
+  watch_free(w);
+  u->watch = NULL;
+  u->watch_after = now + Options.interval * 1000000000LL;
+}
+
+static int same_plan(const struct plan *a, const struct plan *b) {
+  int i;
+
+  if (a->count != b->count)
+    return 0;
+  for (i = 0; i < a->count; i++)
+    if (a->box[i].type != b->box[i].type ||
+        a->box[i].group != b->box[i].group ||
+        strcmp(a->box[i].path, b->box[i].path) != 0)
+      return 0;
+  return 1;
+}
+
+/* Read the plan, and if it is new, schedule all of its groups for NOW. */
+static void load_plan(long long now) {
+  struct plan *p = plan_load();
+  int i, n = 0;
+
+  if (plan && same_plan(plan, p)) {
+    plan_free(p);
+    return;
+  }
+
+  for (i = 0; i < nunits; i++) {
+    if (units[i].watch)
+      watch_stop(units[i].watch);
+    free(units[i].lines.data);
+  }
+  free(units);
+  free(heap);
+  plan_free(plan);
+  plan = p;
+
+  units = calloc(plan->count, sizeof(*units));
+  heap = malloc(plan->count * sizeof(*heap));
+  if (plan->count > 0 && (!units || !heap)) {
+    fprintf(stderr, "mailcheck: out of memory\n");
+    exit(1);
+  }
+  nheap = 0;
+  for (i = 0; i < plan->count; i += plan->box[i].group) {
+    units[n].box = i;
+    units[n].due = now;
+    units[n].hist = history_get(histories, plan->box[i].path);
+    heap_push(n++);
+  }
+  nunits = n;
+  metrics_forget();
+}
+
+static void unit_status(const struct mail_status *status, void *arg) {
+  struct unit *u = arg;
+
+  append_status(status, &u->lines);
+  u->reported = 1;
+  u->new += status->new;
+  u->total += status->new + status->unread + status->saved;
+}
+
+/* Check the mailboxes of U and work out when to check them again. */
+static void check_unit(struct unit *u) {
+  long long start = probe_ns(), end;
+  unsigned int secs = Options.interval;
+
+  u->lines.len = 0;
+  u->reported = u->new = u->total = 0;
+  check_mailbox(&plan->box[u->box], unit_status, u);
+  end = probe_ns();
+
+  if (u->hist) {
+    history_add(u->hist, time(NULL), end - start, u->reported ? u->new : -1,
+                u->total);
+    secs = history_interval(u->hist, Options.interval);
+  }
+  u->due = end + (long long)(secs * 1e9 *
+                             (0.9 + 0.2 * rand_r(&seed) / RAND_MAX));
+  if (Options.verbose)
+    fprintf(stderr, "mailcheck: %s: next check in %.1fs\n",
+            plan->box[u->box].path, (u->due - end) / 1e9);
+}
+
+/* Save the statuses of the answer RB to the snapshot file. */
+static void save_snapshot(const struct reply_buf *rb) {
+  struct mail_status status;
+  const char *line, *end;
+  char buf[BUF_SIZE + 64];
+
+  snapshot_clear(snap);
+  for (line = rb->data + 3; *line == 'S'; line = end + 1) {
+    end = memchr(line, '\n', rb->data + rb->len - line);
+    if ((size_t)(end - line) < sizeof(buf)) {
+      memcpy(buf, line, end - line);
+      buf[end - line] = '\0';
+      if (parse_status(buf, &status) == 0)
+        snapshot_status(&status, snap);
+    }
+  }
+  if (snapshot_write(snap) != 0)
+    fprintf(stderr, "mailcheck: couldn't write the snapshot\n");
+}
+
+/* Let go of a reference to A. */
+static void answer_put(struct answer *a) {
+  int last;
+
+  if (!a)
+    return;
+  pthread_mutex_lock(&reply_lock);
+  last = --a->refs == 0;
+  pthread_mutex_unlock(&reply_lock);
+  if (last) {
+    free(a->rb.data);
+    free(a);
+  }
+}
+
+/* Check everything that is due at NOW and replace the cached answer. */
+static void run_due(long long now) {
+  struct reply_buf rb = {NULL, 0, 0};
+  struct answer *a, *old;
+  int i, u;
+
+  metrics_begin();
+  for (i = 0; i < nunits; i++)
+    if (units[i].watch)
+      watch_collect(&units[i], now);
+
+  while (nheap > 0 && units[heap[0]].due <= now) {
+    struct unit *un = &units[u = heap_pop()];
+
+    if (un->watch) { /* nothing to poll, look again later */
+      un->due = now + Options.interval * 1000000000LL;
+    } else {
+      check_unit(un);
+      if (plan->box[un->box].type == MB_IMAP && un->reported &&
+          !un->no_notify && watch_fd != -1 && un->watch_after <= now)
+        watch_start(un);
+    }
+    heap_push(u);
+  }
+
+  reply_append(&rb, "OK\n", 3);
+  for (i = 0; i < nunits; i++)
+    if (units[i].lines.len > 0)
+      reply_append(&rb, units[i].lines.data, units[i].lines.len);
+  reply_append(&rb, ".\n", 2);
+  save_snapshot(&rb);
+
+  if ((a = malloc(sizeof(*a))) == NULL) {
+    fprintf(stderr, "mailcheck: out of memory\n");
+    exit(1);
+  }
+  a->rb = rb;
+  a->refs = 1;
+  pthread_mutex_lock(&reply_lock);
+  old = reply;
+  reply = a;
+  pthread_mutex_unlock(&reply_lock);
+  answer_put(old);
+
+  if (*histpath && history_save(histories, histpath) != 0)
+    fprintf(stderr, "mailcheck: couldn't save '%s'\n", histpath);
+  metrics_write();
+}
+
+/* Load the plan and check all mailboxes for the first time. */
+static void start_schedule(void) {
+  long long now = probe_ns();
+
+  seed = getpid() ^ now;
+  snap = snapshot_new();
+  if (state_path(histpath, sizeof(histpath), NULL, "history") != 0)
+    histpath[0] = '\0';
+  histories = history_open(histpath, &history_mem);
+  if ((watch_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+    perror("mailcheck: eventfd"); /* then everything is polled */
+  load_plan(now);
+  run_due(now);
+}
+
+static void *refresh_thread(void *arg) {
+  long long due, next_plan, now;
+  struct itimerspec its;
+  struct pollfd pfd[2];
+  uint64_t expired;
+  int tfd;
+
+  (void)arg;
+  if ((tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) == -1) {
+    perror("mailcheck: timerfd_create");
+    remove_socket(0);
+  }
+
+  next_plan = probe_ns() + Options.interval * 1000000000LL;
+  for (;;) {
+    due = next_plan;
+    if (nheap > 0 && units[heap[0]].due < due)
+      due = units[heap[0]].due;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = due / 1000000000;
+    its.it_value.tv_nsec = due % 1000000000;
+    if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) != 0)
+      continue;
+
+    /* woken by the timer, or by a watch with news */
+    pfd[0].fd = tfd;
+    pfd[1].fd = watch_fd;
+    pfd[0].events = pfd[1].events = POLLIN;
+    if (poll(pfd, watch_fd == -1 ? 1 : 2, -1) <= 0)
+      continue;
+    if (pfd[0].revents & POLLIN)
+      read(tfd, &expired, sizeof(expired));
+    if (watch_fd != -1 && (pfd[1].revents & POLLIN))
+      read(watch_fd, &expired, sizeof(expired));
+
+    now = probe_ns();
+    if (now >= next_plan) {
+      load_plan(now);
+      next_plan = now + Options.interval * 1000000000LL;
+    }
+    run_due(now);
+  }
+  return NULL;
+}
+
+/* Answer one client.  The socket has short timeouts, so a stuck client can
+ * not hold up its server thread for long. */
+static void serve_client(int fd) {
+  struct answer *a;
+  char req[64];
+  ssize_t n;
+  int counted;
+
+#ifdef SO_PEERCRED
+  struct ucred cred;
+  socklen_t credlen = sizeof(cred);
+
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) != 0 ||
+      (cred.uid != getuid() && cred.uid != 0))
+    return;
+#endif
+
+  n = read(fd, req, sizeof(req) - 1);
+  if (n <= 0)
+    return;
+  req[n] = '\0';
+
+  if (sscanf(req, "LIST %d", &counted) != 1) {
+    write(fd, "ERR\n", 4);
+    return;
+  }
+  if (counted != Options.advanced_count) {
+    write(fd, "ERR\n", 4);
+    return;
+  }
+
+  pthread_mutex_lock(&reply_lock);
+  a = reply;
+  a->refs++;
+  pthread_mutex_unlock(&reply_lock);
+  write(fd, a->rb.data, a->rb.len);
+  answer_put(a);
+}
+
+/* Serve the clients that the accepting thread queues. */
+static void *serve_thread(void *arg) {
+  int fd;
+
+  (void)arg;
+  for (;;) {
+    pthread_mutex_lock(&queue_lock);
+    while (queue_len == 0)
+      pthread_cond_wait(&queue_cond, &queue_lock);
+    fd = queue[queue_head];
+    queue_head = (queue_head + 1) % SERVE_QUEUE;
+    queue_len--;
+    pthread_mutex_unlock(&queue_lock);
+
+    serve_client(fd);
+    close(fd);
+  }
+  return NULL;
+}
+
+/* Run as daemon.  Does not return unless the socket could not be set up. */
+int run_daemon(void) {
+  struct sockaddr_un addr;
+  struct timeval tv = {0, 200000};
+  pthread_t tid;
+  int i, lfd, fd;
+
+  if (daemon_socket_path(sockpath, sizeof(sockpath)) != 0) {
+    fprintf(stderr, "mailcheck: socket path too long\n");
+    return 1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, sockpath);
+
+  if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+    perror("mailcheck: socket");
+    return 1;
+  }
+
+  /* Refuse to steal the socket of a running daemon, remove a stale one. */
+  if (connect(lfd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+    fprintf(stderr, "mailcheck: daemon already running on %s\n", sockpath);
+    close(lfd);
+    return 1;
+  }
+  close(lfd);
+  unlink(sockpath);
+
+  /* Fill the cache before anybody can ask. */
+  start_schedule();
+
+  if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+    perror("mailcheck: socket");
+    return 1;
+  }
+  umask(077);
+  if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(lfd, 128) != 0) {
+    fprintf(stderr, "mailcheck: couldn't listen on %s: %s\n", sockpath,
+            strerror(errno));
+    close(lfd);
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGTERM, remove_socket);
+  signal(SIGINT, remove_socket);
+  signal(SIGHUP, remove_socket);
+
+  if (pthread_create(&tid, NULL, refresh_thread, NULL) != 0) {
+    fprintf(stderr, "mailcheck: couldn't start refresh thread\n");
+    remove_socket(0);
+  }
+  for (i = 0; i < SERVE_THREADS; i++)
+    if (pthread_create(&tid, NULL, serve_thread, NULL) != 0) {
+      fprintf(stderr, "mailcheck: couldn't start server threads\n");
+      remove_socket(0);
+    }
+
+  for (;;) {
+    if ((fd = accept(lfd, NULL, NULL)) == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      perror("mailcheck: accept");
+      remove_socket(0);
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    /* if every server thread is stuck, the client checks by itself */
+    pthread_mutex_lock(&queue_lock);
+    if (queue_len < SERVE_QUEUE) {
+      queue[(queue_head + queue_len++) % SERVE_QUEUE] = fd;
+      pthread_cond_signal(&queue_cond);
+      fd = -1;
+    }
+    pthread_mutex_unlock(&queue_lock);
+    if (fd != -1)
+      close(fd);
+  }
+}
+
+/* Ask a running daemon for the status of all mailboxes and pass each one to
+ * FN.  Returns 0 on success and -1 if there is no usable daemon, in which case
+ * FN has not been called. */
+int query_daemon(status_fn fn, void *arg) {
+  struct sockaddr_un addr;
+  struct timeval tv = {1, 0};
+  struct reply_buf rb = {NULL, 0, 0};
+  struct mail_status status;
+  char buf[4096], *line, *end;
+  ssize_t n;
+  int fd, len, retval = -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (daemon_socket_path(addr.sun_path, sizeof(addr.sun_path)) != 0)
+    return -1;
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+    return -1;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+  len = snprintf(buf, sizeof(buf), "LIST %d\n", Options.advanced_count);
+  if (write(fd, buf, len) != len) {
+    close(fd);
+    return -1;
+  }
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+    reply_append(&rb, buf, n);
+  close(fd);
+  if (n < 0)
+    goto out;
+
+  /* Only use a complete answer, so that nothing is reported twice if we have
+   * to fall back to checking the mailboxes ourselves. */
+  reply_append(&rb, "", 1);
+  if (rb.len < 6 || strncmp(rb.data, "OK\n", 3) != 0 ||
+      strcmp(rb.data + rb.len - 4, "\n.\n") != 0)
+    goto out;
+
+  for (line = rb.data + 3; *line != '.'; line = end + 1) {
+    end = strchr(line, '\n');
+    *end = '\0';
+    if (parse_status(line, &status) != 0)
+      goto out;
+    fn(&status, arg);
+  }
+  retval = 0;
+
+out:
+  free(rb.data);
+  PROBE2(cache, "daemon", retval == 0);
+  metrics_cache(CACHE_DAEMON, retval == 0);
+  return retval;
+}
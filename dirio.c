@@ -0,0 +1,49 @@
+/* dirio.c -- read directories without the heap
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ */
+
+/* opendir() takes a buffer of 32 KiB from the heap for every directory, so
+ * a run over many maildirs made a few heap calls for each of them.  A
+ * struct dir_stream carries its buffer instead, and lives on the stack of
+ * the scan; getdents64() fills it directly.  Its records are the kernel's
+ * struct linux_dirent64, which struct dir_entry spells out. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "mailcheck.h"
+
+/* Open the directory PATH into D.  Returns -1 if it can't be read. */
+int dir_open(struct dir_stream *d, const char *path) {
+  d->pos = d->len = 0;
+  d->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  return d->fd == -1 ? -1 : 0;
+}
+
+/* The next entry of D, or NULL at the end or on error. */
+struct dir_entry *dir_read(struct dir_stream *d) {
+  struct dir_entry *e;
+  long n;
+
+  if (d->pos >= d->len) {
+    do
+      n = syscall(SYS_getdents64, d->fd, d->buf, sizeof(d->buf));
+    while (n == -1 && errno == EINTR);
+    if (n <= 0)
+      return NULL;
+    d->len = n;
+    d->pos = 0;
+  }
+  e = (struct dir_entry *)(d->buf + d->pos);
+  d->pos += e->d_reclen;
+  return e;
+}
+
+void dir_close(struct dir_stream *d) {
+  close(d->fd);
+}
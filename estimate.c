@@ -0,0 +1,242 @@
+/* estimate.c -- approximate counts for very large local mailboxes
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ */
+
+/* With -e BUDGET, a local mailbox that can't be read within BUDGET bytes is
+ * sampled instead, and the counts are reported as estimates with a 95%
+ * confidence margin.
+ *
+ * An mbox is cut into SAMPLES strata of equal size, and a range of
+ * BUDGET/SAMPLES bytes at a random place in each one is read.  Reading
+ * starts at the first line beginning with "From " and takes in the messages
+ * that start within the range, classified like count_mbox() does.  The
+ * number of messages is extrapolated from their density in the ranges, and
+ * the split into new and unread from the sampled messages.
+ *
+ * In a maildir, the entries are read until the names read would take BUDGET
+ * bytes of directory blocks.  The total is extrapolated from the size of the
+ * directory and the average size of a directory entry, allowing for the room
+ * left in the blocks of an indexed directory, and the flags of the entries
+ * read in cur/ stand for all of them; ext4 and XFS return entries in hash
+ * order, so they make a fair sample.  new/ and cur/ share the budget, new/
+ * first.  Entries are not stat()ed, and the size of a directory means
+ * different things to different file systems, so the margin of the unread
+ * count only covers the sampling of flags, and that of the new count is just
+ * the part that was extrapolated.
+ *
+ * A sample that finds nothing to go by (no message starting in the ranges of
+ * an mbox, no entry of a maildir within the budget) makes the counts unknown,
+ * with a margin of -1: counting them exactly would read the whole mailbox. */
+
+#include <dirent.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include "mailcheck.h"
+#include "metrics.h"
+
+#define SAMPLES (32)
+#define MIN_SAMPLE (65536) /* bytes; fewer samples if the budget is small */
+#define Z95 (1.96)
+#define TMPFS_MAGIC (0x01021994)
+#define TMPFS_DIRENT (20) /* what tmpfs adds to the size of a directory */
+#define HTREE_FILL (0.7)  /* how full the blocks of a large ext4 directory are */
+
+/* Margin of COUNT = P * TOTAL, where P is a proportion of N sampled items and
+ * TOTAL has the standard error TOTAL_SE. */
+static int margin(double p, int n, double total, double total_se) {
+  double var = 0;
+
+  if (n > 0)
+    var = total * total * p * (1 - p) / n;
+  var += p * p * total_se * total_se;
+  return (int)ceil(Z95 * sqrt(var));
+}
+
+/* Read the messages of MBOX starting in [OFF, END).  Returns the number of
+ * messages found, adding their classification to COUNT. */
+static int sample_mbox(FILE *mbox, off_t off, off_t end, int count[3]) {
+  char linebuf[BUF_SIZE];
+  int in_header = 0, n = 0, status = MSG_NEW;
+  off_t pos;
+
+  if (fseeko(mbox, off, SEEK_SET) != 0)
+    return 0;
+  /* resync on the next line that starts with "From " */
+  if (off > 0 && !fgets(linebuf, sizeof(linebuf), mbox))
+    return 0;
+
+  for (;;) {
+    pos = ftello(mbox);
+    if (!fgets(linebuf, sizeof(linebuf), mbox))
+      break;
+    if (!in_header) {
+      if (pos >= end)
+        break;
+      if (strncmp(linebuf, "From ", 5) == 0) {
+        in_header = 1;
+        status = MSG_NEW;
+        n++;
+      }
+    } else if (linebuf[0] == '\n') {
+      in_header = 0;
+      count[status]++;
+    } else if (strncmp(linebuf, "Status: ", 8) == 0) {
+      status = mbox_status(linebuf);
+    }
+  }
+  if (in_header)
+    count[status]++;
+  metrics_scanned(ftello(mbox) - off, 0);
+  return n;
+}
+
+/* Estimate the messages of the mbox PATH, SIZE bytes long.  Returns -1 if it
+ * can't be read, 1 if it is small enough to be counted exactly instead. */
+int estimate_mbox(const char *path, off_t size, struct mail_status *status) {
+  int count[3] = {0, 0, 0}, samples, i, n, total_n = 0;
+  double density[SAMPLES], sum = 0, var = 0, total, se;
+  off_t chunk, stratum, off;
+  unsigned int seed = getpid() ^ size;
+  FILE *mbox;
+
+  if (size <= Options.estimate)
+    return 1;
+  if ((mbox = mbox_open(path, 0)) == NULL) {
+    fprintf(stderr, "mailcheck: unable to open mbox %s\n", path);
+    metrics_error(ERROR_OPEN);
+    return -1;
+  }
+
+  samples = Options.estimate / MIN_SAMPLE;
+  if (samples > SAMPLES)
+    samples = SAMPLES;
+  if (samples < 2)
+    samples = 2;
+  chunk = Options.estimate / samples;
+  stratum = size / samples;
+
+  for (i = 0; i < samples; i++) {
+    off = i * stratum;
+    if (stratum > chunk)
+      off += (off_t)((double)rand_r(&seed) / RAND_MAX * (stratum - chunk));
+    n = sample_mbox(mbox, off, off + chunk, count);
+    total_n += n;
+    density[i] = (double)n / chunk;
+    sum += density[i];
+  }
+  fclose(mbox);
+
+  status->estimated = 1;
+  /* Messages larger than the ranges leave nothing to extrapolate from. */
+  if (total_n == 0) {
+    status->new_margin = status->unread_margin = -1;
+    return 0;
+  }
+
+  for (i = 0; i < samples; i++)
+    var += (density[i] - sum / samples) * (density[i] - sum / samples);
+  total = size * sum / samples;
+  se = size * sqrt(var / (samples - 1) / samples);
+
+  status->new = (int)(total * count[MSG_NEW] / total_n + 0.5);
+  status->unread = (int)(total * count[MSG_UNREAD] / total_n + 0.5);
+  status->new_margin =
+      margin((double)count[MSG_NEW] / total_n, total_n, total, se);
+  status->unread_margin =
+      margin((double)count[MSG_UNREAD] / total_n, total_n, total, se);
+  return 0;
+}
+
+/* Read the directory DIR within *BUDGET bytes, and take what was read off
+ * it.  Sets *TOTAL to the (estimated) number of entries, -1 if the budget
+ * ran out before any was read, and, if FLAGS is not NULL, adds the flags of
+ * the entries read to FLAGS[0] (unseen) and FLAGS[1] (seen).  Returns the
+ * number of entries read, or -1 if DIR can't be read. */
+static int sample_dir(const char *dir, long long *budget, double *total,
+                      int flags[2]) {
+  struct dir_stream d;
+  struct dir_entry *entry;
+  struct statfs sfs;
+  struct stat st;
+  long long bytes = 0;
+  int n = 0, f, complete = 1;
+
+  if (dir_open(&d, dir) != 0)
+    return -1;
+  while ((entry = dir_read(&d))) {
+    /* an ext4 directory entry: 8 bytes and the name, padded to 4 bytes */
+    size_t len = strlen(entry->d_name);
+
+    if (bytes + 8 + ((len + 3) & ~3) > *budget) {
+      complete = 0;
+      break;
+    }
+    bytes += 8 + ((len + 3) & ~3);
+    if (entry->d_name[0] == '.')
+      continue;
+    if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_REG)
+      continue;
+    n++;
+    if (flags && (f = maildir_flags(entry->d_name)) >= 0)
+      flags[f]++;
+  }
+
+  *total = n;
+  if (!complete && n == 0)
+    *total = -1;
+  else if (!complete && fstat(d.fd, &st) == 0 && st.st_size > 0) {
+    if (fstatfs(d.fd, &sfs) == 0 && sfs.f_type == TMPFS_MAGIC)
+      *total = (double)st.st_size / TMPFS_DIRENT - 2;
+    else
+      *total = (double)n * st.st_size / bytes * HTREE_FILL;
+    if (*total < n)
+      *total = n;
+  }
+  dir_close(&d);
+  *budget -= bytes;
+  metrics_scanned(0, n);
+  return n;
+}
+
+/* Estimate the messages of the maildir PATH.  Returns -1 if it isn't a
+ * maildir, 1 if it is small enough to be counted exactly instead. */
+int estimate_maildir(const char *path, struct mail_status *status) {
+  char dir[BUF_SIZE];
+  long long budget = Options.estimate;
+  double new, cur;
+  int flags[2] = {0, 0}, n, read_new, read_cur;
+
+  snprintf(dir, sizeof(dir), "%s/new", path);
+  if ((read_new = sample_dir(dir, &budget, &new, NULL)) < 0)
+    return -1;
+  snprintf(dir, sizeof(dir), "%s/cur", path);
+  if ((read_cur = sample_dir(dir, &budget, &cur, flags)) < 0)
+    return -1;
+  if (read_new == new && read_cur == cur)
+    return 1;
+
+  status->estimated = 1;
+  /* too small a budget to read a single entry of new/ */
+  if (new < 0) {
+    status->new_margin = status->unread_margin = -1;
+    return 0;
+  }
+  status->new = (int)(new + 0.5);
+  status->new_margin = status->new - read_new;
+  if ((n = flags[0] + flags[1]) > 0) {
+    status->unread = (int)(cur * flags[0] / n + 0.5);
+    status->unread_margin = margin((double)flags[0] / n, n, cur, 0);
+  } else if (cur != 0) {
+    status->unread_margin = -1; /* nothing to go by */
+  }
+  return 0;
+}
@@ -0,0 +1,280 @@
+/* health.c -- stop trying servers that are known to be down
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ */
+
+/* A server that is down costs every check a wait for the connection to
+ * fail, and prints the same errors each time.  So the failures of each
+ * server are kept in ~/.mailcheck/servers/<host>:<port>, shared by all
+ * mailcheck processes: how many there were in a row, of what kind, and when
+ * to try again.  This is a circuit breaker:
+ *
+ *   - closed (no file): connections are made as usual;
+ *   - open: after a failure, the server is skipped at once with a short
+ *     note, for RETRY_MIN seconds, twice as long after each further
+ *     failure, up to RETRY_MAX;
+ *   - half open: when that time has come, one check claims the retry,
+ *     counting it as one more failure, so that the others keep skipping
+ *     for twice as long.  The server is probed by a thread in the
+ *     background, with just a TCP connection, while the check that claimed
+ *     it skips it too.  A probe that never gets an answer (of a server
+ *     whose packets are dropped) is thus counted without having to finish.
+ *
+ * Only the server itself is judged: a refused login is the business of one
+ * account, and is reported without skipping anything.  The files are read
+ * and written under a lock, so that only one process claims the retry.
+ *
+ * The breaker closes on the first success.  Before exit, health_wait()
+ * gives the probes still running PROBE_GRACE milliseconds to finish, long
+ * enough for a server that is back, while one that still doesn't answer is
+ * left to time out. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mailcheck.h"
+
+#define HEALTH_MAGIC "MCSRV1"
+#define RETRY_MIN (30)      /* seconds */
+#define RETRY_MAX (30 * 60) /* seconds */
+#define PROBE_GRACE (500)   /* milliseconds */
+
+static const char *cause_name[HEALTH_COUNT] = {"dns", "refused", "timeout",
+                                               "connect"};
+
+/* What ~/.mailcheck/servers/ remembers of a server. */
+struct health {
+  int failures; /* in a row */
+  int cause;    /* of the last one, see enum health_cause */
+  time_t retry; /* when to try again */
+};
+
+/* A background probe. */
+struct probe {
+  char host[256];
+  int port;
+  char file[BUF_SIZE]; /* named before, as Homedir is gone by exit */
+};
+
+static pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t probe_done = PTHREAD_COND_INITIALIZER;
+static int probes; /* running */
+
+/* Take the lock of ~/.mailcheck/servers/, the directory of the server file
+ * FILE.  Returns the file descriptor to close to release it, or -1. */
+static int lock_health(const char *file) {
+  char lock[BUF_SIZE + 8];
+  const char *slash = strrchr(file, '/');
+  int fd;
+
+  if (!slash)
+    return -1;
+  snprintf(lock, sizeof(lock), "%.*s/.lock", (int)(slash - file), file);
+  if ((fd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1)
+    return -1;
+  while (flock(fd, LOCK_EX) == -1)
+    if (errno != EINTR) {
+      close(fd);
+      return -1;
+    }
+  return fd;
+}
+
+static void unlock_health(int fd) {
+  if (fd != -1)
+    close(fd);
+}
+
+/* Name of the file of HOST:PORT. */
+static int health_path(const char *host, int port, char *buf, size_t len) {
+  char name[300];
+
+  snprintf(name, sizeof(name), "%s:%d", host, port);
+  return state_file(buf, len, "servers", name);
+}
+
+static int load_health(const char *file, struct health *h) {
+  char cause[16];
+  long long retry;
+  FILE *fp;
+  int n;
+
+  if ((fp = fopen(file, "r")) == NULL)
+    return -1;
+  n = fscanf(fp, HEALTH_MAGIC " %d %15s %lld", &h->failures, cause, &retry);
+  fclose(fp);
+  if (n != 3)
+    return -1;
+  for (h->cause = 0; h->cause < HEALTH_COUNT; h->cause++)
+    if (!strcmp(cause, cause_name[h->cause]))
+      break;
+  if (h->cause == HEALTH_COUNT)
+    return -1;
+  h->retry = retry;
+  return 0;
+}
+
+static void save_health(const char *file, const struct health *h) {
+  char tmp[BUF_SIZE + 8];
+  FILE *fp;
+
+  if ((fp = state_create(file, tmp, sizeof(tmp))) == NULL)
+    return;
+  fprintf(fp, HEALTH_MAGIC " %d %s %lld\n", h->failures,
+          cause_name[h->cause], (long long)h->retry);
+  state_commit(fp, tmp, file, 0);
+}
+
+/* Close the breaker of the server file FILE. */
+static void clear_health(const char *file) {
+  int lock;
+
+  if (access(file, F_OK) != 0)
+    return;
+  lock = lock_health(file);
+  unlink(file);
+  unlock_health(lock);
+}
+
+/* Count one more failure of H, and put off the next try. */
+static void backoff(struct health *h) {
+  int shift;
+
+  h->failures++;
+  shift = h->failures - 1 < 10 ? h->failures - 1 : 10;
+  h->retry = time(NULL) + (RETRY_MIN << shift < RETRY_MAX ? RETRY_MIN << shift
+                                                          : RETRY_MAX);
+}
+
+/* Wait a little for the probes still running. */
+void health_wait(void) {
+  struct timespec until;
+
+  clock_gettime(CLOCK_REALTIME, &until);
+  until.tv_nsec += PROBE_GRACE * 1000000L;
+  until.tv_sec += until.tv_nsec / 1000000000L;
+  until.tv_nsec %= 1000000000L;
+  pthread_mutex_lock(&probe_lock);
+  while (probes > 0 &&
+         pthread_cond_timedwait(&probe_done, &probe_lock, &until) == 0)
+    ;
+  pthread_mutex_unlock(&probe_lock);
+}
+
+/* The failure was counted when the retry was claimed. */
+static void *probe_thread(void *arg) {
+  struct probe *p = arg;
+  int fd;
+
+  if ((fd = sock_connect(p->host, p->port)) >= 0) {
+    close(fd);
+    clear_health(p->file);
+  }
+  free(p);
+
+  pthread_mutex_lock(&probe_lock);
+  probes--;
+  pthread_cond_broadcast(&probe_done);
+  pthread_mutex_unlock(&probe_lock);
+  return NULL;
+}
+
+/* Probe HOST:PORT, whose server file is FILE, in the background. */
+static void start_probe(const char *host, int port, const char *file) {
+  pthread_attr_t attr;
+  pthread_t tid;
+  struct probe *p;
+
+  if ((p = malloc(sizeof(*p))) == NULL)
+    return;
+  snprintf(p->host, sizeof(p->host), "%s", host);
+  p->port = port;
+  snprintf(p->file, sizeof(p->file), "%s", file);
+
+  pthread_mutex_lock(&probe_lock);
+  probes++;
+  pthread_mutex_unlock(&probe_lock);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&tid, &attr, probe_thread, p) != 0) {
+    free(p);
+    pthread_mutex_lock(&probe_lock);
+    probes--;
+    pthread_mutex_unlock(&probe_lock);
+  }
+  pthread_attr_destroy(&attr);
+}
+
+int health_cause(int err) {
+  if (err == ECONNREFUSED)
+    return HEALTH_REFUSED;
+  if (err == ETIMEDOUT)
+    return HEALTH_TIMEOUT;
+  return HEALTH_CONNECT;
+}
+
+int health_check(const char *host, int port) {
+  char file[BUF_SIZE];
+  struct health h;
+  time_t now = time(NULL);
+  int lock;
+
+  if (health_path(host, port, file, sizeof(file)) != 0 ||
+      access(file, F_OK) != 0)
+    return 0;
+  lock = lock_health(file);
+  if (load_health(file, &h) != 0) {
+    unlock_health(lock);
+    return 0;
+  }
+
+  if (now >= h.retry) { /* half open: claim the retry */
+    fprintf(stderr, "mailcheck: skipping '%s:%d' after %d failure%s (%s), "
+            "retrying in the background\n", host, port, h.failures,
+            h.failures == 1 ? "" : "s", cause_name[h.cause]);
+    backoff(&h);
+    save_health(file, &h);
+    unlock_health(lock);
+    start_probe(host, port, file);
+    return -1;
+  }
+
+  fprintf(stderr, "mailcheck: skipping '%s:%d' after %d failure%s (%s), "
+          "retrying in %lld s\n", host, port, h.failures,
+          h.failures == 1 ? "" : "s", cause_name[h.cause],
+          (long long)(h.retry - now));
+  unlock_health(lock);
+  return -1;
+}
+
+void health_failed(const char *host, int port, int cause) {
+  char file[BUF_SIZE];
+  struct health h;
+  int lock;
+
+  if (health_path(host, port, file, sizeof(file)) != 0)
+    return;
+  lock = lock_health(file);
+  if (load_health(file, &h) != 0)
+    h.failures = 0;
+  h.cause = cause;
+  backoff(&h);
+  save_health(file, &h);
+  unlock_health(lock);
+}
+
+void health_ok(const char *host, int port) {
+  char file[BUF_SIZE];
+
+  if (health_path(host, port, file, sizeof(file)) == 0)
+    clear_health(file);
+}
@@ -0,0 +1,306 @@
+/* history.c -- recent checks of each mailbox, for scheduling checks
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ */
+
+/* For every mailbox a ring of its last HISTORY_LEN checks is kept:
+ * when each one ended, what it cost and whether new mail had arrived.  From
+ * these, history_interval() works out when to look again:
+ *
+ *   - after mail arrived, the base interval (-i);
+ *   - for every quiet check since, twice as long, up to 2^MAX_BACKOFF times
+ *     the base interval;
+ *   - but no longer than half the usual gap between arrivals in the ring, so
+ *     that busy mailboxes are not left alone for long;
+ *   - and no shorter than COST_SHARE times the average cost of a check, so
+ *     that slow servers don't keep the daemon busy.
+ *
+ * The average cost also orders the checks of a run with -j (see jobs.c).
+ *
+ * The rings are kept in ~/.mailcheck/history, so that a restarted daemon
+ * knows the habits of the mailboxes:
+ *
+ *   "MCHIST1\n" <struct history>...
+ *
+ * in the byte order of the machine, as the file isn't meant to travel.
+ * Mailboxes are identified by a hash of their path.
+ *
+ * The daemon and every run share the file, each with a different rc file
+ * maybe.  So a save doesn't write out what the saver knows, but merges it
+ * in: under a lock, the file is read again, the checks made since the last
+ * save are added to the rings found there, and the rings of mailboxes the
+ * saver didn't look at are kept, until none of them was checked for
+ * HISTORY_EXPIRE seconds. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "history.h"
+#include "mailcheck.h"
+
+#define HISTORY_MAGIC "MCHIST1\n"
+#define HISTORY_LEN (32)
+#define MAX_BACKOFF (4)
+#define COST_SHARE (20)
+#define HISTORY_EXPIRE (90 * 24 * 3600)
+
+struct history {
+  uint64_t key;                  /* hash of the mailbox path */
+  uint32_t when[HISTORY_LEN];    /* end of the check, seconds since the epoch */
+  uint16_t cost_ms[HISTORY_LEN]; /* duration of the check */
+  uint8_t arrived[HISTORY_LEN];  /* new mail since the check before */
+  uint32_t new;                  /* new and total messages at the last */
+  uint32_t total;                /*  successful check */
+  uint8_t head;                  /* slot for the next check */
+  uint8_t count;                 /* slots in use */
+  uint8_t known;                 /* new and total are set */
+  uint8_t used;                  /* looked up */
+  uint8_t fresh;                 /* checks added since the last save */
+};
+
+struct histfile {
+  struct arena *mem;
+  struct history **h;
+  size_t count;
+  size_t size;
+};
+
+static uint64_t path_hash(const char *path) {
+  uint64_t h = UINT64_C(14695981039346656037);
+
+  for (; *path; path++) {
+    h ^= (unsigned char)*path;
+    h *= UINT64_C(1099511628211);
+  }
+  return h;
+}
+
+static struct history *history_new(struct histfile *hf) {
+  if (hf->count == hf->size) {
+    size_t size = hf->size ? 2 * hf->size : 16;
+
+    hf->h = arena_grow(hf->mem, hf->h, hf->size * sizeof(*hf->h),
+                       size * sizeof(*hf->h));
+    hf->size = size;
+  }
+  hf->h[hf->count] = arena_alloc(hf->mem, sizeof(struct history));
+  return hf->h[hf->count++];
+}
+
+/* Open the history file FILE and check its header.  A file of the wrong
+ * size is from another version, or damaged.  Returns NULL if there is none
+ * to read. */
+static FILE *open_file(const char *file) {
+  char magic[sizeof(HISTORY_MAGIC) - 1];
+  struct stat st;
+  FILE *fp;
+
+  if ((fp = fopen(file, "r")) == NULL)
+    return NULL;
+  if (fstat(fileno(fp), &st) == 0 && st.st_size >= (off_t)sizeof(magic) &&
+      (st.st_size - sizeof(magic)) % sizeof(struct history) == 0 &&
+      fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+      memcmp(magic, HISTORY_MAGIC, sizeof(magic)) == 0)
+    return fp;
+  fclose(fp);
+  return NULL;
+}
+
+/* Read the next sound record of FP into REC.  Returns -1 at the end. */
+static int read_record(FILE *fp, struct history *rec) {
+  while (fread(rec, sizeof(*rec), 1, fp) == 1)
+    if (rec->head < HISTORY_LEN && rec->count <= HISTORY_LEN) {
+      rec->used = 0;
+      rec->fresh = 0;
+      return 0;
+    }
+  return -1;
+}
+
+struct histfile *history_open(const char *file, struct arena *mem) {
+  struct histfile *hf;
+  struct history rec;
+  FILE *fp;
+
+  hf = arena_alloc(mem, sizeof(*hf));
+  hf->mem = mem;
+  if ((fp = open_file(file)) == NULL)
+    return hf;
+  while (read_record(fp, &rec) == 0)
+    *history_new(hf) = rec;
+  fclose(fp);
+  return hf;
+}
+
+struct history *history_get(struct histfile *hf, const char *path) {
+  uint64_t key = path_hash(path);
+  struct history *h;
+  size_t i;
+
+  for (i = 0; i < hf->count; i++)
+    if (hf->h[i]->key == key) {
+      hf->h[i]->used = 1;
+      return hf->h[i];
+    }
+  h = history_new(hf);
+  h->key = key;
+  h->used = 1;
+  return h;
+}
+
+int history_add(struct history *h, time_t when, long long cost_ns, int new,
+                int total) {
+  long long ms = cost_ns / 1000000;
+  int arrived = 0;
+
+  if (new >= 0) {
+    arrived = h->known &&
+              ((uint32_t)new > h->new || (uint32_t)total > h->total);
+    h->new = new;
+    h->total = total;
+    h->known = 1;
+  }
+
+  h->when[h->head] = when;
+  h->cost_ms[h->head] = ms > UINT16_MAX ? UINT16_MAX : ms;
+  h->arrived[h->head] = arrived;
+  h->head = (h->head + 1) % HISTORY_LEN;
+  if (h->count < HISTORY_LEN)
+    h->count++;
+  if (h->fresh < HISTORY_LEN)
+    h->fresh++;
+  return arrived;
+}
+
+long long history_cost(const struct history *h) {
+  unsigned long cost = 0;
+  unsigned i;
+
+  if (h->count == 0)
+    return -1;
+  for (i = 0; i < h->count; i++)
+    cost += h->cost_ms[i];
+  return cost * 1000000LL / h->count;
+}
+
+unsigned history_interval(const struct history *h, unsigned base) {
+  unsigned interval, quiet = 0, arrivals = 0, gap, i, slot;
+  unsigned long cost = 0;
+  uint32_t first = 0, last = 0;
+
+  /* newest first */
+  for (i = 0; i < h->count; i++) {
+    slot = (h->head + HISTORY_LEN - 1 - i) % HISTORY_LEN;
+    cost += h->cost_ms[slot];
+    if (h->arrived[slot]) {
+      if (arrivals++ == 0)
+        last = h->when[slot];
+      first = h->when[slot];
+    } else if (arrivals == 0) {
+      quiet++;
+    }
+  }
+
+  interval = base << (quiet < MAX_BACKOFF ? quiet : MAX_BACKOFF);
+  if (arrivals >= 2) {
+    gap = (last - first) / (arrivals - 1) / 2;
+    if (interval > gap)
+      interval = gap > base ? gap : base;
+  }
+  if (h->count > 0 && cost * COST_SHARE / h->count / 1000 > interval)
+    interval = cost * COST_SHARE / h->count / 1000;
+  return interval;
+}
+
+/* Add the checks of H made since the last save to the ring REC, as found
+ * in the file, and make that the ring of H. */
+static void merge(struct history *h, struct history *rec) {
+  unsigned i, slot;
+
+  for (i = h->fresh; i > 0; i--) {
+    slot = (h->head + HISTORY_LEN - i) % HISTORY_LEN;
+    rec->when[rec->head] = h->when[slot];
+    rec->cost_ms[rec->head] = h->cost_ms[slot];
+    rec->arrived[rec->head] = h->arrived[slot];
+    rec->head = (rec->head + 1) % HISTORY_LEN;
+    if (rec->count < HISTORY_LEN)
+      rec->count++;
+  }
+  if (h->known) {
+    rec->new = h->new;
+    rec->total = h->total;
+    rec->known = 1;
+  }
+  rec->used = h->used;
+  rec->fresh = 0;
+  *h = *rec;
+}
+
+/* When the mailbox of REC was last checked. */
+static uint32_t last_check(const struct history *rec) {
+  return rec->count ? rec->when[(rec->head + HISTORY_LEN - 1) % HISTORY_LEN]
+                    : 0;
+}
+
+int history_save(struct histfile *hf, const char *file) {
+  char tmp[4096], lockfile[4096];
+  struct history rec;
+  unsigned char *done;
+  time_t now = time(NULL);
+  FILE *fp, *old;
+  size_t i;
+  int lock, ret = -1;
+
+  if ((done = calloc(hf->count + 1, 1)) == NULL) {
+    fprintf(stderr, "mailcheck: out of memory\n");
+    exit(1);
+  }
+  snprintf(lockfile, sizeof(lockfile), "%s.lock", file);
+  if ((lock = open(lockfile, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1)
+    goto out;
+  while (flock(lock, LOCK_EX) == -1)
+    if (errno != EINTR)
+      goto out;
+  if ((fp = state_create(file, tmp, sizeof(tmp))) == NULL)
+    goto out;
+  fwrite(HISTORY_MAGIC, 1, sizeof(HISTORY_MAGIC) - 1, fp);
+
+  /* what the file has now, with our checks added */
+  if ((old = open_file(file)) != NULL) {
+    while (read_record(old, &rec) == 0) {
+      for (i = 0; i < hf->count; i++)
+        if (!done[i] && hf->h[i]->key == rec.key)
+          break;
+      if (i < hf->count) {
+        merge(hf->h[i], &rec);
+        done[i] = 1;
+      } else if (now - last_check(&rec) > HISTORY_EXPIRE) {
+        continue;
+      }
+      fwrite(&rec, sizeof(rec), 1, fp);
+    }
+    fclose(old);
+  }
+  /* and the mailboxes it hasn't heard of */
+  for (i = 0; i < hf->count; i++)
+    if (!done[i] && (hf->h[i]->fresh || hf->h[i]->used)) {
+      hf->h[i]->fresh = 0;
+      fwrite(hf->h[i], sizeof(struct history), 1, fp);
+    }
+  ret = state_commit(fp, tmp, file, 0);
+
+out:
+  if (lock != -1)
+    close(lock);
+  free(done);
+  return ret;
+}
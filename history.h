@@ -0,0 +1,44 @@
+/* history.h -- recent checks of each mailbox, for scheduling checks
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ */
+
+#ifndef _HISTORY_H_
+#define _HISTORY_H_ 1
+
+#include <time.h>
+
+struct arena;
+struct history;
+struct histfile;
+
+/* Read the histories stored in FILE into memory taken from MEM, which also
+ * holds those added later; they are given back with it.  A missing or
+ * damaged file gives an empty set. */
+struct histfile *history_open(const char *file, struct arena *mem);
+
+/* Find the history of mailbox PATH, creating an empty one if there is
+ * none. */
+struct history *history_get(struct histfile *hf, const char *path);
+
+/* Record a check that ended at WHEN, took COST_NS and found NEW new messages
+ * out of TOTAL; NEW is -1 if the check failed.  Returns 1 if mail arrived
+ * since the check before. */
+int history_add(struct history *h, time_t when, long long cost_ns, int new,
+                int total);
+
+/* Average duration of the recorded checks in nanoseconds, or -1 if there
+ * are none. */
+long long history_cost(const struct history *h);
+
+/* Seconds until the mailbox should be checked again, BASE being the shortest
+ * interval.  No jitter is added. */
+unsigned history_interval(const struct history *h, unsigned base);
+
+/* Merge the checks recorded since the last save into FILE, which others may
+ * have written meanwhile, and take in what they recorded.  Returns -1 on
+ * error. */
+int history_save(struct histfile *hf, const char *file);
+
+#endif /* _HISTORY_H_ */
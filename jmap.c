@@ -0,0 +1,725 @@
+/* jmap.c -- check mailboxes on JMAP servers
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ */
+
+/* A JMAP account (RFC 8620, RFC 8621) is named jmap://user@host[:port]/box
+ * in the rc file, and spoken to over HTTPS.  Its session resource, found at
+ * /.well-known/jmap, tells where the API is and which account holds the
+ * mail.  That is looked up once and kept in ~/.mailcheck/jmap/, one file per
+ * account, along with the session state; it is only looked up again when a
+ * reply says that the state has changed, or a request with it fails.
+ *
+ * All mailboxes of an account, however many lines of the rc file name them,
+ * are then checked with a single Mailbox/get call.  Its reply is taken apart
+ * with the reader in json.c while it arrives, so that an account with
+ * thousands of folders needs no more memory than one with a few.  The
+ * daemon keeps its connections open between checks, so that a check costs
+ * a single round trip, without a TCP or TLS handshake. */
+
+#define _GNU_SOURCE /* strcasestr() */
+
+#include <fnmatch.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "conn.h"
+#include "json.h"
+#include "mailcheck.h"
+#include "metrics.h"
+#include "probes.h"
+
+#define JMAP_MAGIC "MCJMAP1"
+#define MAIL_CAP "urn:ietf:params:jmap:mail"
+#define MAX_REDIRECTS (4)
+#define KEPT_CONNS (8)
+
+/* A response, and the connection it arrives on. */
+struct http {
+  struct conn *c;
+  int status;
+  int keep;        /* the connection can be used again */
+  int chunked;     /* Transfer-Encoding: chunked */
+  int until_close; /* neither that nor Content-Length: the body ends at EOF */
+  int done;        /* all of the body has been read */
+  long long left;  /* bytes of the body, or of the chunk, still to come */
+  char location[BUF_SIZE];
+  struct rbuf body; /* the body read so far, without the chunk framing */
+};
+
+/* What ~/.mailcheck/jmap/ remembers of an account. */
+struct session {
+  char api_url[BUF_SIZE + 300]; /* "https://" host ":" port path */
+  char account[256];
+  char state[256];
+};
+
+/* An account being checked: the lines of the rc file that name its
+ * mailboxes, and what was found for each. */
+struct jmap {
+  const struct mailbox *mb;
+  int count;
+  const char *box; /* mailbox of the first line, as parse_url() found it */
+  const char *prefix;
+  int *found;
+  struct mail_status *status;
+  status_fn fn;
+  void *arg;
+};
+
+/* Connections the daemon keeps open between checks. */
+static pthread_mutex_t kept_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct conn *kept[KEPT_CONNS];
+
+static const char base64_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* Encode the LEN bytes at S in base64 (RFC 4648) to DST, which must have
+ * room for 4 / 3 as many and a NUL. */
+static void base64(const char *s, size_t len, char *dst) {
+  const unsigned char *p = (const unsigned char *)s;
+  unsigned long v;
+  size_t i;
+
+  for (i = 0; i + 2 < len; i += 3, p += 3) {
+    v = (unsigned long)p[0] << 16 | p[1] << 8 | p[2];
+    *dst++ = base64_chars[v >> 18];
+    *dst++ = base64_chars[(v >> 12) & 0x3f];
+    *dst++ = base64_chars[(v >> 6) & 0x3f];
+    *dst++ = base64_chars[v & 0x3f];
+  }
+  if (i < len) {
+    v = (unsigned long)p[0] << 16 | (i + 1 < len ? p[1] << 8 : 0);
+    *dst++ = base64_chars[v >> 18];
+    *dst++ = base64_chars[(v >> 12) & 0x3f];
+    *dst++ = i + 1 < len ? base64_chars[(v >> 6) & 0x3f] : '=';
+    *dst++ = '=';
+  }
+  *dst = '\0';
+}
+
+/* Split the https: URL (or absolute path, on BASE_HOST:BASE_PORT) URL into
+ * HOST (256 bytes), PORT and PATH (BUF_SIZE bytes).  Returns -1 if it is
+ * neither. */
+static int split_url(const char *url, const char *base_host, int base_port,
+                     char *host, int *port, char *path) {
+  const char *p, *colon;
+  size_t n;
+
+  if (*url == '/') {
+    if (host != base_host)
+      snprintf(host, 256, "%s", base_host);
+    *port = base_port;
+    snprintf(path, BUF_SIZE, "%s", url);
+    return 0;
+  }
+  if (strncasecmp(url, "https://", 8) != 0)
+    return -1;
+  url += 8;
+  p = url + strcspn(url, "/?#");
+  if ((colon = memchr(url, ':', p - url)) != NULL) {
+    if ((*port = atoi(colon + 1)) <= 0)
+      return -1;
+  } else {
+    *port = 443;
+    colon = p;
+  }
+  if ((n = colon - url) == 0 || n > 255)
+    return -1;
+  memcpy(host, url, n);
+  host[n] = '\0';
+  snprintf(path, BUF_SIZE, "%s", *p == '/' ? p : "/");
+  return 0;
+}
+
+/* Get a connection to HOST:PORT, one kept open if there is one that still
+ * is.  *REUSED tells which. */
+static struct conn *http_connect(const char *host, int port, int *reused) {
+  struct conn *c = NULL;
+  struct pollfd pfd;
+  int i;
+
+  pthread_mutex_lock(&kept_lock);
+  for (i = 0; i < KEPT_CONNS; i++) {
+    if (kept[i] && kept[i]->port == port && !strcmp(kept[i]->host, host)) {
+      c = kept[i];
+      kept[i] = NULL;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&kept_lock);
+
+  /* an idle connection is only readable if the server has closed it */
+  if (c) {
+    pfd.fd = c->fd;
+    pfd.events = POLLIN;
+    if (c->in.start != c->in.end || poll(&pfd, 1, 0) != 0) {
+      conn_close(c);
+      c = NULL;
+    } else if (Options.verbose) {
+      fprintf(stderr, "mailcheck: %s:%d: connection reused\n", host, port);
+    }
+  }
+  *reused = c != NULL;
+  return c ? c : conn_open(host, port, 1);
+}
+
+/* Done with the connection of H: the daemon keeps it for the next check,
+ * if the server lets it. */
+static void http_release(struct http *h) {
+  struct conn *old = NULL;
+  int i;
+
+  if (!h->c)
+    return;
+  if (!Options.daemon_mode || !h->keep || !h->done) {
+    conn_close(h->c);
+    h->c = NULL;
+    return;
+  }
+  pthread_mutex_lock(&kept_lock);
+  for (i = 0; i < KEPT_CONNS && kept[i]; i++)
+    ;
+  if (i == KEPT_CONNS) {
+    old = kept[0];
+    i = 0;
+  }
+  kept[i] = h->c;
+  pthread_mutex_unlock(&kept_lock);
+  conn_close(old);
+  h->c = NULL;
+}
+
+/* Get the next line of the head of a response.  Returns -1 on EOF. */
+static int http_line(struct http *h, struct token *t) {
+  while (pop3_line(&h->c->in, 0, t) == TOK_MORE)
+    if (conn_fill(h->c) <= 0)
+      return -1;
+  return 0;
+}
+
+/* Does the header line LINE start with NAME (with the colon)?  Returns its
+ * value if it does. */
+static const char *header(const char *line, const char *name) {
+  size_t n = strlen(name);
+
+  if (strncasecmp(line, name, n) != 0)
+    return NULL;
+  return line + n + strspn(line + n, " \t");
+}
+
+/* Read the status line and headers of a response. */
+static int http_head(struct http *h) {
+  char line[BUF_SIZE];
+  const char *v;
+  struct token t;
+  int minor;
+
+  if (http_line(h, &t) != 0)
+    return -1;
+  snprintf(line, sizeof(line), "%.*s", (int)t.len, t.ptr);
+  if (sscanf(line, "HTTP/1.%d %d", &minor, &h->status) != 2)
+    return -1;
+  PROBE4(response, h->c->host, h->c->port, h->status / 100 == 2,
+         probe_ns() - h->c->sent);
+
+  h->keep = minor > 0;
+  h->chunked = h->until_close = h->done = 0;
+  h->left = -1;
+  h->location[0] = '\0';
+  h->body.start = h->body.end = 0;
+  for (;;) {
+    if (http_line(h, &t) != 0)
+      return -1;
+    if (t.len == 0)
+      break;
+    snprintf(line, sizeof(line), "%.*s", (int)t.len, t.ptr);
+    if ((v = header(line, "Content-Length:")) != NULL)
+      h->left = strtoll(v, NULL, 10);
+    else if ((v = header(line, "Transfer-Encoding:")) != NULL)
+      h->chunked = strcasestr(v, "chunked") != NULL;
+    else if ((v = header(line, "Connection:")) != NULL)
+      h->keep = strcasestr(v, "close") ? 0 : strcasestr(v, "keep-alive") ? 1
+                                                                         : h->keep;
+    else if ((v = header(line, "Location:")) != NULL)
+      snprintf(h->location, sizeof(h->location), "%s", v);
+  }
+
+  if (h->chunked) {
+    h->left = 0;
+  } else if (h->left < 0) {
+    h->until_close = 1;
+    h->keep = 0;
+  }
+  return 0;
+}
+
+/* Send a request, with the JSON BODY if not NULL. */
+static int http_send(struct http *h, const char *method, const char *path,
+                     const char *auth, const char *body) {
+  char length[96] = "";
+
+  if (body)
+    snprintf(length, sizeof(length),
+             "Content-Type: application/json\r\nContent-Length: %zu\r\n",
+             strlen(body));
+  return conn_printf(h->c,
+                     "%s %s HTTP/1.1\r\nHost: %s:%d\r\n"
+                     "Authorization: Basic %s\r\nAccept: application/json\r\n"
+                     "%s%s\r\n%s",
+                     method, path, h->c->host, h->c->port, auth, length,
+                     Options.daemon_mode ? "" : "Connection: close\r\n",
+                     body ? body : "");
+}
+
+/* Send a request to HOST:PORT and read the head of the response.  If a kept
+ * connection turns out to have been closed, the request is sent again over
+ * a new one. */
+static int http_request(struct http *h, const char *host, int port,
+                        const char *method, const char *path, const char *auth,
+                        const char *body) {
+  int reused, tries;
+
+  for (tries = 0; tries < 2; tries++) {
+    if ((h->c = http_connect(host, port, &reused)) == NULL)
+      return -1;
+    if (http_send(h, method, path, auth, body) == 0 && http_head(h) == 0)
+      return 0;
+    conn_close(h->c);
+    h->c = NULL;
+    if (!reused)
+      break;
+  }
+  fprintf(stderr, "mailcheck: no HTTP response from '%s:%d'\n", host, port);
+  metrics_error(ERROR_PROTOCOL);
+  return -1;
+}
+
+/* Move more of the body from the connection to h->body.  Returns the number
+ * of bytes moved, 0 at the end of the body and -1 on error. */
+static ssize_t http_fill(struct http *h) {
+  struct rbuf *in = &h->c->in;
+  struct token t;
+  char size[32], *end;
+  size_t space, n;
+  ssize_t got;
+  char *p;
+
+  while (h->chunked && h->left == 0 && !h->done) {
+    /* the line end after the last chunk comes first */
+    do {
+      if (http_line(h, &t) != 0)
+        return -1;
+    } while (t.len == 0);
+    snprintf(size, sizeof(size), "%.*s", (int)t.len, t.ptr);
+    h->left = strtoll(size, &end, 16);
+    if (end == size || h->left < 0)
+      return -1;
+    if (h->left == 0) { /* the last chunk: skip the trailer */
+      do {
+        if (http_line(h, &t) != 0)
+          return -1;
+      } while (t.len != 0);
+      h->done = 1;
+    }
+  }
+  if (h->done || h->left == 0) {
+    h->done = 1;
+    return 0;
+  }
+
+  if (in->start == in->end && (got = conn_fill(h->c)) <= 0) {
+    if (got == 0 && h->until_close) {
+      h->done = 1;
+      return 0;
+    }
+    return -1;
+  }
+  p = rbuf_reserve(&h->body, &space);
+  n = in->end - in->start;
+  if (n > space)
+    n = space;
+  if (h->left > 0 && (long long)n > h->left)
+    n = h->left;
+  if (n == 0)
+    return -1;
+  memcpy(p, in->data + in->start, n);
+  in->start += n;
+  rbuf_commit(&h->body, n);
+  if (h->left > 0)
+    h->left -= n;
+  return n;
+}
+
+/* Read and forget the rest of the body. */
+static void http_drain(struct http *h) {
+  while (http_fill(h) > 0)
+    h->body.start = h->body.end = 0;
+}
+
+/* Get the next token of the JSON body of the response. */
+static int json_get(struct http *h, struct json_reader *jr,
+                    struct json_token *t) {
+  while (json_next(jr, &h->body, t) == JSON_MORE)
+    if (http_fill(h) <= 0)
+      return t->type = JSON_ERROR;
+  return t->type;
+}
+
+/* JMAP ids are made of the characters of base64url (RFC 8620, 1.2), and can
+ * go into a request without being quoted. */
+static int valid_id(const char *s) {
+  return *s && strlen(s) < 256 &&
+         s[strspn(s, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+                     "0123456789-_")] == '\0';
+}
+
+static int load_session(const char *file, struct session *s) {
+  char magic[16];
+  FILE *fp;
+  int ok;
+
+  if ((fp = fopen(file, "r")) == NULL)
+    return -1;
+  ok = fgets(magic, sizeof(magic), fp) &&
+       strcmp(magic, JMAP_MAGIC "\n") == 0 &&
+       fgets(s->api_url, sizeof(s->api_url), fp) &&
+       fgets(s->account, sizeof(s->account), fp) &&
+       fgets(s->state, sizeof(s->state), fp);
+  fclose(fp);
+  if (!ok)
+    return -1;
+  s->api_url[strcspn(s->api_url, "\n")] = '\0';
+  s->account[strcspn(s->account, "\n")] = '\0';
+  s->state[strcspn(s->state, "\n")] = '\0';
+  return valid_id(s->account) ? 0 : -1;
+}
+
+static void save_session(const char *file, const struct session *s) {
+  char tmp[BUF_SIZE + 8];
+  FILE *fp;
+
+  if ((fp = state_create(file, tmp, sizeof(tmp))) == NULL)
+    return;
+  fprintf(fp, JMAP_MAGIC "\n%s\n%s\n%s\n", s->api_url, s->account, s->state);
+  state_commit(fp, tmp, file, 0);
+}
+
+/* Read the session resource in the body of H: the API URL, relative to
+ * HOST:PORT, and the primary mail account. */
+static int parse_session(struct http *h, const char *host, int port,
+                         struct session *s) {
+  struct json_reader jr = {0};
+  struct json_token t;
+  char url[BUF_SIZE], api_host[256], path[BUF_SIZE];
+  int type, field = 0, api_port;
+
+  enum { F_API_URL = 1, F_STATE, F_PRIMARY, F_MAIL };
+
+  url[0] = s->account[0] = s->state[0] = '\0';
+  while ((type = json_get(h, &jr, &t)) != JSON_END) {
+    if (type == JSON_ERROR)
+      return -1;
+    if (type == JSON_KEY && jr.depth == 1) {
+      field = json_is(&t, "apiUrl")            ? F_API_URL
+              : json_is(&t, "state")           ? F_STATE
+              : json_is(&t, "primaryAccounts") ? F_PRIMARY
+                                               : 0;
+    } else if (type == JSON_KEY && jr.depth == 2 && field >= F_PRIMARY) {
+      field = json_is(&t, MAIL_CAP) ? F_MAIL : F_PRIMARY;
+    } else if (type == JSON_STRING) {
+      if (field == F_API_URL && jr.depth == 1)
+        json_string(&t, url, sizeof(url));
+      else if (field == F_STATE && jr.depth == 1)
+        json_string(&t, s->state, sizeof(s->state));
+      else if (field == F_MAIL && jr.depth == 2)
+        json_string(&t, s->account, sizeof(s->account));
+    }
+  }
+
+  if (split_url(url, host, port, api_host, &api_port, path) != 0 ||
+      !valid_id(s->account))
+    return -1;
+  snprintf(s->api_url, sizeof(s->api_url), "https://%s:%d%s", api_host,
+           api_port, path);
+  return 0;
+}
+
+/* Look up the session of the account USER on HOST:PORT, following
+ * redirections from the well-known URL. */
+static int fetch_session(const char *host, int port, const char *user,
+                         const char *auth, struct session *s) {
+  char rhost[256], next_host[256], path[BUF_SIZE] = "/.well-known/jmap";
+  struct http h;
+  int rport = port, redirects, retval;
+
+  memset(&h, 0, sizeof(h));
+  snprintf(rhost, sizeof(rhost), "%s", host);
+  for (redirects = 0;; redirects++) {
+    if (http_request(&h, rhost, rport, "GET", path, auth, NULL) != 0)
+      return -1;
+    if (h.status / 100 != 3 || !*h.location)
+      break;
+    http_drain(&h);
+    http_release(&h);
+    if (redirects == MAX_REDIRECTS ||
+        split_url(h.location, rhost, rport, next_host, &rport, path) != 0) {
+      fprintf(stderr, "mailcheck: bad JMAP redirection from '%s:%d'\n", host,
+              port);
+      metrics_error(ERROR_PROTOCOL);
+      return -1;
+    }
+    strcpy(rhost, next_host);
+  }
+
+  if (h.status != 200) {
+    fprintf(stderr, "mailcheck: no JMAP session for '%s@%s:%d': HTTP %d\n",
+            user, host, port, h.status);
+    metrics_error(h.status == 401 || h.status == 403 ? ERROR_AUTH
+                                                     : ERROR_PROTOCOL);
+    retval = -1;
+  } else if ((retval = parse_session(&h, rhost, rport, s)) != 0) {
+    fprintf(stderr, "mailcheck: bad JMAP session from '%s:%d'\n", rhost,
+            rport);
+    metrics_error(ERROR_PROTOCOL);
+  }
+  http_drain(&h);
+  http_release(&h);
+  return retval;
+}
+
+/* The mailbox named by line I of the account. */
+static const char *line_box(const struct jmap *jm, int i) {
+  const char *name = jm->mb[i].path + strlen(jm->prefix);
+
+  return i == 0 ? jm->box : *name ? name : "INBOX";
+}
+
+/* Report the mailbox NAME (with ROLE) to every line that names it. */
+static void report_mailbox(struct jmap *jm, const char *name, const char *role,
+                           long long total, long long unread) {
+  char pattern[BUF_SIZE], *p;
+  const char *box;
+  int i, match;
+
+  if (total < 0 || unread < 0)
+    return;
+  for (i = 0; i < jm->count; i++) {
+    box = line_box(jm, i);
+    if (strpbrk(box, "*%")) { /* names have no hierarchy: '%' is '*' */
+      snprintf(pattern, sizeof(pattern), "%s", box);
+      for (p = pattern; (p = strchr(p, '%')) != NULL; p++)
+        *p = '*';
+      match = fnmatch(pattern, name, 0) == 0;
+      box = name;
+    } else if (strcasecmp(box, "INBOX") == 0) {
+      match = strcmp(role, "inbox") == 0;
+    } else {
+      match = strcmp(box, name) == 0;
+    }
+    if (!match)
+      continue;
+    snprintf(jm->status->path, sizeof(jm->status->path), "%s%s", jm->prefix,
+             box);
+    jm->status->new = unread;
+    jm->status->saved = total - unread;
+    jm->fn(jm->status, jm->arg);
+    jm->found[i]++;
+  }
+}
+
+/* Ask for all mailboxes of the account with Mailbox/get, and report them
+ * while the reply is read.  The session state the server reports is left
+ * in STATE.  A failed request is only complained about if not QUIET. */
+static int get_mailboxes(struct jmap *jm, const struct session *s,
+                         const char *auth, char *state, size_t len,
+                         int quiet) {
+  char body[BUF_SIZE], host[256], path[BUF_SIZE], name[BUF_SIZE], role[64];
+  struct json_reader jr = {0};
+  struct json_token t;
+  struct http h;
+  long long total = -1, unread = -1;
+  int port, type, d, section = 0, in_list = 0, field = 0, invocation = 0;
+  int answered = 0, failed = 0;
+
+  enum { F_NAME = 1, F_ROLE, F_TOTAL, F_UNREAD };
+
+  if (split_url(s->api_url, "", 0, host, &port, path) != 0)
+    return -1;
+  snprintf(body, sizeof(body),
+           "{\"using\":[\"urn:ietf:params:jmap:core\",\"" MAIL_CAP "\"],"
+           "\"methodCalls\":[[\"Mailbox/get\",{\"accountId\":\"%s\","
+           "\"ids\":null,\"properties\":[\"name\",\"role\",\"totalEmails\","
+           "\"unreadEmails\"]},\"0\"]]}",
+           s->account);
+
+  memset(&h, 0, sizeof(h));
+  if (http_request(&h, host, port, "POST", path, auth, body) != 0)
+    return -1;
+  if (h.status != 200) {
+    if (!quiet)
+      fprintf(stderr, "mailcheck: JMAP request to '%s:%d' failed: HTTP %d\n",
+              host, port, h.status);
+    http_drain(&h);
+    http_release(&h);
+    return -1;
+  }
+
+  /* {"methodResponses": [["Mailbox/get", {"list": [{...}, ...], ...}, "0"]],
+   *  "sessionState": "..."} */
+  *state = '\0';
+  name[0] = role[0] = '\0';
+  while ((type = json_get(&h, &jr, &t)) != JSON_END) {
+    if (type == JSON_ERROR) {
+      failed = 1;
+      break;
+    }
+    d = jr.depth;
+    if (type == JSON_KEY) {
+      if (d == 1)
+        section = json_is(&t, "methodResponses") ? 1
+                  : json_is(&t, "sessionState")  ? 2
+                                                 : 0;
+      else if (d == 4 && section == 1)
+        in_list = json_is(&t, "list");
+      else if (d == 6 && in_list)
+        field = json_is(&t, "name")           ? F_NAME
+                : json_is(&t, "role")         ? F_ROLE
+                : json_is(&t, "totalEmails")  ? F_TOTAL
+                : json_is(&t, "unreadEmails") ? F_UNREAD
+                                              : 0;
+      continue;
+    }
+
+    if (type == JSON_BEGIN_ARRAY && d == 3 && section == 1) {
+      invocation = 1;
+    } else if (type == JSON_STRING && d == 3 && invocation) {
+      /* the method name: "error" if the call failed */
+      if (json_is(&t, "Mailbox/get"))
+        answered = 1;
+      invocation = 0;
+    } else if (type == JSON_STRING && d == 1 && section == 2) {
+      json_string(&t, state, len);
+    } else if (d == 6 && in_list && type == JSON_BEGIN_OBJECT) {
+      name[0] = role[0] = '\0';
+      total = unread = -1;
+    } else if (d == 5 && in_list && type == JSON_END_OBJECT) {
+      report_mailbox(jm, name, role, total, unread);
+    } else if (d == 6 && in_list) {
+      if (field == F_NAME && type == JSON_STRING)
+        json_string(&t, name, sizeof(name));
+      else if (field == F_ROLE && type == JSON_STRING)
+        json_string(&t, role, sizeof(role));
+      else if (field == F_TOTAL)
+        total = json_number(&t);
+      else if (field == F_UNREAD)
+        unread = json_number(&t);
+    }
+    field = 0;
+  }
+  http_drain(&h);
+  http_release(&h);
+
+  if (failed || !answered) {
+    if (!quiet)
+      fprintf(stderr, "mailcheck: bad JMAP reply from '%s:%d'\n", host, port);
+    return -1;
+  }
+  return 0;
+}
+
+/* Count mails in the COUNT JMAP mailboxes MB, which all belong to the same
+ * account and are checked with one request.  If the mailbox part of a path
+ * contains '*' or '%', all mailboxes whose name matches are reported.
+ * STATUS is the template for the results passed to FN. */
+int check_jmap(const struct mailbox *mb, int count, struct mail_status *status,
+               status_fn fn, void *arg) {
+  char hostname[BUF_SIZE], box[BUF_SIZE], prefix[BUF_SIZE];
+  char name[BUF_SIZE], file[BUF_SIZE], state[256];
+  char user[128] = "", pass[128] = "", login[256], auth[352];
+  struct session s;
+  struct jmap jm;
+  int port, tls, i, hit, reported, retval, errors = 0;
+  long long t0;
+
+  port = getnetinfo(mb, hostname, box, user, pass, &tls);
+  if (port == 0 || strlen(hostname) > 255) {
+    fprintf(stderr, "mailcheck: Unable to get login information for %s\n",
+            mb->path);
+    metrics_error(ERROR_CONFIG);
+    return 1;
+  }
+  snprintf(login, sizeof(login), "%s:%s", user, pass);
+  base64(login, strlen(login), auth);
+
+  /* the results are named "<prefix><mailbox>" */
+  remote_prefix(mb->path, prefix, sizeof(prefix));
+  memset(&jm, 0, sizeof(jm));
+  jm.mb = mb;
+  jm.count = count;
+  jm.box = box;
+  jm.prefix = prefix;
+  jm.status = status;
+  jm.fn = fn;
+  jm.arg = arg;
+  if ((jm.found = calloc(count, sizeof(*jm.found))) == NULL) {
+    fprintf(stderr, "mailcheck: out of memory\n");
+    exit(1);
+  }
+
+  if ((size_t)snprintf(name, sizeof(name), "%s@%s:%d", user, hostname,
+                       port) >= sizeof(name) ||
+      state_file(file, sizeof(file), "jmap", name) != 0)
+    file[0] = '\0'; /* no session cache */
+  hit = *file && load_session(file, &s) == 0;
+  PROBE2(cache, "jmap", hit);
+  metrics_cache(CACHE_JMAP, hit);
+
+  t0 = probe_ns();
+  if (!hit && fetch_session(hostname, port, user, auth, &s) != 0) {
+    free(jm.found);
+    return 1;
+  }
+  metrics_phase(PHASE_AUTH, probe_ns() - t0);
+
+  t0 = probe_ns();
+  retval = get_mailboxes(&jm, &s, auth, state, sizeof(state), hit);
+  for (i = reported = 0; i < count; i++)
+    reported += jm.found[i];
+  /* a session from the cache may be out of date */
+  if (retval != 0 && hit && reported) {
+    fprintf(stderr, "mailcheck: JMAP reply for '%s@%s:%d' broke off\n", user,
+            hostname, port);
+  } else if (retval != 0 && hit &&
+             fetch_session(hostname, port, user, auth, &s) == 0) {
+    hit = 0;
+    retval = get_mailboxes(&jm, &s, auth, state, sizeof(state), 0);
+  }
+  metrics_phase(PHASE_STATUS, probe_ns() - t0);
+
+  if (*file) {
+    if (!hit && retval == 0)
+      save_session(file, &s);
+    else if (hit && *state && strcmp(state, s.state) != 0)
+      unlink(file); /* look it up again next time */
+  }
+
+  for (i = 0; i < count; i++) {
+    if (retval == 0 && jm.found[i])
+      continue;
+    if (retval == 0)
+      fprintf(stderr, "mailcheck: no mailbox '%s' in JMAP account '%s@%s:%d'\n",
+              line_box(&jm, i), user, hostname, port);
+    metrics_error(ERROR_PROTOCOL);
+    errors++;
+  }
+  free(jm.found);
+
+  return errors ? 1 : 0;
+}
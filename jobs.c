@@ -0,0 +1,277 @@
+/* jobs.c -- check the mailboxes of a run several at a time
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ */
+
+/* With -j N, the groups of the plan are checked by worker threads in two
+ * lanes: remote mailboxes, which mostly wait for the network, get up to N
+ * threads, local ones, which keep the disk and CPU busy, no more than there
+ * are CPUs.  Within a lane the checks expected to take longest start first
+ * (LPT scheduling), and cheap ones fill in around them, so that a slow IMAP
+ * account does not start last and drag the run out.
+ *
+ * The expected durations come from earlier checks, see history.c; a mailbox
+ * never checked before is assumed to take DEFAULT_NET_COST or
+ * DEFAULT_LOCAL_COST.  Results are still reported in the order of the rc
+ * file, each as soon as everything in front of it is done.  With -t, the
+ * time taken is compared with the prediction on standard error.
+ *
+ * The bookkeeping of a run, histories included, lives in an arena (see
+ * arena.c) that the next run reuses, so that runs after the first take no
+ * memory from the heap beyond what the checks themselves need. */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "history.h"
+#include "mailcheck.h"
+#include "probes.h"
+
+#define DEFAULT_NET_COST (1000000000LL) /* nanoseconds */
+#define DEFAULT_LOCAL_COST (1000000LL)
+#define RUN_MEMORY (65536) /* first block of the arena */
+
+enum { LANE_NET, LANE_LOCAL, LANES };
+
+struct job {
+  const struct mailbox *mb;
+  struct history *hist;
+  long long predicted;  /* nanoseconds */
+  long long took;
+  struct mail_status *status; /* results, in the order reported */
+  int nstatus;
+  int size;
+  int done;
+};
+
+struct jobs;
+
+struct lane {
+  struct jobs *js;
+  int *queue; /* indexes into js->job, most expensive first */
+  int count;
+  int next;
+  int workers;
+  pthread_t *tid;
+};
+
+struct jobs {
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  struct job *job;
+  int njobs;
+  struct lane lane[LANES];
+};
+
+static struct arena run_mem = ARENA_INITIALIZER(RUN_MEMORY);
+
+static void collect(const struct mail_status *status, void *arg) {
+  struct job *j = arg;
+
+  if (j->nstatus == j->size) {
+    j->status = arena_grow(&run_mem, j->status, j->size * sizeof(*status),
+                           2 * j->size * sizeof(*status));
+    j->size *= 2;
+  }
+  j->status[j->nstatus++] = *status;
+}
+
+static void run_job(struct job *j) {
+  long long t0 = probe_ns();
+
+  check_mailbox(j->mb, collect, j);
+  j->took = probe_ns() - t0;
+}
+
+static void *worker(void *arg) {
+  struct lane *l = arg;
+  struct jobs *js = l->js;
+  struct job *j;
+
+  pthread_mutex_lock(&js->lock);
+  while (l->next < l->count) {
+    j = &js->job[l->queue[l->next++]];
+    pthread_mutex_unlock(&js->lock);
+
+    run_job(j);
+
+    pthread_mutex_lock(&js->lock);
+    j->done = 1;
+    pthread_cond_broadcast(&js->done);
+  }
+  pthread_mutex_unlock(&js->lock);
+  return NULL;
+}
+
+static struct jobs *sort_js; /* for cmp_cost(), qsort() has no argument */
+
+static int cmp_cost(const void *a, const void *b) {
+  const struct job *x = &sort_js->job[*(const int *)a];
+  const struct job *y = &sort_js->job[*(const int *)b];
+
+  if (x->predicted != y->predicted)
+    return x->predicted > y->predicted ? -1 : 1;
+  return *(const int *)a - *(const int *)b;
+}
+
+/* Wall time of a lane if its jobs are started in queue order, each on the
+ * worker that becomes free first. */
+static long long makespan(const struct jobs *js, const struct lane *l) {
+  long long *load, max = 0;
+  int i, w, min;
+
+  if (l->workers == 0)
+    return 0;
+  load = arena_alloc(&run_mem, l->workers * sizeof(*load));
+  for (i = 0; i < l->count; i++) {
+    for (min = 0, w = 1; w < l->workers; w++)
+      if (load[w] < load[min])
+        min = w;
+    load[min] += js->job[l->queue[i]].predicted;
+  }
+  for (w = 0; w < l->workers; w++)
+    if (load[w] > max)
+      max = load[w];
+  return max;
+}
+
+/* Pass the results of J to FN and add the check to its history. */
+static void finish_job(struct job *j, status_fn fn, void *arg) {
+  int k, new = 0, total = 0;
+
+  for (k = 0; k < j->nstatus; k++) {
+    fn(&j->status[k], arg);
+    new += j->status[k].new;
+    total += j->status[k].new + j->status[k].unread + j->status[k].saved;
+  }
+  history_add(j->hist, time(NULL), j->took, j->nstatus ? new : -1, total);
+}
+
+static void report_timing(const struct jobs *js, long long predicted,
+                          long long took, unsigned long heap) {
+  int i;
+
+  for (i = 0; i < js->njobs; i++)
+    fprintf(stderr, "mailcheck: %s: %.3fs (predicted %.3fs)\n",
+            js->job[i].mb->path, js->job[i].took / 1e9,
+            js->job[i].predicted / 1e9);
+  if (Options.jobs <= 1)
+    fprintf(stderr, "mailcheck: %d checks in %.3fs (predicted %.3fs)\n",
+            js->njobs, took / 1e9, predicted / 1e9);
+  else
+    fprintf(stderr,
+            "mailcheck: %d checks in %.3fs (predicted %.3fs; %d network and "
+            "%d local threads)\n",
+            js->njobs, took / 1e9, predicted / 1e9, js->lane[LANE_NET].workers,
+            js->lane[LANE_LOCAL].workers);
+  fprintf(stderr,
+          "mailcheck: %lu allocations of run memory, %zu bytes; %lu from the "
+          "heap\n",
+          run_mem.allocs, run_mem.used, run_mem.mallocs);
+  fprintf(stderr, "mailcheck: %lu heap allocations in all\n", heap);
+}
+
+/* Check every mailbox of PLAN with up to Options.jobs threads, passing the
+ * results to FN in plan order, and record how long each check took. */
+void check_plan_jobs(const struct plan *plan, status_fn fn, void *arg) {
+  struct jobs js;
+  struct histfile *hf;
+  struct lane *l;
+  struct job *j;
+  char file[BUF_SIZE];
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  long long start = probe_ns(), predicted = 0, lane_time;
+  unsigned long heap = heap_allocs();
+  int i, k;
+
+  arena_reset(&run_mem);
+  memset(&js, 0, sizeof(js));
+  pthread_mutex_init(&js.lock, NULL);
+  pthread_cond_init(&js.done, NULL);
+  js.job = arena_alloc(&run_mem, plan->count * sizeof(*js.job));
+  for (k = 0; k < LANES; k++) {
+    js.lane[k].js = &js;
+    js.lane[k].queue = arena_alloc(&run_mem, plan->count * sizeof(int));
+  }
+
+  if (state_path(file, sizeof(file), NULL, "history") != 0)
+    file[0] = '\0';
+  hf = history_open(file, &run_mem);
+
+  for (i = 0; i < plan->count; i += plan->box[i].group) {
+    j = &js.job[js.njobs];
+    j->mb = &plan->box[i];
+    j->hist = history_get(hf, j->mb->path);
+    /* an IMAP group reports a mailbox each, wildcards maybe more */
+    j->size = j->mb->group > 1 ? j->mb->group : 1;
+    j->status = arena_alloc(&run_mem, j->size * sizeof(*j->status));
+    k = j->mb->type == MB_POP3 || j->mb->type == MB_IMAP ||
+                j->mb->type == MB_JMAP
+            ? LANE_NET
+            : LANE_LOCAL;
+    if ((j->predicted = history_cost(j->hist)) < 0)
+      j->predicted = k == LANE_NET ? DEFAULT_NET_COST : DEFAULT_LOCAL_COST;
+    l = &js.lane[k];
+    l->queue[l->count++] = js.njobs++;
+  }
+
+  sort_js = &js;
+  for (k = 0; k < LANES; k++) {
+    l = &js.lane[k];
+    qsort(l->queue, l->count, sizeof(int), cmp_cost);
+    l->workers = Options.jobs;
+    if (k == LANE_LOCAL && cpus > 0 && l->workers > cpus)
+      l->workers = cpus;
+    if (l->workers > l->count)
+      l->workers = l->count;
+    if ((lane_time = makespan(&js, l)) > predicted)
+      predicted = lane_time;
+  }
+
+  if (Options.jobs <= 1) {
+    /* one at a time, in plan order */
+    predicted = 0;
+    for (i = 0; i < js.njobs; i++) {
+      run_job(&js.job[i]);
+      finish_job(&js.job[i], fn, arg);
+      predicted += js.job[i].predicted;
+    }
+  } else {
+    for (k = 0; k < LANES; k++) {
+      l = &js.lane[k];
+      l->tid = arena_alloc(&run_mem, l->workers * sizeof(*l->tid));
+      for (i = 0; i < l->workers; i++)
+        if (pthread_create(&l->tid[i], NULL, worker, l) != 0)
+          break;
+      l->workers = i;
+      if (i == 0 && l->count > 0) /* no threads, check here */
+        worker(l);
+    }
+
+    for (i = 0; i < js.njobs; i++) {
+      pthread_mutex_lock(&js.lock);
+      while (!js.job[i].done)
+        pthread_cond_wait(&js.done, &js.lock);
+      pthread_mutex_unlock(&js.lock);
+      finish_job(&js.job[i], fn, arg);
+    }
+
+    for (k = 0; k < LANES; k++)
+      for (i = 0; i < js.lane[k].workers; i++)
+        pthread_join(js.lane[k].tid[i], NULL);
+  }
+
+  if (Options.timing)
+    report_timing(&js, predicted, probe_ns() - start, heap_allocs() - heap);
+  if (*file && history_save(hf, file) != 0)
+    fprintf(stderr, "mailcheck: couldn't save '%s'\n", file);
+
+  pthread_cond_destroy(&js.done);
+  pthread_mutex_destroy(&js.lock);
+}
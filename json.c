@@ -0,0 +1,408 @@
+/* json.c -- incremental reader for JSON documents
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ *
+ * Compile with -DSTANDALONE to test this module: the test program runs
+ * fixed cases and a fuzzer.
+ */
+
+/* The reader works like imap_lex(): it takes tokens off the front of a
+ * receive buffer as they arrive, and says JSON_MORE when the next one isn't
+ * complete yet, so that a reply is looked at while it is being read and
+ * never has to be held in memory as a whole.  Besides the tokens, it keeps
+ * track of the containers open and of what may come next, so that anything
+ * that isn't JSON is an error. */
+
+#include <string.h>
+
+#include "json.h"
+
+/* What may come next */
+enum {
+  EXPECT_START, /* the document */
+  EXPECT_VALUE,
+  EXPECT_VALUE_OR_CLOSE, /* the first element of an array */
+  EXPECT_KEY,
+  EXPECT_KEY_OR_CLOSE, /* the first member of an object */
+  EXPECT_COLON,
+  EXPECT_NEXT, /* ',' or the end of the container */
+  EXPECT_DONE
+};
+
+static int is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/* A token that fills the whole buffer can never be completed. */
+static int more(const struct rbuf *b, struct json_token *t) {
+  return t->type = b->end - b->start == RBUF_SIZE ? JSON_ERROR : JSON_MORE;
+}
+
+/* A value is complete: what may follow it? */
+static int value(struct json_reader *jr, struct json_token *t, int type) {
+  jr->expect = jr->depth ? EXPECT_NEXT : EXPECT_DONE;
+  return t->type = type;
+}
+
+static int open_container(struct json_reader *jr, struct rbuf *b,
+                          struct json_token *t, char c) {
+  if (jr->depth == JSON_MAX_DEPTH)
+    return t->type = JSON_ERROR;
+  jr->open[jr->depth++] = c;
+  jr->expect = c == '{' ? EXPECT_KEY_OR_CLOSE : EXPECT_VALUE_OR_CLOSE;
+  b->start++;
+  return t->type = c == '{' ? JSON_BEGIN_OBJECT : JSON_BEGIN_ARRAY;
+}
+
+static int close_container(struct json_reader *jr, struct rbuf *b,
+                           struct json_token *t, char c) {
+  char open = c == '}' ? '{' : '[';
+
+  if (jr->depth == 0 || jr->open[jr->depth - 1] != open ||
+      (jr->expect != EXPECT_NEXT &&
+       jr->expect != (c == '}' ? EXPECT_KEY_OR_CLOSE : EXPECT_VALUE_OR_CLOSE)))
+    return t->type = JSON_ERROR;
+  jr->depth--;
+  b->start++;
+  return value(jr, t, c == '}' ? JSON_END_OBJECT : JSON_END_ARRAY);
+}
+
+/* The literal WORD at P, of which END - P bytes are buffered. */
+static int literal(struct json_reader *jr, struct rbuf *b, struct json_token *t,
+                   const char *p, const char *end, const char *word, int type) {
+  size_t n = strlen(word);
+
+  if ((size_t)(end - p) < n)
+    return strncmp(p, word, end - p) == 0 ? more(b, t) : (t->type = JSON_ERROR);
+  if (strncmp(p, word, n) != 0)
+    return t->type = JSON_ERROR;
+  b->start += n;
+  return value(jr, t, type);
+}
+
+int json_next(struct json_reader *jr, struct rbuf *b, struct json_token *t) {
+  const char *p, *q, *end;
+  int key;
+
+  t->ptr = NULL;
+  t->len = 0;
+
+  if (jr->expect == EXPECT_DONE)
+    return t->type = JSON_END;
+
+  for (;;) {
+    while (b->start < b->end && is_space(b->data[b->start]))
+      b->start++;
+    p = b->data + b->start;
+    end = b->data + b->end;
+    if (p == end)
+      return t->type = JSON_MORE;
+
+    if (*p == '}' || *p == ']')
+      return close_container(jr, b, t, *p);
+    if (jr->expect == EXPECT_NEXT) {
+      if (*p != ',')
+        return t->type = JSON_ERROR;
+      jr->expect = jr->open[jr->depth - 1] == '{' ? EXPECT_KEY : EXPECT_VALUE;
+      b->start++;
+      continue;
+    }
+    if (jr->expect == EXPECT_COLON) {
+      if (*p != ':')
+        return t->type = JSON_ERROR;
+      jr->expect = EXPECT_VALUE;
+      b->start++;
+      continue;
+    }
+    break;
+  }
+
+  key = jr->expect == EXPECT_KEY || jr->expect == EXPECT_KEY_OR_CLOSE;
+  if (key && *p != '"')
+    return t->type = JSON_ERROR;
+
+  switch (*p) {
+  case '{':
+  case '[':
+    return open_container(jr, b, t, *p);
+
+  case '"':
+    for (q = p + 1; q < end; q++) {
+      if (*q == '\\') {
+        if (++q == end)
+          break;
+      } else if (*q == '"') {
+        t->ptr = p + 1;
+        t->len = q - p - 1;
+        b->start = q + 1 - b->data;
+        if (key) {
+          jr->expect = EXPECT_COLON;
+          return t->type = JSON_KEY;
+        }
+        return value(jr, t, JSON_STRING);
+      } else if ((unsigned char)*q < ' ') {
+        return t->type = JSON_ERROR;
+      }
+    }
+    return more(b, t);
+
+  case 't':
+    return literal(jr, b, t, p, end, "true", JSON_TRUE);
+  case 'f':
+    return literal(jr, b, t, p, end, "false", JSON_FALSE);
+  case 'n':
+    return literal(jr, b, t, p, end, "null", JSON_NULL);
+
+  default:
+    if (*p != '-' && (*p < '0' || *p > '9'))
+      return t->type = JSON_ERROR;
+    for (q = p + 1; q < end && *q && strchr("0123456789.eE+-", *q); q++)
+      ;
+    /* a number only ends with what follows it */
+    if (q == end)
+      return more(b, t);
+    t->ptr = p;
+    t->len = q - p;
+    b->start = q - b->data;
+    return value(jr, t, JSON_NUMBER);
+  }
+}
+
+long long json_number(const struct json_token *t) {
+  long long n = 0;
+  size_t i;
+
+  if (t->type != JSON_NUMBER || t->len == 0 || t->len > 18)
+    return -1;
+  for (i = 0; i < t->len; i++) {
+    if (t->ptr[i] < '0' || t->ptr[i] > '9')
+      return -1;
+    n = n * 10 + (t->ptr[i] - '0');
+  }
+  return n;
+}
+
+static int hex4(const char *p, const char *end) {
+  int i, c, n = 0;
+
+  if (end - p < 4)
+    return -1;
+  for (i = 0; i < 4; i++) {
+    c = p[i];
+    if (c >= '0' && c <= '9')
+      c -= '0';
+    else if (c >= 'a' && c <= 'f')
+      c -= 'a' - 10;
+    else if (c >= 'A' && c <= 'F')
+      c -= 'A' - 10;
+    else
+      return -1;
+    n = n * 16 + c;
+  }
+  return n;
+}
+
+/* Encode the code point C as UTF-8 at DST.  Returns the number of bytes. */
+static size_t utf8(unsigned long c, char *dst) {
+  if (c < 0x80) {
+    dst[0] = c;
+    return 1;
+  }
+  if (c < 0x800) {
+    dst[0] = 0xc0 | (c >> 6);
+    dst[1] = 0x80 | (c & 0x3f);
+    return 2;
+  }
+  if (c < 0x10000) {
+    dst[0] = 0xe0 | (c >> 12);
+    dst[1] = 0x80 | ((c >> 6) & 0x3f);
+    dst[2] = 0x80 | (c & 0x3f);
+    return 3;
+  }
+  dst[0] = 0xf0 | (c >> 18);
+  dst[1] = 0x80 | ((c >> 12) & 0x3f);
+  dst[2] = 0x80 | ((c >> 6) & 0x3f);
+  dst[3] = 0x80 | (c & 0x3f);
+  return 4;
+}
+
+void json_string(const struct json_token *t, char *dst, size_t len) {
+  const char *p = t->ptr, *end = t->ptr + t->len;
+  char buf[4];
+  size_t o = 0, n;
+  long c, lo;
+
+  if (len == 0)
+    return;
+  while (p < end) {
+    if (*p != '\\') {
+      buf[0] = *p++;
+      n = 1;
+    } else if (++p == end) {
+      break;
+    } else if (*p != 'u') {
+      switch (*p) {
+      case 'b': buf[0] = '\b'; break;
+      case 'f': buf[0] = '\f'; break;
+      case 'n': buf[0] = '\n'; break;
+      case 'r': buf[0] = '\r'; break;
+      case 't': buf[0] = '\t'; break;
+      default: buf[0] = *p; break; /* '"', '\\' and '/' */
+      }
+      p++;
+      n = 1;
+    } else {
+      if ((c = hex4(p + 1, end)) == -1)
+        break;
+      p += 5;
+      /* a surrogate pair */
+      if (c >= 0xd800 && c < 0xdc00 && end - p >= 6 && p[0] == '\\' &&
+          p[1] == 'u' && (lo = hex4(p + 2, end)) >= 0xdc00 && lo < 0xe000) {
+        c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+        p += 6;
+      } else if (c >= 0xd800 && c < 0xe000) {
+        c = 0xfffd;
+      }
+      n = utf8(c, buf);
+    }
+    if (o + n >= len)
+      break;
+    memcpy(dst + o, buf, n);
+    o += n;
+  }
+  dst[o] = '\0';
+}
+
+int json_is(const struct json_token *t, const char *s) {
+  return (t->type == JSON_KEY || t->type == JSON_STRING) &&
+         strlen(s) == t->len && memcmp(t->ptr, s, t->len) == 0;
+}
+
+#ifdef STANDALONE
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Read INPUT, feeding it in chunks of random size up to MAXCHUNK (1 for
+ * byte-by-byte), and write a printable dump of the tokens to OUT.  Returns
+ * the type of the last token. */
+static int dump(const char *input, size_t inlen, size_t maxchunk,
+                unsigned *seed, char *out, size_t outlen) {
+  static struct rbuf b;
+  struct json_reader jr = {0};
+  struct json_token t;
+  size_t off = 0, o = 0, n;
+  int type;
+
+  b.start = b.end = 0;
+  for (;;) {
+    type = json_next(&jr, &b, &t);
+    if (type == JSON_MORE) {
+      if (off == inlen)
+        break;
+      memmove(b.data, b.data + b.start, b.end - b.start);
+      b.end -= b.start;
+      b.start = 0;
+      n = maxchunk == 1 ? 1 : 1 + rand_r(seed) % maxchunk;
+      if (n > RBUF_SIZE - b.end)
+        n = RBUF_SIZE - b.end;
+      if (n > inlen - off)
+        n = inlen - off;
+      memcpy(b.data + b.end, input + off, n);
+      b.end += n;
+      off += n;
+      continue;
+    }
+    if (o + t.len + 8 < outlen)
+      o += snprintf(out + o, outlen - o, "%d:%.*s ", type, (int)t.len, t.ptr);
+    if (type == JSON_ERROR || type == JSON_END)
+      break;
+  }
+  out[o] = '\0';
+  return type;
+}
+
+static const char *valid[] = {
+    "{\"a\": [1, -2.5e3, true, false, null], \"b\": {}}",
+    "[[[]], {\"k\": \"v\\\"\\\\\"}, \"\\u00e9\\ud83d\\ude00\"]",
+    " \"top\" ",
+    "{\"methodResponses\":[[\"Mailbox/get\",{\"list\":[]},\"0\"]]}",
+};
+
+static const char *invalid[] = {
+    "{\"a\" 1}", "{\"a\":1,}", "[1 2]", "{1:2}", "[1,]", "[}", "]",
+    "{\"a\":tru}", "\"ctl\x01\"", "{\"a\":[1}",
+};
+
+static void test_cases(void) {
+  char a[4096], b[4096], s[64];
+  struct json_token t;
+  unsigned seed = 1;
+  size_t i, j;
+
+  dump(valid[0], strlen(valid[0]), 4096, &seed, a, sizeof(a));
+  assert(strcmp(a, "2: 6:a 4: 8:1 8:-2.5e3 9: 10: 11: 5: 6:b 2: 3: 3: 12: ") ==
+         0);
+  for (i = 0; i < sizeof(valid) / sizeof(*valid); i++) {
+    assert(dump(valid[i], strlen(valid[i]), 4096, &seed, a, sizeof(a)) ==
+           JSON_END);
+    /* chunking must not change the result */
+    for (j = 1; j < 20; j++) {
+      dump(valid[i], strlen(valid[i]), j, &seed, b, sizeof(b));
+      assert(strcmp(a, b) == 0);
+    }
+  }
+  for (i = 0; i < sizeof(invalid) / sizeof(*invalid); i++)
+    assert(dump(invalid[i], strlen(invalid[i]), 4096, &seed, a, sizeof(a)) ==
+           JSON_ERROR);
+
+  t.type = JSON_STRING;
+  t.ptr = "a\\\"\\n\\u00e9\\ud83d\\ude00";
+  t.len = strlen(t.ptr);
+  json_string(&t, s, sizeof(s));
+  assert(strcmp(s, "a\"\n\xc3\xa9\xf0\x9f\x98\x80") == 0);
+  json_string(&t, s, 3);
+  assert(strcmp(s, "a\"") == 0);
+  t.type = JSON_NUMBER;
+  t.ptr = "1234";
+  t.len = 4;
+  assert(json_number(&t) == 1234);
+  t.ptr = "-1";
+  t.len = 2;
+  assert(json_number(&t) == -1);
+  printf("cases: ok\n");
+}
+
+static void test_fuzz(int rounds) {
+  static const char alphabet[] = " {}[]:,\"\\0123456789-.eEtrufalsn\x01";
+  char input[1024], a[16384], b[16384];
+  unsigned seed = 42;
+  size_t len, i, j;
+  int r;
+
+  for (r = 0; r < rounds; r++) {
+    const char *s = valid[rand_r(&seed) % (sizeof(valid) / sizeof(*valid))];
+
+    len = strlen(s);
+    memcpy(input, s, len);
+    for (j = rand_r(&seed) % 4; j > 0; j--) {
+      i = rand_r(&seed) % len;
+      input[i] = alphabet[rand_r(&seed) % (sizeof(alphabet) - 1)];
+    }
+    dump(input, len, 1 << 20, &seed, a, sizeof(a));
+    dump(input, len, 1 + rand_r(&seed) % 8, &seed, b, sizeof(b));
+    if (strcmp(a, b) != 0) {
+      fprintf(stderr, "fuzz: chunking changed result in round %d\n", r);
+      exit(1);
+    }
+  }
+  printf("fuzz: %d rounds ok\n", rounds);
+}
+
+int main(int argc, char **argv) {
+  test_cases();
+  test_fuzz(argc > 1 ? atoi(argv[1]) : 100000);
+  return 0;
+}
+#endif /* STANDALONE */
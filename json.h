@@ -0,0 +1,63 @@
+/* json.h -- incremental reader for JSON documents
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ */
+
+#ifndef _JSON_H_
+#define _JSON_H_ 1
+
+#include <stddef.h>
+
+#include "proto.h"
+
+#define JSON_MAX_DEPTH (32)
+
+/* Token types returned by json_next() */
+enum json_type {
+  JSON_MORE,  /* not enough data buffered, nothing consumed */
+  JSON_ERROR, /* syntax error, or nesting deeper than JSON_MAX_DEPTH */
+  JSON_BEGIN_OBJECT,
+  JSON_END_OBJECT,
+  JSON_BEGIN_ARRAY,
+  JSON_END_ARRAY,
+  JSON_KEY,    /* name of an object member; contents without the quotes */
+  JSON_STRING, /* contents without the quotes, escapes still in place */
+  JSON_NUMBER,
+  JSON_TRUE,
+  JSON_FALSE,
+  JSON_NULL,
+  JSON_END /* the document is complete; what follows is left alone */
+};
+
+/* Like struct token, a JSON token points into the receive buffer and is only
+ * valid until the buffer is next refilled. */
+struct json_token {
+  int type;
+  const char *ptr;
+  size_t len;
+};
+
+struct json_reader {
+  int depth;                          /* of the containers open */
+  char open[JSON_MAX_DEPTH];          /* '{' or '[' for each of them */
+  int expect;                         /* what may come next, see json.c */
+};
+
+/* Get the next token of the document from B.  The reader must be zeroed
+ * before the first call.  Returns the token type, which is also stored in
+ * T->type; depth counts the token's own container once it is open. */
+int json_next(struct json_reader *jr, struct rbuf *b, struct json_token *t);
+
+/* Value of a JSON_NUMBER that is an integer, or -1 if T isn't one. */
+long long json_number(const struct json_token *t);
+
+/* Copy the string value of a JSON_KEY or JSON_STRING to DST, resolving
+ * escapes, truncated to fit LEN bytes including the terminating NUL. */
+void json_string(const struct json_token *t, char *dst, size_t len);
+
+/* Does the JSON_KEY or JSON_STRING T equal S?  Escapes are compared as
+ * they are. */
+int json_is(const struct json_token *t, const char *s);
+
+#endif /* _JSON_H_ */
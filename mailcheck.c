@@ -17,42 +17,57 @@
  * -f: specify alternative rc file location
  * -h: print usage
  * -n: nopath mode, more brief than brief; not useful with multiple accounts
+ * -d: daemon mode; keep checking and serve results on a UNIX socket
+ * -i: refresh interval for daemon mode, in seconds
+ * -v: verbose mode; report details of server connections on stderr
+ * -q, --any: only find out whether there is any new mail, see exit status
+ * -P: write Prometheus metrics to given file after every run
+ * -j: number of mailboxes to check at the same time
+ * -t: report predicted and actual check times on stderr
+ * -e: estimate counts of local mailboxes larger than the given size
+ * -I: read local mailboxes in the idle I/O class
+ * -B: check the accounts listed in given manifest, printing one record each
+ * -m: connections per server in bulk mode
+ * -w: also write the results to the snapshot file
+ * -S: print the results in the snapshot file, refreshing it if older than
+ *     given number of seconds
+ * -z: also report the size of local mailboxes
  */
 
+#define _GNU_SOURCE /* strcasestr() */
+
 #include <ctype.h>
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-#include "netrc.h"
-
-#define BUF_SIZE (2048)
-
-extern int sock_connect(char *hostname, int port);
+#include "mailcheck.h"
+#include "metrics.h"
+#include "probes.h"
 
 /* Global variables */
 char *Homedir;                /* Home directory pathname */
 unsigned short have_mail = 0; /* Any mail found? */
-struct {
-  unsigned short login_mode;     /* see '-l' option */
-  unsigned short brief_mode;     /* see '-b' option */
-  unsigned short nopath_mode;    /* see '-n' option */
-  unsigned short advanced_count; /* see '-c' option */
-  unsigned short show_summary;   /* see '-s' option */
-  char *rcfile_path;             /* see '-f' option */
-} Options = {0, 0, 0, 0, 0, NULL};
+__thread int probe_mailbox = -1;  /* see probes.h */
+struct options Options = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 60, 0, 4, 0, 0, NULL, NULL, NULL};
 
 /* Print usage information. */
 void print_usage(void) {
-  printf("Usage: mailcheck [-bchls] [-f rcfile]\n"
+  printf("Usage: mailcheck [-bchlnqsdtvIwz] [-i interval] [-j jobs] [-e size] "
+         "[-f rcfile] [-P file]\n"
+         "       mailcheck -S[max-age] [-bns]\n"
+         "       mailcheck -B manifest [-j jobs] [-m connections] [-P file]\n"
          "\n"
          "Options:\n"
          "  -b  - brief output mode\n"
@@ -62,6 +77,24 @@ void print_usage(void) {
          "  -l  - login mode, honor ~/.hushlogin file\n"
          "  -s  - show \"no mail\" summary, if no new mail was found\n"
          "  -f  - specify alternative rcfile location\n"
+         "  -d  - daemon mode, serve results to other mailcheck processes\n"
+         "  -i  - refresh interval for daemon mode, in seconds\n"
+         "  -v  - report details of server connections\n"
+         "  -q  - print nothing, exit with 0 if there is new mail, 1 if not\n"
+         "        (--any)\n"
+         "  -P  - write metrics for Prometheus to given file after each run\n"
+         "  -j  - number of mailboxes to check at the same time\n"
+         "  -t  - report predicted and actual time of each check\n"
+         "  -e  - estimate counts, reading no more than size bytes (k, M, G)\n"
+         "        of each local mailbox\n"
+         "  -I  - read local mailboxes only when the disk is otherwise idle\n"
+         "  -B  - check the accounts listed in manifest (- for stdin) and\n"
+         "        print a record for each (--bulk)\n"
+         "  -m  - connections to each server with -B (default 4)\n"
+         "  -w  - also write the results to the snapshot file\n"
+         "  -z  - also report the size of local mailboxes\n"
+         "  -S  - print the results in the snapshot file, refresh them in the\n"
+         "        background if older than max-age seconds (--from-snapshot)\n"
          "  -h  - show this help screen\n"
          "\n");
 }
@@ -97,46 +130,79 @@ FILE *open_rcfile(void) {
   return rcfile;
 }
 
-/* Expand environment variables.  Input buffer must be long enough
- * to hold output.  Nested $()'s don't work.
- */
-char *expand_envstr(char *path) {
-  char *srcptr, *envptr, *tmpptr, *dup, *envname;
-  int len;
+/* Build the path of NAME in the private state directory ~/.mailcheck (or in
+ * its subdirectory SUBDIR, if not NULL), creating the directories as needed.
+ * Returns -1 if that fails or the path does not fit into BUF. */
+int state_path(char *buf, size_t len, const char *subdir, const char *name) {
+  int n;
 
-  srcptr = strstr(path, "$(");
-  if (!srcptr)
-    return path;
+  n = snprintf(buf, len, "%s/.mailcheck", Homedir);
+  if (n < 0 || (size_t)n >= len || (mkdir(buf, 0700) && errno != EEXIST))
+    return -1;
 
-  len = strlen(path);
-  if (!len)
-    return path;
+  if (subdir) {
+    n = snprintf(buf, len, "%s/.mailcheck/%s", Homedir, subdir);
+    if (n < 0 || (size_t)n >= len || (mkdir(buf, 0700) && errno != EEXIST))
+      return -1;
+  }
 
-  dup = malloc(len + 1);
-  if (!dup)
-    return path;
+  n = snprintf(buf, len, "%s/.mailcheck/%s%s%s", Homedir, subdir ? subdir : "",
+               subdir ? "/" : "", name);
+  return (n < 0 || (size_t)n >= len) ? -1 : 0;
+}
 
-  strcpy(dup, path);
-  envptr = strstr(dup, "$(") + 2;
-  tmpptr = strchr(envptr, ')');
-  if (!tmpptr) {
-    free(dup);
-    return path;
+/* Build the path of the state file of KEY (a mailbox, user@host:port...) in
+ * SUBDIR, like state_path().  KEY is escaped into one file name: '/' becomes
+ * '_', while '_' and '%' become "%_" and "%%", so that no two keys share a
+ * file, and no file name ends like a temporary file of state_create(). */
+int state_file(char *buf, size_t len, const char *subdir, const char *key) {
+  char name[BUF_SIZE];
+  size_t n = 0;
+
+  for (; *key; key++) {
+    if (n + 3 > sizeof(name))
+      return -1;
+    if (*key == '_' || *key == '%')
+      name[n++] = '%';
+    name[n++] = *key == '/' ? '_' : *key;
   }
+  name[n] = '\0';
+  return state_path(buf, len, subdir, name);
+}
 
-  *tmpptr = 0;
-  *srcptr = 0;
-  envname = getenv(envptr);
-  if (envname)
-    strcat(srcptr, envname);
-  strcat(srcptr, tmpptr + 1);
+/* Start replacing FILE: returns a stream on a new temporary file next to it,
+ * whose name is stored into TMP (of LEN bytes), or NULL.  Every writer gets
+ * its own, so processes and threads saving the same file at once don't
+ * clobber each other's work. */
+FILE *state_create(const char *file, char *tmp, size_t len) {
+  FILE *fp;
+  int fd, n;
+
+  n = snprintf(tmp, len, "%s%%XXXXXX", file);
+  if (n < 0 || (size_t)n >= len || (fd = mkstemp(tmp)) == -1)
+    return NULL;
+  if ((fp = fdopen(fd, "w")) == NULL) {
+    close(fd);
+    unlink(tmp);
+  }
+  return fp;
+}
 
-  free(dup);
-  return expand_envstr(path);
+/* Finish replacing FILE with the temporary file TMP written to FP: unless
+ * FAILED or writing failed, it takes the place of FILE at once, otherwise it
+ * is removed.  Returns -1 if FILE was not replaced. */
+int state_commit(FILE *fp, const char *tmp, const char *file, int failed) {
+  failed |= ferror(fp);
+  if (fclose(fp) != 0 || failed || rename(tmp, file) != 0) {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
 }
 
 /* Should entry in maildir be ignored? */
-inline int ignore_maildir_entry(const char *dir, const struct dirent *entry) {
+static inline int ignore_maildir_entry(const char *dir,
+                                       const struct dir_entry *entry) {
   char fname[BUF_SIZE];
   struct stat filestat;
 
@@ -147,12 +213,10 @@ inline int ignore_maildir_entry(const char *dir, const struct dirent *entry) {
     /* also count only regular files
      * use dirent's d_type if possible, otherwise stat file (which is much
      * slower) */
-#ifdef _DIRENT_HAVE_D_TYPE
   if (entry->d_type != DT_UNKNOWN) {
     if (entry->d_type != DT_REG)
       return 1;
   } else {
-#endif /* _DIRENT_HAVE_D_TYPE */
     snprintf(fname, sizeof(fname), "%s/%s", dir, entry->d_name);
     fname[sizeof(fname) - 1] = '\0';
 
@@ -163,158 +227,115 @@ inline int ignore_maildir_entry(const char *dir, const struct dirent *entry) {
 
     if (!S_ISREG(filestat.st_mode))
       return 1;
-#ifdef _DIRENT_HAVE_D_TYPE
   }
-#endif /* _DIRENT_HAVE_D_TYPE */
 
   return 0;
 }
 
-/* Count files in subdir of maildir (new/cur/tmp). */
-int count_entries(char *path) {
-  DIR *mdir;
-  struct dirent *entry;
+/* Add the size of message NAME in directory DFD to *SIZE: from the
+ * ",S=<bytes>" that delivery agents put in the name, or else from fstatat(). */
+static void add_message_size(int dfd, const char *name, long long *size) {
+  const char *tag = strstr(name, ",S=");
+  struct stat st;
+  char *end;
+  long long n;
+
+  if (tag && (n = strtoll(tag + 3, &end, 10)) >= 0 && end > tag + 3 &&
+      (*end == '\0' || *end == ',' || *end == ':'))
+    *size += n;
+  else if (fstatat(dfd, name, &st, 0) == 0)
+    *size += st.st_size;
+}
+
+/* Size of the Maildir++ maildir PATH according to its maildirsize file:
+ * below the quota definition, each line holds a change in bytes and in
+ * messages.  Returns -1 if there is no such file. */
+static long long maildirsize(const char *path) {
+  char file[BUF_SIZE], line[256];
+  long long size = 0;
+  FILE *fp;
+
+  if ((size_t)snprintf(file, sizeof(file), "%s/maildirsize", path) >=
+          sizeof(file) ||
+      (fp = fopen(file, "r")) == NULL)
+    return -1;
+  if (fgets(line, sizeof(line), fp)) /* the quota */
+    while (fgets(line, sizeof(line), fp))
+      size += strtoll(line, NULL, 10);
+  fclose(fp);
+  return size < 0 ? 0 : size;
+}
+
+/* Count files in subdir of maildir (new/cur/tmp), adding their size to
+ * *SIZE if SIZE is not NULL. */
+int count_entries(char *path, long long *size) {
+  struct dir_stream mdir;
+  struct dir_entry *entry;
   int count = 0;
+  long long t0 = probe_ns();
 
-  if ((mdir = opendir(path)) == NULL)
+  if (dir_open(&mdir, path) != 0)
     return -1;
 
-  while ((entry = readdir(mdir))) {
+  while ((entry = dir_read(&mdir))) {
     if (ignore_maildir_entry(path, entry))
       continue;
 
     count++;
+    if (size)
+      add_message_size(mdir.fd, entry->d_name, size);
   }
 
-  closedir(mdir);
+  dir_close(&mdir);
+  PROBE4(dir_scan, probe_mailbox, path, count, probe_ns() - t0);
+  metrics_scanned(0, count);
 
   return count;
 }
 
-/* Get password for given account on given host from ~/.netrc file. */
-char *getpw(char *host, char *account) {
-  char file[256];
-  struct stat sb;
-  netrc_entry *head, *a;
-
-  snprintf(file, sizeof(file), "%s/.netrc", Homedir);
-
-  if (stat(file, &sb))
-    return 0;
-
-  if (sb.st_mode & 077) {
-    static int issued_warning = 0;
+/* Count mails in unix mbox. */
+int check_mbox(const char *path, int *new, int *read, int *unread) {
+  FILE *mbox;
 
-    if (!issued_warning++)
-      fprintf(stderr,
-              "mailcheck: WARNING! %s may be readable by other users.\n"
-              "mailcheck: Type \"chmod 0600 %s\" to correct the permissions.\n",
-              file, file);
+  if ((mbox = mbox_open(path, 1)) == NULL) {
+    fprintf(stderr, "mailcheck: unable to open mbox %s\n", path);
+    metrics_error(ERROR_OPEN);
+    return -1;
   }
 
-  head = parse_netrc(file);
-  if (!head) {
-    static int issued_warning = 0;
-
-    if (!issued_warning++)
-      fprintf(stderr, "mailcheck: WARNING! %s could not be read.\n", file);
-    return 0;
-  }
+  count_mbox(mbox, new, read, unread);
+  fclose(mbox);
 
-  if (host && account) {
-    a = search_netrc(head, host, account);
-    if (a && a->password)
-      return (a->password);
-  }
   return 0;
 }
 
-/* returns port number, or zero on error */
-/* returns hostname, box, user, and pass through pointers */
-int getnetinfo(const char *path, char *hostname, char *box, char *user,
-               char *pass) {
-  char buf[BUF_SIZE];
-  int port = 0;
-  char *p, *q, *h, *proto;
-
-  strncpy(buf, path, BUF_SIZE - 1);
-  /* first separate "protocol:" part */
-  p = strchr(buf, ':');
-  if (!p)
-    return (0);
-  *p = '\0';
-  proto = buf;
-  h = p + 1;
-  if (!strcmp(proto, "pop3"))
-    port = 110;
-  else if (!strcmp(proto, "imap"))
-    port = 143;
-  /* handle "pop3://hostname" form */
-  while (*h == '/')
-    h++;
-  /* change "hostname/" or "hostname/something" to "hostname" */
-  p = strchr(h, '/');
-  if (p) {
-    *p = '\0';
-    p++;
-    if (*p != '\0')
-      strncpy(box, p, BUF_SIZE - 1);
-    else
-      strcpy(box, "INBOX");
-  } else
-    strcpy(box, "INBOX");
-  /* determine username -- look for user@hostname, else use USER */
-  p = strrchr(h, '@');
-  if (p) {
-    *p = '\0';
-    p++;
-    q = h;
-    h = p;
-  } else {
-    /* default to getenv("USER") */
-    q = getenv("USER");
-    if (!q)
-      return (0);
-  }
-  strncpy(user, q, 127);
-  /* check for port specification */
-  p = strchr(h, ':');
-  if (p) {
-    *p = '\0';
-    p++;
-    if (isdigit(*p)) {
-      int n = atoi(p);
-      if (n > 0)
-        port = n;
-    }
-  }
-  strncpy(hostname, h, 127);
-
-  /* get password for this hostname and username from $HOME/.netrc */
-  p = getpw(hostname, user);
-  if (p)
-    strncpy(pass, p, 127);
+/* Classify a message of an mbox by its "Status: " header LINE. */
+int mbox_status(const char *line) {
+  int linelen = strlen(line);
 
-  return (port);
+  if (linelen >= 10 && ((line[8] == 'R' && line[9] == 'O') ||
+                        (line[8] == 'O' && line[9] == 'R')))
+    return MSG_READ;
+  if (linelen >= 9 && line[8] == 'O')
+    return MSG_UNREAD;
+  return MSG_NEW;
 }
 
-/* Count mails in unix mbox. */
-int check_mbox(const char *path, int *new, int *read, int *unread) {
+/* Count mails in an open unix mbox; the work horse of check_mbox(). */
+void count_mbox(FILE *mbox, int *new, int *read, int *unread) {
   char linebuf[BUF_SIZE];
-  FILE *mbox;
-  int linelen;
   unsigned short in_header = 0; /* do we parse mail header or mail body? */
-
-  if ((mbox = fopen(path, "r")) == NULL) {
-    fprintf(stderr, "mailcheck: unable to open mbox %s\n", path);
-    return -1;
-  }
+  unsigned lines = 0;
+  long long t0 = probe_ns();
 
   *new = 0;
   *read = 0;
   *unread = 0;
 
   while (fgets(linebuf, sizeof(linebuf), mbox)) {
+    if (++lines % MBOX_CHUNK_LINES == 0)
+      PROBE4(mbox_chunk, probe_mailbox, ftell(mbox), *new + *read + *unread,
+             probe_ns() - t0);
     if (!in_header) {
       if (strncmp(linebuf, "From ", 5) == 0) { /* 5 == strlen("From ") */
         in_header = 1;
@@ -325,34 +346,47 @@ int check_mbox(const char *path, int *new, int *read, int *unread) {
         in_header = 0;
       } else if (strncmp(linebuf, "Status: ", 8) ==
                  0) { /* 8 == strlen("Status: ") */
-        linelen = strlen(linebuf);
-
-        if (linelen >= 10 && ((linebuf[8] == 'R' && linebuf[9] == 'O') ||
-                              (linebuf[8] == 'O' && linebuf[9] == 'R'))) {
+        switch (mbox_status(linebuf)) {
+        case MSG_READ:
           (*new)--;
           (*read)++;
-        } else if (linelen >= 9 && linebuf[8] == 'O') {
+          break;
+        case MSG_UNREAD:
           (*new)--;
           (*unread)++;
+          break;
         }
       }
     }
   }
+  PROBE4(mbox_chunk, probe_mailbox, ftell(mbox), *new + *read + *unread,
+         probe_ns() - t0);
+  metrics_scanned(ftell(mbox), 0);
+}
 
-  fclose(mbox);
+/* Classify a file in maildir/cur by the flags in its name: 1 if it has been
+ * seen, 0 if not, -1 if the info part is not understood. */
+int maildir_flags(const char *name) {
+  const char *pos;
 
-  return 0;
+  if ((pos = strchr(name, ':')) == NULL)
+    return 0;
+  if (pos[1] != '2')
+    return -1;
+  /* search for seen ('S') flag */
+  return strchr(pos, 'S') != NULL;
 }
 
 /* Count mails in maildir.  Slightely modified original Jeff's version.  Just
- * counts files in maildir/new and maildir/cur. */
-int check_maildir_old(const char *path, int *new, int *cur) {
+ * counts files in maildir/new and maildir/cur, and adds up their size if
+ * SIZE is not NULL. */
+int check_maildir_old(const char *path, int *new, int *cur, long long *size) {
   char dir[BUF_SIZE];
 
   snprintf(dir, sizeof(dir), "%s/new", path);
-  *new = count_entries(dir);
+  *new = count_entries(dir, size);
   snprintf(dir, sizeof(dir), "%s/cur", path);
-  *cur = count_entries(dir);
+  *cur = count_entries(dir, size);
 
   if (*new == -1 || *cur == -1)
     return -1;
@@ -361,502 +395,648 @@ int check_maildir_old(const char *path, int *new, int *cur) {
 }
 
 /* Count mails in maildir.  Newer, more sophisticated, but also more time
- * consuming version. */
-int check_maildir(const char *path, int *new, int *read, int *unread) {
+ * consuming version.  Adds up their size, too, if SIZE is not NULL. */
+int check_maildir(const char *path, int *new, int *read, int *unread,
+                  long long *size) {
   char dir[BUF_SIZE];
-  DIR *mdir;
-  struct dirent *entry;
-  char *pos;
+  struct dir_stream mdir;
+  struct dir_entry *entry;
+  long long t0;
 
   /* new mail - standard way */
   snprintf(dir, sizeof(dir), "%s/new", path);
-  *new = count_entries(dir);
+  *new = count_entries(dir, size);
   if (*new == -1)
     return -1;
 
   /* older mail - check also mail status */
   snprintf(dir, sizeof(dir), "%s/cur", path);
-  if ((mdir = opendir(dir)) == NULL)
+  t0 = probe_ns();
+  if (dir_open(&mdir, dir) != 0)
     return -1;
 
   *read = 0;
   *unread = 0;
-  while ((entry = readdir(mdir))) {
+  while ((entry = dir_read(&mdir))) {
     if (ignore_maildir_entry(dir, entry))
       continue;
+    if (size)
+      add_message_size(mdir.fd, entry->d_name, size);
 
-    if ((pos = strchr(entry->d_name, ':')) == NULL) {
+    switch (maildir_flags(entry->d_name)) {
+    case 0:
       (*unread)++;
-    } else if (*(pos + 1) != '2') {
+      break;
+    case 1:
+      (*read)++;
+      break;
+    default:
       fprintf(stderr,
               "mailcheck: ooops, unsupported experimental info "
               "semantics on %s/%s\n",
               dir, entry->d_name);
-      continue;
-    } else if (strchr(pos, 'S') == NULL) {
-      /* search for seen ('S') flag */
-      (*unread)++;
-    } else {
-      (*read)++;
     }
   }
 
-  closedir(mdir);
+  dir_close(&mdir);
+  PROBE4(dir_scan, probe_mailbox, dir, *read + *unread, probe_ns() - t0);
+  metrics_scanned(0, *read + *unread);
 
   return 0;
 }
 
-/* Count mails in pop3 mailbox. */
-int check_pop3(char *path, int *new_p, int *cur_p) {
-  int port;
-  int fd;
-  FILE *fp;
-  char buf[BUF_SIZE];
-  char hostname[BUF_SIZE];
-  char box[BUF_SIZE]; /* not actually used for pop3 */
-  char user[128];
-  char pass[128];
-  int total = 0;
-
-  port = getnetinfo(path, hostname, box, user, pass);
+/* Is there any new or unread mail in unix mbox?  Stops reading at the first
+ * such message, or as soon as *STOP is set. */
+static int mbox_has_mail(const char *path, const int *stop) {
+  char linebuf[BUF_SIZE];
+  FILE *mbox;
+  unsigned short in_header = 0;
+  int seen = 0, found = 0;
 
-  /* connect to host */
-  if ((fd = sock_connect(hostname, port)) == -1)
-    return 1;
-  fp = fdopen(fd, "r+");
-  fgets(buf, BUF_SIZE, fp);
-  fflush(fp);
-  fprintf(fp, "USER %s\r\n", user);
-  fflush(fp);
-  fgets(buf, BUF_SIZE, fp);
-  if (buf[0] != '+') {
-    fprintf(stderr, "mailcheck: Invalid User Name '%s@%s:%d'\n", user, hostname,
-            port);
-#ifdef DEBUG_POP3
-    fprintf(stderr, "%s\n", buf);
-#endif
-    fprintf(fp, "QUIT\r\n");
-    fclose(fp);
-    return 1;
-  };
-
-  fflush(fp);
-  fprintf(fp, "PASS %s\r\n", pass);
-  fflush(fp);
-  fgets(buf, BUF_SIZE, fp);
-  if (buf[0] != '+') {
-    fprintf(stderr, "mailcheck: Incorrect Password for user '%s@%s:%d'\n", user,
-            hostname, port);
-    fprintf(stderr, "mailcheck: Server said %s", buf);
-    fprintf(fp, "QUIT\r\n");
-    fclose(fp);
-    return 1;
-  };
-
-  fflush(fp);
-  fprintf(fp, "STAT\r\n");
-  fflush(fp);
-  fgets(buf, BUF_SIZE, fp);
-  if (buf[0] != '+') {
-    fprintf(stderr, "mailcheck: Error Receiving STAT '%s@%s:%d'\n", user,
-            hostname, port);
-    return 1;
-  } else {
-    sscanf(buf, "+OK %d", &total);
+  if ((mbox = mbox_open(path, 1)) == NULL) {
+    fprintf(stderr, "mailcheck: unable to open mbox %s\n", path);
+    metrics_error(ERROR_OPEN);
+    return 0;
   }
 
-  fflush(fp);
-  fprintf(fp, "LAST\r\n");
-  fflush(fp);
-  fgets(buf, BUF_SIZE, fp);
-  if (buf[0] != '+') {
-    /* Server does not support LAST. Assume total as new */
-    *new_p = total;
-    *cur_p = 0;
-  } else {
-    sscanf(buf, "+OK %d", cur_p);
-    *new_p = total - *cur_p;
+  while (!found && fgets(linebuf, sizeof(linebuf), mbox)) {
+    if (!in_header) {
+      if (strncmp(linebuf, "From ", 5) == 0) {
+        in_header = 1;
+        seen = 0;
+        if (__atomic_load_n(stop, __ATOMIC_RELAXED))
+          break;
+      }
+    } else if (linebuf[0] == '\n') {
+      in_header = 0;
+      found = !seen;
+    } else if (strncmp(linebuf, "Status: ", 8) == 0) {
+      seen = (linebuf[8] == 'R' && linebuf[9] == 'O') ||
+             (linebuf[8] == 'O' && linebuf[9] == 'R');
+    }
   }
+  if (in_header && !seen)
+    found = 1;
 
-  fprintf(fp, "QUIT\r\n");
-  fclose(fp);
-
-  return 0;
+  metrics_scanned(ftell(mbox), 0);
+  fclose(mbox);
+  return found;
 }
 
-/* Count mails in imap mailbox. */
-int check_imap(char *path, int *new_p, int *cur_p) {
-  int port;
-  int fd;
-  FILE *fp;
-  char buf[BUF_SIZE];
-  char hostname[BUF_SIZE];
-  char box[BUF_SIZE];
-  char user[128];
-  char pass[128];
-  int total = 0;
-
-  port = getnetinfo(path, hostname, box, user, pass);
-  if (port == 0) {
-    fprintf(stderr, "mailcheck: Unable to get login information for %s\n",
-            path);
-    return 1;
-  }
-
-  if ((fd = sock_connect(hostname, port)) == -1) {
-    fprintf(stderr, "mailcheck: Not Connected To Server '%s:%d'\n", hostname,
-            port);
-    return 1;
-  }
-
-  fp = fdopen(fd, "r+");
-  fgets(buf, BUF_SIZE, fp);
-
-  /* Login to the server */
-  fflush(fp);
-  fprintf(fp, "a001 LOGIN %s %s\r\n", user, pass);
+/* Is there any new or unread mail in maildir?  Stops at the first entry of
+ * new/, or the first entry of cur/ without the seen flag.  Returns -1 if
+ * there is no new/. */
+static int maildir_has_mail(const char *path, const int *stop) {
+  char dir[BUF_SIZE];
+  struct dir_stream mdir;
+  struct dir_entry *entry;
+  int found = 0, entries = 0;
+  long long t0 = probe_ns();
 
-  /* Ensure that the buffer is not an informational line */
-  do {
-    fflush(fp);
-    fgets(buf, BUF_SIZE, fp);
-  } while (buf[0] == '*');
+  snprintf(dir, sizeof(dir), "%s/new", path);
+  if (dir_open(&mdir, dir) != 0)
+    return -1;
+  while (!found && (entry = dir_read(&mdir)))
+    found = !ignore_maildir_entry(dir, entry);
+  dir_close(&mdir);
+  PROBE4(dir_scan, probe_mailbox, dir, found, probe_ns() - t0);
+  metrics_scanned(0, found);
+  if (found || __atomic_load_n(stop, __ATOMIC_RELAXED))
+    return found;
 
-  if (buf[5] != 'O') { /* Looking for "a001 OK" */
-    fprintf(fp, "a002 LOGOUT\r\n");
-    fclose(fp);
-    fprintf(stderr, "mailcheck: Unable to check IMAP mailbox '%s@%s:%d'\n",
-            user, hostname, port);
-    fprintf(stderr, "mailcheck: Server said %s", buf);
-    return 1;
-  };
-
-  fflush(fp);
-  fprintf(fp, "a003 STATUS %s (MESSAGES UNSEEN)\r\n", box);
-  fflush(fp);
-  fgets(buf, BUF_SIZE, fp);
-  if (buf[0] != '*') { /* Looking for "* STATUS ..." */
-    fprintf(stderr, "mailcheck: Error Receiving Stats '%s@%s:%d'\n\t%s\n", user,
-            hostname, port, buf);
-    fclose(fp);
-    return 1;
-  } else {
-    sscanf(buf, "* STATUS %*s (MESSAGES %d UNSEEN %d)", &total, new_p);
-#ifdef DEBUG_IMAP4
-    fprintf(stderr, "[%s:%d] %s", __FILE__, __LINE__, buf);
-#endif
-    fgets(buf, BUF_SIZE, fp);
-#ifdef DEBUG_IMAP4
-    fprintf(stderr, "[%s:%d] %s", __FILE__, __LINE__, buf);
-#endif
-    *cur_p = total - *new_p;
+  snprintf(dir, sizeof(dir), "%s/cur", path);
+  t0 = probe_ns();
+  if (dir_open(&mdir, dir) != 0)
+    return 0;
+  while (!found && !__atomic_load_n(stop, __ATOMIC_RELAXED) &&
+         (entry = dir_read(&mdir))) {
+    if (ignore_maildir_entry(dir, entry))
+      continue;
+    entries++;
+    found = maildir_flags(entry->d_name) == 0;
   }
+  dir_close(&mdir);
+  PROBE4(dir_scan, probe_mailbox, dir, entries, probe_ns() - t0);
+  metrics_scanned(0, entries);
+  return found;
+}
 
-  fflush(fp);
-
-  fprintf(fp, "a004 LOGOUT\r\n");
-  fclose(fp);
-
-  return 0;
+/* Is PATH a pop3:, pop3s:, imap:, imaps: or jmap: URL? */
+int is_remote(const char *path) {
+  return strncmp(path, "pop3:", 5) == 0 || strncmp(path, "imap:", 5) == 0 ||
+         strncmp(path, "pop3s:", 6) == 0 || strncmp(path, "imaps:", 6) == 0 ||
+         strncmp(path, "jmap:", 5) == 0;
 }
 
-/* Check for mail in given mail path (could be mbox, maildir, pop3 or imap). */
-void check_for_mail(char *tmppath) {
-  struct stat st;
-  char *mailpath;
+/* Print the counts of one mailbox, honouring the output mode selected on the
+ * command line. */
+static void report_counts(const struct mail_status *status) {
+  const char *mailpath = status->path;
   int brief_name_offset = 0;
+  int new = status->new;
+  int unread = status->unread;
+  int cur = status->saved;
   char *new_plural = "";
   char *cur_plural = "";
   char *unread_plural = "";
 
-  /* expand environment variables in path specifier */
-  mailpath = expand_envstr(tmppath);
-
   /* in brief mode, print relative paths for mailboxes/maildirs inside home
    * directory */
   if (Options.brief_mode && strncmp(mailpath, Homedir, strlen(Homedir)) == 0) {
     brief_name_offset = strlen(Homedir) + 1;
   }
 
+  /* sampled with -e: say so, and how far off the counts may be; a margin
+   * of -1 means the sample had nothing to go by */
+  if (status->estimated) {
+    char new_text[64], unread_text[64];
+
+    if (new == 0 && unread == 0 && status->new_margin >= 0 &&
+        status->unread_margin >= 0)
+      return;
+    if (status->new_margin < 0)
+      snprintf(new_text, sizeof(new_text), "an unknown number of");
+    else
+      snprintf(new_text, sizeof(new_text), "about %d (+/-%d)", new,
+               status->new_margin);
+    if (status->unread_margin < 0)
+      snprintf(unread_text, sizeof(unread_text), "an unknown number of");
+    else
+      snprintf(unread_text, sizeof(unread_text), "%d (+/-%d)", unread,
+               status->unread_margin);
+    if (Options.brief_mode) {
+      printf("%s: %s new and %s unread messages (estimated)\n",
+             mailpath + brief_name_offset, new_text, unread_text);
+    } else if (Options.nopath_mode) {
+      new_text[0] = toupper((unsigned char)new_text[0]);
+      printf("%s new and %s unread messages (estimated).\n", new_text,
+             unread_text);
+    } else {
+      printf("You have %s new and %s unread messages in %s (estimated)\n",
+             new_text, unread_text, mailpath);
+    }
+    have_mail = 1;
+    return;
+  }
+
+  /* rd: plurals */
+  if (new > 1) {
+    new_plural = "s";
+  }
+  if (cur > 1) {
+    cur_plural = "s";
+  }
+  if (unread > 1) {
+    unread_plural = "s";
+  }
+
+  if (status->type == MB_MBOX && !status->counted) {
+    if (new > 0 || cur > 0) {
+      if (!Options.brief_mode) {
+        printf("You have %smail in %s\n", new ? "new " : "", mailpath);
+      } else {
+        printf("%s: %smail message(s)\n", mailpath + brief_name_offset,
+               new ? "new " : "contains saved ");
+      }
+      have_mail = 1;
+    }
+  } else if (status->type == MB_MBOX) { /* advanced count */
+    if (Options.brief_mode) {
+      if (new > 0 && unread > 0) {
+        printf("%s: %d new message%s and %d unread message%s\n",
+               mailpath + brief_name_offset, new, new_plural, unread,
+               unread_plural);
+        have_mail = 1;
+      } else if (new > 0) {
+        printf("%s: %d new message%s\n", mailpath + brief_name_offset, new,
+               new_plural);
+        have_mail = 1;
+      } else if (unread > 0) {
+        printf("%s: no new mail, %d unread message%s\n",
+               mailpath + brief_name_offset, unread, unread_plural);
+        have_mail = 1;
+      }
+    } else if (Options.nopath_mode) {
+      if (unread > 0 && new > 0) {
+        printf("%d new message%s and %d saved message%s.\n", new, new_plural,
+               unread, unread_plural);
+        have_mail = 1;
+      } else if (new > 0) {
+        printf("%d new message%s.\n", new, new_plural);
+        have_mail = 1;
+      } else if (unread > 0) {
+        printf("%d saved message%s.\n", unread, unread_plural);
+        have_mail = 1;
+      }
+    } else { /*traditional*/
+      if (new > 0 && unread > 0) {
+        printf("You have %d new and %d unread messages in %s\n", new, unread,
+               mailpath);
+        have_mail = 1;
+      } else if (new > 0) {
+        printf("You have %d new messages in %s\n", new, mailpath);
+        have_mail = 1;
+      } else if (unread > 0) {
+        printf("You have %d unread messages in %s\n", unread, mailpath);
+        have_mail = 1;
+      }
+    }
+  } else if ((status->type == MB_MAILDIR || status->type == MB_MH) &&
+             !status->counted) {
+    if (Options.brief_mode) { /* brief output */
+      if (cur > 0 && new > 0) {
+        printf("%s: %d new message%s and %d saved message%s\n",
+               mailpath + brief_name_offset, new, new_plural, cur, cur_plural);
+        have_mail = 1;
+      } else if (new > 0) {
+        printf("%s: %d new message%s\n", mailpath + brief_name_offset, new,
+               new_plural);
+        have_mail = 1;
+      } else if (cur > 0) {
+        printf("%s: %d saved message%s\n", mailpath + brief_name_offset, cur,
+               cur_plural);
+        have_mail = 1;
+      }
+    }                               // end if brief mode
+    else if (Options.nopath_mode) { /* nopath mode */
+      if (cur > 0 && new > 0) {
+        printf("%d new message%s and %d saved message%s.\n", new, new_plural,
+               cur, cur_plural);
+        have_mail = 1;
+      } else if (new > 0) {
+        printf("%d new message%s.\n", new, new_plural);
+        have_mail = 1;
+      } else if (cur > 0) {
+        printf("%d saved message%s.\n", cur, cur_plural);
+        have_mail = 1;
+      }
+    }      // end if nopath mode
+    else { /* traditional output */
+      if (cur > 0 && new > 0) {
+        printf("You have %d new message%s and %d saved message%s in %s\n", new,
+               new_plural, cur, cur_plural, mailpath);
+        have_mail = 1;
+      } else if (new > 0) {
+        printf("You have %d new message%s in %s\n", new, new_plural, mailpath);
+        have_mail = 1;
+      } else if (cur > 0) {
+        printf("You have %d saved message%s in %s\n", cur, cur_plural,
+               mailpath);
+        have_mail = 1;
+      }
+    } // end traditional mode
+  } else if (status->type == MB_MAILDIR) { /* new counting method */
+    if (!Options.brief_mode && !Options.nopath_mode) { /* traditional output */
+      if (new > 0 && unread > 0) {
+        printf("You have %d new message%s and %d unread message%s in %s\n",
+               new, new_plural, unread, unread_plural, mailpath);
+        have_mail = 1;
+      } else if (new > 0) {
+        printf("You have %d new message%s in %s\n", new, new_plural, mailpath);
+        have_mail = 1;
+      } else if (unread > 0) {
+        printf("You have %d unread message%s in %s\n", unread, unread_plural,
+               mailpath);
+        have_mail = 1;
+      }
+    } else if (Options.brief_mode) { /* brief output */
+      if (new > 0 && unread > 0) {
+        printf("%s: %d new message%s and %d unread message%s\n",
+               mailpath + brief_name_offset, new, new_plural, unread,
+               unread_plural);
+        have_mail = 1;
+      } else if (new > 0) {
+        printf("%s: %d new message%s\n", mailpath + brief_name_offset, new,
+               new_plural);
+        have_mail = 1;
+      } else if (unread > 0) {
+        printf("%s: no new mail, %d unread message%s\n",
+               mailpath + brief_name_offset, unread, unread_plural);
+        have_mail = 1;
+      }
+    } else { /* rd: nopath mode */
+      if (unread > 0 && new > 0) {
+        printf("%d new message%s and %d unread message%s.\n", new, new_plural,
+               unread, unread_plural);
+        have_mail = 1;
+      } else if (new > 0) {
+        printf("%d new message%s.\n", new, new_plural);
+        have_mail = 1;
+      } else if (unread > 0) {
+        printf("No new mail, %d unread message%s.\n", unread, unread_plural);
+        have_mail = 1;
+      }
+    }
+  } else { /* pop3 or imap */
+    if (!Options.brief_mode && !Options.nopath_mode) { /* traditional output */
+      if (cur > 0 && new > 0) {
+        printf("You have %d new message%s and %d saved message%s in %s\n", new,
+               new_plural, cur, cur_plural, mailpath);
+        have_mail = 1;
+      } else if (new > 0) {
+        printf("You have %d new message%s in %s\n", new, new_plural, mailpath);
+        have_mail = 1;
+      } else if (cur > 0) {
+        printf("You have %d saved message%s in %s\n", cur, cur_plural,
+               mailpath);
+        have_mail = 1;
+      }
+    } else if (Options.brief_mode) { /* brief output */
+      if (cur > 0 && new > 0) {
+        printf("%s: %d new message%s and %d saved message%s.\n",
+               mailpath + brief_name_offset, new, new_plural, cur, cur_plural);
+        have_mail = 1;
+      } else if (new > 0) {
+        printf("%s: %d new message%s.\n", mailpath + brief_name_offset, new,
+               new_plural);
+        have_mail = 1;
+      } else if (cur > 0) {
+        printf("%s: %d saved message%s.\n", mailpath + brief_name_offset, cur,
+               cur_plural);
+        have_mail = 1;
+      }
+    } else if (Options.nopath_mode) {
+      if (cur > 0 && new > 0) {
+        printf("%d new message%s and %d saved message%s.\n", new, new_plural,
+               cur, cur_plural);
+        have_mail = 1;
+      } else if (new > 0) {
+        printf("%d new message%s.\n", new, new_plural);
+        have_mail = 1;
+      } else if (cur > 0) {
+        printf("%d saved message%s.\n", cur, cur_plural);
+        have_mail = 1;
+      }
+    }
+  }
+}
+
+/* Print SIZE bytes with a unit, as in "1.5M". */
+static void print_size(long long size) {
+  static const char unit[] = "KMGT";
+  double n = size;
+  int u = -1;
+
+  while (n >= 1024 && u < (int)sizeof(unit) - 2) {
+    n /= 1024;
+    u++;
+  }
+  if (u < 0)
+    printf("%lld bytes", size);
+  else
+    printf("%.*f%c", n < 10 ? 1 : 0, n, unit[u]);
+}
+
+/* Print the size of a local mailbox (-z), whether or not it has mail. */
+static void report_size(const struct mail_status *status) {
+  const char *mailpath = status->path;
+
+  if (Options.brief_mode) {
+    if (strncmp(mailpath, Homedir, strlen(Homedir)) == 0)
+      mailpath += strlen(Homedir) + 1;
+    printf("%s: ", mailpath);
+    print_size(status->size);
+    printf("\n");
+  } else if (Options.nopath_mode) {
+    printf("Size: ");
+    print_size(status->size);
+    printf(".\n");
+  } else {
+    printf("Size of %s: ", mailpath);
+    print_size(status->size);
+    printf("\n");
+  }
+}
+
+/* Print the result of checking one mailbox. */
+void report_status(const struct mail_status *status, void *arg) {
+  (void)arg;
+
+  report_counts(status);
+  if (Options.show_size && status->size >= 0)
+    report_size(status);
+}
+
+/* Check for mail in given mailbox (could be mbox, maildir, pop3, imap or
+ * jmap, or a group of imap or jmap mailboxes) and pass the result to FN. */
+static void check_one(const struct mailbox *mb, status_fn fn, void *arg) {
+  struct stat st;
+  struct mail_status status;
+  const char *mailpath = mb->path;
+  int read;
+
+  memset(&status, 0, sizeof(status));
+  strcpy(status.path, mailpath); /* both BUF_SIZE */
+  status.counted = Options.advanced_count;
+  status.size = -1;
+
+  /* Remote mailboxes are named by URL, there is nothing to stat(). */
+  if (mb->type == MB_POP3) {
+    status.counted = 0;
+    status.type = MB_POP3;
+    if (!check_pop3(mb, &status.new, &status.saved))
+      fn(&status, arg);
+    return;
+  } else if (mb->type == MB_IMAP) { /* may report several mailboxes */
+    status.counted = 0;
+    status.type = MB_IMAP;
+    check_imap(mb, mb->group, &status, fn, arg);
+    return;
+  } else if (mb->type == MB_JMAP) { /* one request for all of them */
+    status.counted = 0;
+    status.type = MB_JMAP;
+    check_jmap(mb, mb->group, &status, fn, arg);
+    return;
+  }
+
+  /* Local ones may have changed since the plan was made. */
   if (!stat(mailpath, &st)) {
     /* Is it regular file? (if yes, it should be mailbox ;) */
     if (S_ISREG(st.st_mode)) {
+      status.type = MB_MBOX;
+      if (Options.show_size)
+        status.size = st.st_size;
       /* Use advanced counting? */
       if (!Options.advanced_count) {
-        if (st.st_size != 0) {
-          if (!Options.brief_mode) {
-            printf("You have %smail in %s\n",
-                   (st.st_mtime > st.st_atime) ? "new " : "", mailpath);
-          } else {
-            printf("%s: %smail message(s)\n", mailpath + brief_name_offset,
-                   (st.st_mtime > st.st_atime) ? "new " : "contains saved ");
-          }
-          have_mail = 1;
-        }
-      } else { /* advanced count */
-        int new, read, unread;
-        if (check_mbox(mailpath, &new, &read, &unread) == -1)
+        if (st.st_size == 0)
           return;
+        if (mbox_is_new(mailpath, &st))
+          status.new = 1;
+        else
+          status.saved = 1;
+      } else { /* advanced count */
+        int retval = 1;
 
-        /* rd: plurals */
-        if (new > 1) {
-          new_plural = "s";
-        }
-        if (unread > 1) {
-          unread_plural = "s";
-        }
-
-        if (Options.brief_mode) {
-          if (new > 0 && unread > 0) {
-            printf("%s: %d new message%s and %d unread message%s\n",
-                   mailpath + brief_name_offset, new, new_plural, unread,
-                   unread_plural);
-            have_mail = 1;
-          } else if (new > 0) {
-            printf("%s: %d new message%s\n", mailpath + brief_name_offset, new,
-                   new_plural);
-            have_mail = 1;
-          } else if (unread > 0) {
-            printf("%s: no new mail, %d unread message%s\n",
-                   mailpath + brief_name_offset, unread, unread_plural);
-            have_mail = 1;
-          }
-        } else if (Options.nopath_mode) {
-          if (unread > 0 && new > 0) {
-            printf("%d new message%s and %d saved message%s.\n", new,
-                   new_plural, unread, unread_plural);
-            have_mail = 1;
-          } else if (new > 0) {
-            printf("%d new message%s.\n", new, new_plural);
-            have_mail = 1;
-          } else if (unread > 0) {
-            printf("%d saved message%s.\n", unread, unread_plural);
-            have_mail = 1;
-          }
-        } else { /*traditional*/
-          if (new > 0 && unread > 0) {
-            printf("You have %d new and %d unread messages in %s\n", new,
-                   unread, mailpath);
-            have_mail = 1;
-          } else if (new > 0) {
-            printf("You have %d new messages in %s\n", new, mailpath);
-            have_mail = 1;
-          } else if (unread > 0) {
-            printf("You have %d unread messages in %s\n", unread, mailpath);
-            have_mail = 1;
-          }
-        }
+        if (Options.estimate) /* sample it, if it's large */
+          retval = estimate_mbox(mailpath, st.st_size, &status);
+        if (retval == -1 ||
+            (retval == 1 &&
+             check_mbox(mailpath, &status.new, &read, &status.unread) == -1))
+          return;
       }
     }
 
-    /* Is it directory? (if yes, it should be maildir ;) */
+    /* Is it directory? (if yes, it should be maildir ;) or an MH folder */
     /* for maildir specification, see: http://cr.yp.to/proto/maildir.html */
     else if (S_ISDIR(st.st_mode)) {
-      if (!Options.advanced_count) { /* use old counting method */
-        int new, cur;
+      long long *size = NULL; /* to add up while reading the directories */
+      int retval = 1;
 
-        if (check_maildir_old(mailpath, &new, &cur) == -1) {
-          fprintf(stderr, "mailcheck: %s is not a valid maildir -- skipping.\n",
-                  mailpath);
-          return;
-        }
+      status.type = MB_MAILDIR;
+      if (Options.show_size && (status.size = maildirsize(mailpath)) < 0) {
+        status.size = 0;
+        size = &status.size;
+      }
+      if (!Options.advanced_count) /* use old counting method */
+        retval =
+            check_maildir_old(mailpath, &status.new, &status.saved, size);
+      else {
+        if (Options.estimate) /* sample it, if it's large */
+          retval = estimate_maildir(mailpath, &status);
+        if (retval == 1) /* new counting method */
+          retval = check_maildir(mailpath, &status.new, &read, &status.unread,
+                                 size);
+        else if (size) /* not read in full */
+          status.size = -1;
+      }
 
-        /* rd: plurals */
-        if (new > 1) {
-          new_plural = "s";
-        }
-        if (cur > 1) {
-          cur_plural = "s";
-        }
+      if (retval == -1) { /* maybe an MH folder */
+        status.type = MB_MH;
+        status.size = -1;
+        status.counted = 0;
+        status.unread = 0;
+        status.estimated = 0;
+        retval = check_mh(mailpath, &status.new, &status.saved);
+      }
+      if (retval == -1) {
+        fprintf(stderr,
+                "mailcheck: %s is not a valid maildir or MH folder -- "
+                "skipping.\n",
+                mailpath);
+        metrics_error(ERROR_OPEN);
+        return;
+      }
+    } else {
+      fprintf(stderr, "mailcheck: invalid line '%s' in rc-file\n", mailpath);
+      metrics_error(ERROR_CONFIG);
+      return;
+    }
 
-        if (Options.brief_mode) { /* brief output */
-          if (cur > 0 && new > 0) {
-            printf("%s: %d new message%s and %d saved message%s\n",
-                   mailpath + brief_name_offset, new, new_plural, cur,
-                   cur_plural);
-            have_mail = 1;
-          } else if (new > 0) {
-            printf("%s: %d new message%s\n", mailpath + brief_name_offset, new,
-                   new_plural);
-            have_mail = 1;
-          } else if (cur > 0) {
-            printf("%s: %d saved message%s\n", mailpath + brief_name_offset,
-                   cur, cur_plural);
-            have_mail = 1;
-          }
-        }                               // end if brief mode
-        else if (Options.nopath_mode) { /* nopath mode */
-          if (cur > 0 && new > 0) {
-            printf("%d new message%s and %d saved message%s.\n", new,
-                   new_plural, cur, cur_plural);
-            have_mail = 1;
-          } else if (new > 0) {
-            printf("%d new message%s.\n", new, new_plural);
-            have_mail = 1;
-          } else if (cur > 0) {
-            printf("%d saved message%s.\n", cur, cur_plural);
-            have_mail = 1;
-          }
-        }      // end if nopath mode
-        else { /* traditional output */
-          if (cur > 0 && new > 0) {
-            printf("You have %d new message%s and %d saved message%s in %s\n",
-                   new, new_plural, cur, cur_plural, mailpath);
-            have_mail = 1;
-          } else if (new > 0) {
-            printf("You have %d new message%s in %s\n", new, new_plural,
-                   mailpath);
-            have_mail = 1;
-          } else if (cur > 0) {
-            printf("You have %d saved message%s in %s\n", cur, cur_plural,
-                   mailpath);
-            have_mail = 1;
-          }
-        }    // end traditional mode
-      }      // end old counting method
-      else { /* new counting method */
-        int new, read, unread;
-
-        if (check_maildir(mailpath, &new, &read, &unread) == -1) {
-          fprintf(stderr, "mailcheck: %s is not a valid maildir -- skipping.\n",
-                  mailpath);
-          return;
-        }
+    fn(&status, arg);
+  }
+}
 
-        /* rd: plurals */
-        if (new > 1) {
-          new_plural = "s";
-        }
-        if (unread > 1) {
-          unread_plural = "s";
-        }
+/* Totals of one check_mailbox() call, for the mailbox_done probe. */
+struct tally {
+  status_fn fn;
+  void *arg;
+  int new;
+  int unread;
+  int saved;
+};
+
+static void tally_status(const struct mail_status *status, void *arg) {
+  struct tally *t = arg;
+
+  t->new += status->new;
+  t->unread += status->unread;
+  t->saved += status->saved;
+  metrics_mailbox(status);
+  t->fn(status, t->arg);
+}
 
-        if (!Options.brief_mode &&
-            !Options.nopath_mode) { /* traditional output */
-          if (new > 0 && unread > 0) {
-            printf("You have %d new message%s and %d unread message%s in %s\n",
-                   new, new_plural, unread, unread_plural, mailpath);
-            have_mail = 1;
-          } else if (new > 0) {
-            printf("You have %d new message%s in %s\n", new, new_plural,
-                   mailpath);
-            have_mail = 1;
-          } else if (unread > 0) {
-            printf("You have %d unread message%s in %s\n", unread,
-                   unread_plural, mailpath);
-            have_mail = 1;
-          }
-        } else if (Options.brief_mode) { /* brief output */
-          if (new > 0 && unread > 0) {
-            printf("%s: %d new message%s and %d unread message%s\n",
-                   mailpath + brief_name_offset, new, new_plural, unread,
-                   unread_plural);
-            have_mail = 1;
-          } else if (new > 0) {
-            printf("%s: %d new message%s\n", mailpath + brief_name_offset, new);
-            have_mail = 1;
-          } else if (unread > 0) {
-            printf("%s: no new mail, %d unread message%s\n",
-                   mailpath + brief_name_offset, unread, unread_plural);
-            have_mail = 1;
-          }
-        } else if (Options.nopath_mode) { /* rd: nopath mode */
-          if (unread > 0 && new > 0) {
-            printf("%d new message%s and %d unread message%s.\n", new,
-                   new_plural, unread, unread_plural);
-            have_mail = 1;
-          } else if (new > 0) {
-            printf("%d new message%s.\n", new, new_plural);
-            have_mail = 1;
-          } else if (unread > 0) {
-            printf("No new mail, %d unread message%s.\n", unread,
-                   unread_plural);
-            have_mail = 1;
-          }
-        } else {
-          fprintf(stderr, "mailcheck: error, %s is not mbox or maildir\n",
-                  mailpath);
-        }
-      } /* end if new counting method */
-    } else if (strncmp(mailpath, "pop3:", 5) == 0 ||
-               strncmp(mailpath, "imap:", 5) == 0) { /* if pop3 or imap */
-      int retval = 1;
-      int new = 0, cur = 0;
+void check_mailbox(const struct mailbox *mb, status_fn fn, void *arg) {
+  struct tally t = {fn, arg, 0, 0, 0};
+  long long t0 = probe_ns();
 
-      /* Is it POP3 or IMAP? */
-      if (!strncmp(mailpath, "pop3:", 5))
-        retval = check_pop3(mailpath, &new, &cur);
-      else
-        retval = check_imap(mailpath, &new, &cur);
+  probe_mailbox = mb->id;
+  PROBE3(mailbox_start, mb->id, mb->path, mb->type);
+  check_one(mb, tally_status, &t);
+  t0 = probe_ns() - t0;
+  PROBE6(mailbox_done, mb->id, mb->path, t.new, t.unread, t.saved, t0);
+  probe_mailbox = -1;
 
-      if (retval)
-        return;
+  if (mb->type != MB_POP3 && mb->type != MB_IMAP && mb->type != MB_JMAP)
+    metrics_phase(PHASE_SCAN, t0);
+  metrics_mailbox_time(mb->path, t0);
+}
 
-      /* rd: plurals */
-      char *new_plural = "";
-      char *cur_plural = "";
-      if (new > 1) {
-        new_plural = "s";
-      }
-      if (cur > 1) {
-        cur_plural = "s";
-      }
+/* Called with the results from remote servers by has_mail(). */
+static void note_mail(const struct mail_status *status, void *arg) {
+  if (status->new > 0 || status->unread > 0)
+    *(int *)arg = 1;
+}
 
-      if (!Options.brief_mode &&
-          !Options.nopath_mode) { /* traditional output */
-        if (cur > 0 && new > 0) {
-          printf("You have %d new message%s and %d saved message%s in %s\n",
-                 new, new_plural, cur, cur_plural, mailpath);
-          have_mail = 1;
-        } else if (new > 0) {
-          printf("You have %d new message%s in %s\n", new, new_plural,
-                 mailpath);
-          have_mail = 1;
-        } else if (cur > 0) {
-          printf("You have %d saved message%s in %s\n", cur, cur_plural,
-                 mailpath);
-          have_mail = 1;
-        }
-      } else if (Options.brief_mode) { /* brief output */
-        if (cur > 0 && new > 0) {
-          printf("%s: %d new message%s and %d saved message%s.\n",
-                 mailpath + brief_name_offset, new, new_plural, cur,
-                 cur_plural);
-          have_mail = 1;
-        } else if (new > 0) {
-          printf("%s: %d new message%s.\n", mailpath + brief_name_offset, new,
-                 new_plural);
-          have_mail = 1;
-        } else if (cur > 0) {
-          printf("%s: %d saved message%s.\n", mailpath + brief_name_offset, cur,
-                 cur_plural);
-          have_mail = 1;
-        }
-      } else if (Options.nopath_mode) {
-        if (cur > 0 && new > 0) {
-          printf("%d new message%s and %d saved message%s.\n", new, new_plural,
-                 cur, cur_plural);
-          have_mail = 1;
-        } else if (new > 0) {
-          printf("%d new message%s.\n", new, new_plural);
-          have_mail = 1;
-        } else if (cur > 0) {
-          printf("%d saved message%s.\n", cur, cur_plural);
-          have_mail = 1;
-        }
-      }
-    }
-    else {
-      fprintf(stderr, "mailcheck: invalid line '%s' in rc-file\n", mailpath);
-    }
+/* Is there any new or unread mail in given mailbox?  Local mailboxes are
+ * only read up to the first such message, and not at all once *STOP is
+ * set.  Errors are reported and count as no mail. */
+int has_mail(const struct mailbox *mb, const int *stop) {
+  struct stat st;
+  int found = 0, new, saved;
+  long long t0;
+
+  if (mb->type == MB_POP3 || mb->type == MB_IMAP || mb->type == MB_JMAP) {
+    check_mailbox(mb, note_mail, &found);
+    return found;
   }
+
+  t0 = probe_ns();
+  probe_mailbox = mb->id;
+  PROBE3(mailbox_start, mb->id, mb->path, mb->type);
+  if (stat(mb->path, &st) != 0)
+    ;
+  else if (S_ISREG(st.st_mode))
+    found = st.st_size > 0 && mbox_has_mail(mb->path, stop);
+  else if (S_ISDIR(st.st_mode)) {
+    if ((found = maildir_has_mail(mb->path, stop)) == -1)
+      found = check_mh(mb->path, &new, &saved) == 0 && new > 0;
+  }
+  else {
+    fprintf(stderr, "mailcheck: invalid line '%s' in rc-file\n", mb->path);
+    metrics_error(ERROR_CONFIG);
+  }
+  t0 = probe_ns() - t0;
+  PROBE6(mailbox_done, mb->id, mb->path, found, 0, 0, t0);
+  probe_mailbox = -1;
+  metrics_phase(PHASE_SCAN, t0);
+
+  return found;
+}
+
+/* Parse a size such as "512k" or "4M".  Returns -1 if it is invalid. */
+static long long parse_size(const char *arg) {
+  char *end;
+  long long size = strtoll(arg, &end, 10);
+
+  switch (*end) {
+  case 'G':
+  case 'g':
+    size *= 1024;
+    /* fall through */
+  case 'M':
+  case 'm':
+    size *= 1024;
+    /* fall through */
+  case 'K':
+  case 'k':
+    size *= 1024;
+    end++;
+  }
+  return end == arg || *end || size <= 0 ? -1 : size;
 }
 
 /* Process command-line options */
 void process_options(int argc, char *argv[]) {
+  static const struct option longopts[] = {
+      {"any", no_argument, NULL, 'q'},
+      {"prometheus", required_argument, NULL, 'P'},
+      {"bulk", required_argument, NULL, 'B'},
+      {"from-snapshot", optional_argument, NULL, 'S'},
+      {NULL, 0, NULL, 0}};
   int opt;
 
-  while ((opt = getopt(argc, argv, "bchlnsf:")) != -1) {
+  while ((opt = getopt_long(argc, argv, "bcdhlnqstvIwzB:e:f:i:j:m:P:S::", longopts, NULL)) !=
+         -1) {
     switch (opt) {
     case 'b':
       Options.brief_mode = 1;
@@ -880,15 +1060,95 @@ void process_options(int argc, char *argv[]) {
     case 'f':
       Options.rcfile_path = optarg;
       break;
+    case 'd':
+      Options.daemon_mode = 1;
+      break;
+    case 'v':
+      Options.verbose = 1;
+      break;
+    case 'q':
+      Options.any_mode = 1;
+      break;
+    case 'P':
+      Options.metrics_path = optarg;
+      break;
+    case 't':
+      Options.timing = 1;
+      break;
+    case 'I':
+      Options.idle_io = 1;
+      break;
+    case 'j':
+      Options.jobs = atoi(optarg);
+      if (Options.jobs == 0) {
+        fprintf(stderr, "mailcheck: invalid number of jobs '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'e':
+      if ((Options.estimate = parse_size(optarg)) < 0) {
+        fprintf(stderr, "mailcheck: invalid size '%s'\n", optarg);
+        exit(1);
+      }
+      Options.advanced_count = 1;
+      break;
+    case 'B':
+      Options.bulk_path = optarg;
+      break;
+    case 'w':
+      Options.write_snapshot = 1;
+      break;
+    case 'z':
+      Options.show_size = 1;
+      break;
+    case 'S':
+      Options.snapshot_age = optarg ? atoi(optarg) : -1;
+      if (Options.snapshot_age == 0) {
+        fprintf(stderr, "mailcheck: invalid age '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'm':
+      Options.per_server = atoi(optarg);
+      if (Options.per_server == 0) {
+        fprintf(stderr, "mailcheck: invalid number of connections '%s'\n",
+                optarg);
+        exit(1);
+      }
+      break;
+    case 'i':
+      Options.interval = atoi(optarg);
+      if (Options.interval == 0) {
+        fprintf(stderr, "mailcheck: invalid interval '%s'\n", optarg);
+        exit(1);
+      }
+      break;
     }
   }
 }
 
+#ifndef MAILCHECK_BENCH /* bench.c has its own */
+/* Like report_status(), for the answer of a daemon, which leaves it to the
+ * client to mark POP3 messages as seen once they have been reported. */
+static void report_from_daemon(const struct mail_status *status, void *arg) {
+  report_status(status, arg);
+  if (status->type == MB_POP3 && status->new > 0)
+    pop3_reported(status->path);
+}
+
+/* Print STATUS and keep it for the snapshot ARG (-w). */
+static void report_and_save(const struct mail_status *status, void *arg) {
+  report_status(status, NULL);
+  snapshot_status(status, arg);
+}
+
 /* main */
 int main(int argc, char *argv[]) {
   char buf[1024], *ptr;
-  FILE *rcfile;
+  struct snapshot *snap;
+  struct plan *plan;
   struct stat st;
+  int retval;
 
   ptr = getenv("HOME");
   if (!ptr) {
@@ -898,8 +1158,28 @@ int main(int argc, char *argv[]) {
     Homedir = strdup(ptr);
   }
 
+  /* "mailcheckd" is the same as "mailcheck -d" */
+  ptr = strrchr(argv[0], '/');
+  if (!strcmp(ptr ? ptr + 1 : argv[0], "mailcheckd"))
+    Options.daemon_mode = 1;
+
   process_options(argc, argv);
 
+  if (Options.idle_io && io_idle() != 0)
+    perror("mailcheck: ioprio_set");
+
+  if (Options.bulk_path) {
+    metrics_begin();
+    retval = check_bulk();
+    metrics_write();
+    return retval;
+  }
+
+  if (Options.daemon_mode) {
+    Options.estimate = 0; /* estimates aren't served */
+    return run_daemon();
+  }
+
   if (Options.login_mode) {
     /* If we can stat .hushlogin successfully and it is regular file, we
      * should exit. */
@@ -908,18 +1188,37 @@ int main(int argc, char *argv[]) {
       return 0;
   }
 
-  rcfile = open_rcfile();
-
-  while (fgets(buf, sizeof(buf), rcfile)) {
-    /* eliminate newline */
-    ptr = strchr(buf, '\n');
-    if (ptr)
-      *ptr = '\0';
+  metrics_begin();
+  if (Options.any_mode) {
+    retval = check_any();
+    metrics_write();
+    /* not exit(): the checks that were abandoned may still be running */
+    fflush(stdout);
+    fflush(stderr);
+    _exit(retval);
+  }
 
-    /* If it's not a blank line or comment, look for mail in it */
-    if (strlen(buf) && (*buf != '#'))
-      check_for_mail(buf);
+  /* A running daemon already knows the answer for the default rc file, but
+   * not estimates or sizes. */
+  if (Options.snapshot_age) {
+    read_snapshot(report_status, NULL);
+  } else if (Options.rcfile_path != NULL || Options.estimate ||
+             Options.show_size ||
+             query_daemon(report_from_daemon, NULL) != 0) {
+    plan = plan_load();
+    if (Options.write_snapshot) {
+      snap = snapshot_new();
+      check_plan_jobs(plan, report_and_save, snap);
+      if (snapshot_write(snap) != 0)
+        fprintf(stderr, "mailcheck: couldn't write the snapshot\n");
+      free(snap);
+    } else {
+      check_plan_jobs(plan, report_status, NULL);
+    }
+    plan_free(plan);
   }
+  metrics_write();
+  health_wait();
 
   if (Options.show_summary && !have_mail) {
     if (Options.brief_mode) {
@@ -929,10 +1228,10 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  fclose(rcfile);
   free(Homedir);
 
   return 0;
 }
+#endif /* MAILCHECK_BENCH */
 
 /* vim:set ts=8 sw=2: */
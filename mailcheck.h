@@ -0,0 +1,212 @@
+/* mailcheck.h -- declarations shared between the mailcheck modules
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ */
+
+#ifndef _MAILCHECK_H_
+#define _MAILCHECK_H_ 1
+
+#include <sys/types.h>
+
+#define BUF_SIZE (2048)
+
+/* Mailbox types, as reported in struct mail_status. */
+enum mailbox_type {
+  MB_MBOX,
+  MB_MAILDIR,
+  MB_POP3,
+  MB_IMAP,
+  MB_LOCAL, /* plan only: local path, type not known */
+  MB_MH,
+  MB_JMAP
+};
+
+/* Messages in an mbox, by their "Status: " header. */
+enum message_status { MSG_NEW, MSG_READ, MSG_UNREAD };
+
+/* Result of checking one mailbox.  Without advanced counting (-c), a local
+ * mbox is only known to be empty or not; `new' is then 1 if it was modified
+ * since it was last read.  Maildirs and remote mailboxes split their mail
+ * into new and saved messages, advanced counts split it into new and unread
+ * ones.  With -e, large local mailboxes are only sampled: the advanced
+ * counts are then estimates, give or take the margins.  With -z, local
+ * mailboxes also report their size. */
+struct mail_status {
+  char path[BUF_SIZE]; /* expanded mailbox specification */
+  int type;            /* see enum mailbox_type */
+  int counted;         /* new/unread below are exact (-c) counts */
+  int new;
+  int unread;
+  int saved;
+  int estimated;       /* new/unread are estimates (-e) */
+  int new_margin;      /* 95% confidence margins of the estimates; */
+  int unread_margin;   /* -1: that count is not known */
+  long long size;      /* bytes, with -z; -1 if not known */
+};
+
+/* A mailbox to check, as compiled from the rc file by plan_load().  IMAP
+ * (and JMAP) mailboxes of one account follow each other and are checked over
+ * a single connection: the first has `group' set to the size of the group,
+ * the others 0.  Everything else is a group of its own. */
+struct mailbox {
+  int id;              /* position in the plan */
+  int type;            /* see enum mailbox_type */
+  int group;
+  dev_t dev;           /* identity of local mailboxes at planning time */
+  ino_t ino;
+  char path[BUF_SIZE]; /* expanded mailbox specification */
+  const char *pass;    /* from the bulk manifest; NULL to use ~/.netrc */
+};
+
+struct plan {
+  struct mailbox *box;
+  int count;
+  int size;
+};
+
+/* Called once for every mailbox that was checked successfully. */
+typedef void (*status_fn)(const struct mail_status *status, void *arg);
+
+/* Global variables, see mailcheck.c */
+extern char *Homedir;
+extern unsigned short have_mail;
+extern struct options {
+  unsigned short login_mode;     /* see '-l' option */
+  unsigned short brief_mode;     /* see '-b' option */
+  unsigned short nopath_mode;    /* see '-n' option */
+  unsigned short advanced_count; /* see '-c' option */
+  unsigned short show_summary;   /* see '-s' option */
+  unsigned short daemon_mode;    /* see '-d' option */
+  unsigned short verbose;        /* see '-v' option */
+  unsigned short any_mode;       /* see '-q' option */
+  unsigned short timing;         /* see '-t' option */
+  unsigned short idle_io;        /* see '-I' option */
+  unsigned short write_snapshot; /* see '-w' option */
+  unsigned short show_size;      /* see '-z' option */
+  unsigned int interval;         /* see '-i' option */
+  unsigned int jobs;             /* see '-j' option, 0 if not given */
+  unsigned int per_server;       /* see '-m' option */
+  int snapshot_age;              /* see '-S' option; 0 if not given, -1 if
+                                    given without a value */
+  long long estimate;            /* see '-e' option, bytes */
+  char *rcfile_path;             /* see '-f' option */
+  char *metrics_path;            /* see '-P' option */
+  char *bulk_path;               /* see '-B' option */
+} Options;
+
+/* mailcheck.c */
+FILE *open_rcfile(void);
+int state_path(char *buf, size_t len, const char *subdir, const char *name);
+int state_file(char *buf, size_t len, const char *subdir, const char *key);
+FILE *state_create(const char *file, char *tmp, size_t len);
+int state_commit(FILE *fp, const char *tmp, const char *file, int failed);
+int check_mbox(const char *path, int *new, int *read, int *unread);
+void count_mbox(FILE *mbox, int *new, int *read, int *unread);
+int mbox_status(const char *line);
+int maildir_flags(const char *name);
+int is_remote(const char *path);
+void check_mailbox(const struct mailbox *mb, status_fn fn, void *arg);
+void report_status(const struct mail_status *status, void *arg);
+int has_mail(const struct mailbox *mb, const int *stop);
+
+/* plan.c */
+struct deps;
+void expand_path(const char *path, char *buf, size_t len, struct deps *deps);
+struct plan *plan_load(void);
+void plan_free(struct plan *plan);
+
+/* estimate.c */
+int estimate_mbox(const char *path, off_t size, struct mail_status *status);
+int estimate_maildir(const char *path, struct mail_status *status);
+
+/* mh.c */
+int check_mh(const char *path, int *new, int *saved);
+
+/* mboxio.c */
+FILE *mbox_open(const char *path, int sequential);
+int io_idle(void);
+
+/* dirio.c */
+#define DIRIO_BUF (32768)
+struct dir_entry {      /* struct linux_dirent64 */
+  unsigned long long d_ino;
+  long long d_off;
+  unsigned short d_reclen;
+  unsigned char d_type; /* DT_* of <dirent.h> */
+  char d_name[];
+};
+struct dir_stream {
+  int fd;
+  int pos, len;
+  char buf[DIRIO_BUF] __attribute__((aligned(8)));
+};
+int dir_open(struct dir_stream *d, const char *path);
+struct dir_entry *dir_read(struct dir_stream *d);
+void dir_close(struct dir_stream *d);
+
+/* mboxmark.c */
+struct stat;
+int mbox_is_new(const char *path, const struct stat *st);
+
+/* jobs.c */
+void check_plan_jobs(const struct plan *plan, status_fn fn, void *arg);
+
+/* snapshot.c */
+struct snapshot;
+struct snapshot *snapshot_new(void);
+void snapshot_clear(struct snapshot *s);
+void snapshot_status(const struct mail_status *status, void *arg);
+int snapshot_write(struct snapshot *s);
+int read_snapshot(status_fn fn, void *arg);
+
+/* bulk.c */
+int check_bulk(void);
+
+/* any.c */
+int check_any(void);
+
+/* remote.c */
+int parse_url(const char *path, char *hostname, char *box, char *user,
+              int *tls);
+int getnetinfo(const struct mailbox *mb, char *hostname, char *box, char *user,
+               char *pass, int *tls);
+int remote_type(const char *path);
+void remote_prefix(const char *path, char *buf, size_t len);
+int check_pop3(const struct mailbox *mb, int *new_p, int *cur_p);
+void pop3_reported(const char *path);
+int check_imap(const struct mailbox *mb, int count, struct mail_status *status,
+               status_fn fn, void *arg);
+int watch_imap(const struct mailbox *mb, int count, struct mail_status *status,
+               status_fn fn, void *arg, const int *stop);
+
+/* jmap.c */
+int check_jmap(const struct mailbox *mb, int count, struct mail_status *status,
+               status_fn fn, void *arg);
+
+/* daemon.c */
+int daemon_socket_path(char *buf, size_t len);
+int run_daemon(void);
+int query_daemon(status_fn fn, void *arg);
+
+/* health.c */
+enum health_cause {
+  HEALTH_DNS,
+  HEALTH_REFUSED,
+  HEALTH_TIMEOUT,
+  HEALTH_CONNECT, /* any other reason the connection failed */
+  HEALTH_COUNT
+};
+/* Returns 0 if HOST:PORT may be tried now, -1 (after saying so) if not. */
+int health_check(const char *host, int port);
+void health_failed(const char *host, int port, int cause);
+void health_ok(const char *host, int port);
+/* The cause of a failed connect(), from its errno. */
+int health_cause(int err);
+/* Give the background probes a moment to finish, before exit. */
+void health_wait(void);
+
+/* socket.c */
+extern int sock_connect(char *hostname, int port);
+
+#endif /* _MAILCHECK_H_ */
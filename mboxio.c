@@ -0,0 +1,191 @@
+/* mboxio.c -- read mboxes without crowding out the page cache
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ */
+
+/* On a shared mail server, reading every spool through the page cache
+ * evicts pages that other programs (the IMAP server's indexes, say) need
+ * far more than mailcheck does.  So mbox_open() returns a stream that reads
+ * the file in windows of WINDOW bytes:
+ *
+ *   - when the file is opened, mincore() tells which of its pages are
+ *     cached already;
+ *   - for sequential reads, the kernel is told so, and the next window is
+ *     requested ahead of time;
+ *   - once a window is done with, the pages that weren't cached before are
+ *     dropped again, the others are left alone.
+ *
+ * The pages are looked at once, before anything is read, as the kernel's
+ * own readahead would soon make the next window look cached.
+ *
+ * A mailbox that somebody else is reading keeps its pages, and a cold one
+ * leaves the cache as it found it, give or take the window being read.
+ * With -I, the process also drops to the idle I/O class, so that its reads
+ * only use the disk when nobody else does. */
+
+#define _GNU_SOURCE /* fopencookie() */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "mailcheck.h"
+
+#define WINDOW (2 << 20)      /* bytes */
+#define STREAM_BUF (64 << 10) /* divides WINDOW */
+
+#define IOPRIO_WHO_PROCESS (1)
+#define IOPRIO_CLASS_IDLE (3)
+#define IOPRIO_CLASS_SHIFT (13)
+
+struct mbox_file {
+  int fd;
+  int sequential;
+  off_t pos;
+  off_t size;
+  size_t pagesize;
+  unsigned char *resident; /* pages cached at open, NULL if not known */
+  off_t window;            /* start of the window being read, -1 if none */
+  char mem[];              /* the stream buffer, then room for resident */
+};
+
+/* Drop the pages of the window starting at START that we brought into the
+ * cache. */
+static void release_window(struct mbox_file *m, off_t start) {
+  off_t stop = start + WINDOW < m->size ? start + WINDOW : m->size;
+  size_t last, i, end;
+
+  if (!m->resident || start < 0 || start >= m->size)
+    return;
+  last = (stop + m->pagesize - 1) / m->pagesize;
+  for (i = start / m->pagesize; i < last; i = end) {
+    for (end = i + 1;
+         end < last && (m->resident[end] & 1) == (m->resident[i] & 1); end++)
+      ;
+    if (!(m->resident[i] & 1))
+      posix_fadvise(m->fd, i * m->pagesize, (end - i) * m->pagesize,
+                    POSIX_FADV_DONTNEED);
+  }
+}
+
+static ssize_t mbox_read(void *cookie, char *buf, size_t size) {
+  struct mbox_file *m = cookie;
+  off_t start = m->pos - m->pos % WINDOW;
+  ssize_t n;
+
+  if (start != m->window) {
+    release_window(m, m->window);
+    if (m->sequential && start + WINDOW < m->size)
+      posix_fadvise(m->fd, start + WINDOW, WINDOW, POSIX_FADV_WILLNEED);
+    m->window = start;
+  }
+  if ((off_t)size > start + WINDOW - m->pos)
+    size = start + WINDOW - m->pos;
+  if ((n = pread(m->fd, buf, size, m->pos)) > 0)
+    m->pos += n;
+  return n;
+}
+
+static int mbox_seek(void *cookie, off64_t *off, int whence) {
+  struct mbox_file *m = cookie;
+  off_t pos;
+
+  switch (whence) {
+  case SEEK_SET:
+    pos = *off;
+    break;
+  case SEEK_CUR:
+    pos = m->pos + *off;
+    break;
+  case SEEK_END:
+    pos = m->size + *off;
+    break;
+  default:
+    return -1;
+  }
+  if (pos < 0)
+    return -1;
+  *off = m->pos = pos;
+  return 0;
+}
+
+static int mbox_close(void *cookie) {
+  struct mbox_file *m = cookie;
+  int retval;
+
+  release_window(m, m->window);
+  if (m->sequential && m->window >= 0) /* read ahead, maybe not read */
+    release_window(m, m->window + WINDOW);
+  retval = close(m->fd);
+  free(m);
+  return retval;
+}
+
+/* Note which pages of the file are cached before we read any. */
+static void probe_cache(struct mbox_file *m) {
+  void *map;
+
+  if (m->size == 0 ||
+      (map = mmap(NULL, m->size, PROT_READ, MAP_SHARED, m->fd, 0)) ==
+          MAP_FAILED)
+    return;
+  m->resident = (unsigned char *)m->mem + STREAM_BUF;
+  if (mincore(map, m->size, m->resident) != 0)
+    m->resident = NULL;
+  munmap(map, m->size);
+}
+
+/* Open the mbox PATH for reading, sparing the page cache; if SEQUENTIAL,
+ * it will be read from start to end.  Returns NULL with errno set on
+ * error.  Apart from the stream itself, everything comes in one allocation:
+ * the state, the stream buffer and the map of cached pages. */
+FILE *mbox_open(const char *path, int sequential) {
+  static const cookie_io_functions_t io = {mbox_read, NULL, mbox_seek,
+                                           mbox_close};
+  struct mbox_file *m;
+  size_t pagesize = sysconf(_SC_PAGESIZE);
+  struct stat st;
+  FILE *fp;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+    return NULL;
+  if (fstat(fd, &st) != 0 ||
+      (m = calloc(1, sizeof(*m) + STREAM_BUF +
+                         (st.st_size + pagesize - 1) / pagesize)) == NULL) {
+    close(fd);
+    return NULL;
+  }
+  m->fd = fd;
+  m->sequential = sequential;
+  m->size = st.st_size;
+  m->pagesize = pagesize;
+  m->window = -1;
+  probe_cache(m);
+
+  if ((fp = fopencookie(m, "r", io)) == NULL) {
+    mbox_close(m);
+    return NULL;
+  }
+  setvbuf(fp, m->mem, _IOFBF, STREAM_BUF);
+  posix_fadvise(fd, 0, 0,
+                sequential ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_RANDOM);
+  return fp;
+}
+
+/* Use the idle I/O class from now on (-I).  Threads created later inherit
+ * it. */
+int io_idle(void) {
+#ifdef SYS_ioprio_set
+  return syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                 IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+#else
+  return -1;
+#endif
+}
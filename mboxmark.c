@@ -0,0 +1,154 @@
+/* mboxmark.c -- tell new mail in an mbox without reading it
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ */
+
+/* Without -c, an mbox has new mail if it was modified after it was last
+ * read, which used to be told by its modification and access times.  On
+ * file systems mounted noatime that never works, and elsewhere anything
+ * else that reads the mbox (a backup, a search, mailcheck -c itself) makes
+ * its mail look read.
+ *
+ * Instead, a watermark of each mbox is kept in ~/.mailcheck/mbox/, one file
+ * per mailbox: its inode, size and modification time when it was last
+ * checked, a hash of its last TAIL bytes, and whether it had new mail then.
+ * Mail is delivered by appending to the file, while a mail reader that has
+ * shown it rewrites the file, with the status of the messages changed.  So
+ * at the next check, after a stat():
+ *
+ *   - if nothing changed, the answer is the same as last time;
+ *   - if the file grew, one pread() of the end of the old contents and the
+ *     start of what follows tells whether the old contents are still there,
+ *     followed by a "From " separator: then mail was delivered, and there is
+ *     new mail until the next rewrite;
+ *   - otherwise the file was rewritten, or replaced, and the mail read.
+ *
+ * The first time an mbox is seen, the times are all there is to go by. */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mailcheck.h"
+#include "metrics.h"
+#include "probes.h"
+
+#define MARK_MAGIC "MCMBOX1"
+#define TAIL (256) /* bytes before the watermark that must not change */
+
+/* What ~/.mailcheck/mbox/ remembers of an mbox. */
+struct mark {
+  unsigned long long ino;
+  long long size;
+  struct timespec mtime;
+  uint64_t hash; /* of the last TAIL bytes, or all of them if fewer */
+  int new;
+};
+
+/* Name of the watermark file of the mbox PATH. */
+static int mark_path(const char *path, char *buf, size_t len) {
+  return state_file(buf, len, "mbox", path);
+}
+
+static int load_mark(const char *file, struct mark *m) {
+  long long sec, nsec;
+  unsigned long long hash;
+  FILE *fp;
+  int n;
+
+  if ((fp = fopen(file, "r")) == NULL)
+    return -1;
+  n = fscanf(fp, MARK_MAGIC " %llu %lld %lld %lld %llx %d", &m->ino, &m->size,
+             &sec, &nsec, &hash, &m->new);
+  fclose(fp);
+  if (n != 6)
+    return -1;
+  m->mtime.tv_sec = sec;
+  m->mtime.tv_nsec = nsec;
+  m->hash = hash;
+  return 0;
+}
+
+static void save_mark(const char *file, const struct mark *m) {
+  char tmp[BUF_SIZE + 8];
+  FILE *fp;
+
+  if ((fp = state_create(file, tmp, sizeof(tmp))) == NULL)
+    return;
+  fprintf(fp, MARK_MAGIC " %llu %lld %lld %lld %llx %d\n", m->ino, m->size,
+          (long long)m->mtime.tv_sec, (long long)m->mtime.tv_nsec,
+          (unsigned long long)m->hash, m->new);
+  state_commit(fp, tmp, file, 0);
+}
+
+/* FNV-1a */
+static uint64_t hash_bytes(const char *p, size_t len) {
+  uint64_t h = 14695981039346656037ULL;
+
+  while (len--) {
+    h ^= (unsigned char)*p++;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+/* Read the TAIL bytes (or fewer) that end at offset END of FD, and the
+ * EXTRA bytes after them into BUF.  Returns how many bytes come before END,
+ * or -1 if they couldn't all be read. */
+static ssize_t read_tail(int fd, long long end, char *buf, size_t extra) {
+  size_t before = end < TAIL ? (size_t)end : TAIL;
+
+  if (pread(fd, buf, before + extra, end - before) != (ssize_t)(before + extra))
+    return -1;
+  return before;
+}
+
+/* Has the non-empty mbox PATH, whose stat() is ST, got mail that arrived
+ * after it was last read?  Updates its watermark. */
+int mbox_is_new(const char *path, const struct stat *st) {
+  char file[BUF_SIZE];
+  char buf[TAIL + 5];
+  struct mark m, old;
+  ssize_t before;
+  int fd, have_mark, hit;
+
+  m.ino = st->st_ino;
+  m.size = st->st_size;
+  m.mtime = st->st_mtim;
+  if (mark_path(path, file, sizeof(file)) != 0)
+    file[0] = '\0';
+  have_mark = *file && load_mark(file, &old) == 0;
+  hit = have_mark && old.ino == m.ino && old.size == m.size &&
+        old.mtime.tv_sec == m.mtime.tv_sec &&
+        old.mtime.tv_nsec == m.mtime.tv_nsec;
+  PROBE2(cache, "mbox", hit);
+  metrics_cache(CACHE_MBOX, hit);
+  if (hit)
+    return old.new;
+
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+    return st->st_mtime > st->st_atime;
+
+  if (!have_mark) {
+    m.new = st->st_mtime > st->st_atime;
+  } else if (old.ino == m.ino && old.size < m.size &&
+             (before = read_tail(fd, old.size, buf, 5)) >= 0 &&
+             hash_bytes(buf, before) == old.hash &&
+             strncmp(buf + before, "From ", 5) == 0) {
+    m.new = 1; /* delivered to */
+  } else {
+    m.new = 0; /* rewritten by a mail reader */
+  }
+
+  if ((before = read_tail(fd, m.size, buf, 0)) >= 0) {
+    m.hash = hash_bytes(buf, before);
+    if (*file)
+      save_mark(file, &m);
+  }
+  close(fd);
+  return m.new;
+}
@@ -0,0 +1,321 @@
+/* metrics.c -- statistics for the Prometheus node_exporter textfile collector
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ */
+
+/* With -P FILE, mailcheck writes FILE after every run, or after every
+ * refresh in daemon mode, in the Prometheus text exposition format.  It is
+ * written to a temporary file first and renamed, so that the collector never
+ * sees half of it.  The file holds:
+ *
+ *   - the new, unread and saved messages of each mailbox and the time it
+ *     took to check it, from its last check;
+ *   - latency histograms of local scans, DNS, connect, TLS, login and status
+ *     queries;
+ *   - failed checks by cause, cache hits and misses, and the bytes and
+ *     directory entries read from local mailboxes.
+ *
+ * Counters are kept with atomic operations, as the checks of -q run in
+ * several threads; the per-mailbox gauges are protected by a mutex. */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mailcheck.h"
+#include "metrics.h"
+#include "probes.h"
+
+/* Upper bounds of the histogram buckets, in nanoseconds. */
+static const long long bucket_ns[] = {
+    1000000LL,    2500000LL,    5000000LL,   10000000LL,   25000000LL,
+    50000000LL,   100000000LL,  250000000LL, 500000000LL,  1000000000LL,
+    2500000000LL, 5000000000LL, 10000000000LL, 30000000000LL};
+#define NBUCKETS (sizeof(bucket_ns) / sizeof(bucket_ns[0]))
+
+struct histogram {
+  unsigned long long bucket[NBUCKETS + 1]; /* not cumulative, last is +Inf */
+  unsigned long long sum_ns;
+};
+
+enum gauge_kind {
+  GAUGE_NEW,
+  GAUGE_UNREAD,
+  GAUGE_SAVED,
+  GAUGE_SECONDS,
+  GAUGE_BYTES
+};
+
+struct gauge {
+  int kind;
+  int type; /* enum mailbox_type, or -1 */
+  double value;
+  char *mailbox;
+};
+
+static const char *phase_name[PHASE_COUNT] = {"scan", "dns",  "connect",
+                                              "tls",  "auth", "status"};
+static const char *error_name[ERROR_COUNT] = {
+    "open", "config", "dns", "connect", "tls", "auth", "protocol"};
+static const char *cache_name[CACHE_COUNT] = {"plan", "tls", "daemon", "mh",
+                                              "jmap", "mbox"};
+static const char *type_name[] = {"mbox", "maildir", "pop3", "imap", "local",
+                                  "mh", "jmap"};
+
+static struct histogram phases[PHASE_COUNT];
+static unsigned long long errors[ERROR_COUNT];
+static unsigned long long caches[CACHE_COUNT][2]; /* misses, hits */
+static unsigned long long scanned_bytes, scanned_entries;
+
+static pthread_mutex_t gauge_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct gauge *gauges;
+static int ngauges, gauge_size;
+static long long run_start;
+
+#define COUNT(var, n) __atomic_fetch_add(&(var), (n), __ATOMIC_RELAXED)
+#define READ(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+
+void metrics_phase(int phase, long long ns) {
+  struct histogram *h = &phases[phase];
+  size_t i;
+
+  if (!Options.metrics_path)
+    return;
+  for (i = 0; i < NBUCKETS && ns > bucket_ns[i]; i++)
+    ;
+  COUNT(h->bucket[i], 1);
+  COUNT(h->sum_ns, ns);
+}
+
+void metrics_error(int cause) {
+  if (Options.metrics_path)
+    COUNT(errors[cause], 1);
+}
+
+void metrics_cache(int cache, int hit) {
+  if (Options.metrics_path)
+    COUNT(caches[cache][hit != 0], 1);
+}
+
+void metrics_scanned(long long bytes, long entries) {
+  if (!Options.metrics_path)
+    return;
+  if (bytes > 0)
+    COUNT(scanned_bytes, bytes);
+  if (entries > 0)
+    COUNT(scanned_entries, entries);
+}
+
+/* Set a gauge, replacing the value from an earlier check of the mailbox. */
+static void set_gauge(int kind, int type, const char *mailbox, double value) {
+  struct gauge *p;
+  int i;
+
+  for (i = 0; i < ngauges; i++)
+    if (gauges[i].kind == kind && strcmp(gauges[i].mailbox, mailbox) == 0) {
+      gauges[i].type = type;
+      gauges[i].value = value;
+      return;
+    }
+
+  if (ngauges == gauge_size) {
+    gauge_size = gauge_size ? 2 * gauge_size : 32;
+    if ((p = realloc(gauges, gauge_size * sizeof(*p))) == NULL) {
+      gauge_size = ngauges;
+      return;
+    }
+    gauges = p;
+  }
+  if ((gauges[ngauges].mailbox = strdup(mailbox)) == NULL)
+    return;
+  gauges[ngauges].kind = kind;
+  gauges[ngauges].type = type;
+  gauges[ngauges].value = value;
+  ngauges++;
+}
+
+/* Not per mailbox in bulk mode (-B), where there may be any number. */
+void metrics_mailbox(const struct mail_status *status) {
+  if (!Options.metrics_path || Options.bulk_path)
+    return;
+  pthread_mutex_lock(&gauge_lock);
+  set_gauge(GAUGE_NEW, status->type, status->path, status->new);
+  set_gauge(GAUGE_UNREAD, status->type, status->path, status->unread);
+  set_gauge(GAUGE_SAVED, status->type, status->path, status->saved);
+  if (status->size >= 0)
+    set_gauge(GAUGE_BYTES, status->type, status->path, status->size);
+  pthread_mutex_unlock(&gauge_lock);
+}
+
+void metrics_mailbox_time(const char *path, long long ns) {
+  if (!Options.metrics_path || Options.bulk_path)
+    return;
+  pthread_mutex_lock(&gauge_lock);
+  set_gauge(GAUGE_SECONDS, -1, path, ns / 1e9);
+  pthread_mutex_unlock(&gauge_lock);
+}
+
+void metrics_begin(void) {
+  run_start = probe_ns();
+}
+
+void metrics_forget(void) {
+  int i;
+
+  pthread_mutex_lock(&gauge_lock);
+  for (i = 0; i < ngauges; i++)
+    free(gauges[i].mailbox);
+  ngauges = 0;
+  pthread_mutex_unlock(&gauge_lock);
+}
+
+/* Write S as the value of a label, escaped as the format requires. */
+static void put_label(FILE *fp, const char *s) {
+  putc('"', fp);
+  for (; *s; s++) {
+    if (*s == '\n')
+      fputs("\\n", fp);
+    else {
+      if (*s == '"' || *s == '\\')
+        putc('\\', fp);
+      putc(*s, fp);
+    }
+  }
+  putc('"', fp);
+}
+
+static void put_header(FILE *fp, const char *name, const char *type,
+                       const char *help) {
+  fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void put_gauges(FILE *fp, int kind, const char *name,
+                       const char *help) {
+  int i;
+
+  put_header(fp, name, "gauge", help);
+  for (i = 0; i < ngauges; i++) {
+    if (gauges[i].kind != kind)
+      continue;
+    fprintf(fp, "%s{mailbox=", name);
+    put_label(fp, gauges[i].mailbox);
+    if (gauges[i].type >= 0)
+      fprintf(fp, ",type=\"%s\"", type_name[gauges[i].type]);
+    fprintf(fp, "} %.9g\n", gauges[i].value);
+  }
+}
+
+static void put_histograms(FILE *fp) {
+  const char *name = "mailcheck_phase_duration_seconds";
+  unsigned long long n;
+  size_t i;
+  int p;
+
+  put_header(fp, name, "histogram", "Time spent in each phase of a check.");
+  for (p = 0; p < PHASE_COUNT; p++) {
+    n = 0;
+    for (i = 0; i <= NBUCKETS; i++) {
+      n += READ(phases[p].bucket[i]);
+      if (i < NBUCKETS)
+        fprintf(fp, "%s_bucket{phase=\"%s\",le=\"%g\"} %llu\n", name,
+                phase_name[p], bucket_ns[i] / 1e9, n);
+      else
+        fprintf(fp, "%s_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n", name,
+                phase_name[p], n);
+    }
+    fprintf(fp, "%s_sum{phase=\"%s\"} %.9g\n", name, phase_name[p],
+            READ(phases[p].sum_ns) / 1e9);
+    fprintf(fp, "%s_count{phase=\"%s\"} %llu\n", name, phase_name[p], n);
+  }
+}
+
+static void put_counters(FILE *fp) {
+  unsigned long long hits, misses;
+  int i;
+
+  put_header(fp, "mailcheck_errors_total", "counter",
+             "Failed mailbox checks by cause.");
+  for (i = 0; i < ERROR_COUNT; i++)
+    fprintf(fp, "mailcheck_errors_total{cause=\"%s\"} %llu\n", error_name[i],
+            READ(errors[i]));
+
+  put_header(fp, "mailcheck_cache_requests_total", "counter",
+             "Lookups in the plan, TLS session, daemon and MH folder caches.");
+  for (i = 0; i < CACHE_COUNT; i++) {
+    fprintf(fp, "mailcheck_cache_requests_total{cache=\"%s\",result=\"hit\"} "
+                "%llu\n",
+            cache_name[i], READ(caches[i][1]));
+    fprintf(fp, "mailcheck_cache_requests_total{cache=\"%s\",result=\"miss\"} "
+                "%llu\n",
+            cache_name[i], READ(caches[i][0]));
+  }
+  put_header(fp, "mailcheck_cache_hit_ratio", "gauge",
+             "Share of cache lookups that were hits.");
+  for (i = 0; i < CACHE_COUNT; i++) {
+    hits = READ(caches[i][1]);
+    misses = READ(caches[i][0]);
+    if (hits + misses > 0)
+      fprintf(fp, "mailcheck_cache_hit_ratio{cache=\"%s\"} %.4f\n",
+              cache_name[i], (double)hits / (hits + misses));
+  }
+
+  put_header(fp, "mailcheck_scanned_bytes_total", "counter",
+             "Bytes read from local mbox files.");
+  fprintf(fp, "mailcheck_scanned_bytes_total %llu\n", READ(scanned_bytes));
+  put_header(fp, "mailcheck_scanned_entries_total", "counter",
+             "Directory entries read from local maildirs.");
+  fprintf(fp, "mailcheck_scanned_entries_total %llu\n", READ(scanned_entries));
+}
+
+int metrics_write(void) {
+  char tmp[BUF_SIZE];
+  FILE *fp;
+  int n;
+
+  if (!Options.metrics_path)
+    return 0;
+  /* node_exporter only reads files ending in ".prom" */
+  n = snprintf(tmp, sizeof(tmp), "%s.%d", Options.metrics_path, (int)getpid());
+  if (n < 0 || (size_t)n >= sizeof(tmp) || (fp = fopen(tmp, "w")) == NULL)
+    goto fail;
+
+  pthread_mutex_lock(&gauge_lock);
+  put_gauges(fp, GAUGE_NEW, "mailcheck_mailbox_new_messages",
+             "New messages at the last check.");
+  put_gauges(fp, GAUGE_UNREAD, "mailcheck_mailbox_unread_messages",
+             "Unread messages at the last check (with -c).");
+  put_gauges(fp, GAUGE_SAVED, "mailcheck_mailbox_saved_messages",
+             "Saved messages at the last check.");
+  put_gauges(fp, GAUGE_SECONDS, "mailcheck_mailbox_check_seconds",
+             "Time taken by the last check of the mailbox.");
+  put_gauges(fp, GAUGE_BYTES, "mailcheck_mailbox_size_bytes",
+             "Size of the local mailbox at the last check (with -z).");
+  pthread_mutex_unlock(&gauge_lock);
+  put_histograms(fp);
+  put_counters(fp);
+
+  put_header(fp, "mailcheck_run_duration_seconds", "gauge",
+             "Time taken by the last run.");
+  fprintf(fp, "mailcheck_run_duration_seconds %.9g\n",
+          (probe_ns() - run_start) / 1e9);
+  put_header(fp, "mailcheck_last_run_timestamp_seconds", "gauge",
+             "When the last run ended.");
+  fprintf(fp, "mailcheck_last_run_timestamp_seconds %lld\n",
+          (long long)time(NULL));
+
+  n = ferror(fp);
+  if (fclose(fp) != 0 || n || rename(tmp, Options.metrics_path) != 0) {
+    unlink(tmp);
+    goto fail;
+  }
+  return 0;
+
+fail:
+  fprintf(stderr, "mailcheck: couldn't write metrics to '%s'\n",
+          Options.metrics_path);
+  return -1;
+}
@@ -0,0 +1,57 @@
+/* metrics.h -- statistics for the Prometheus node_exporter textfile collector
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_ 1
+
+#include "mailcheck.h"
+
+/* Phases with a latency histogram. */
+enum metric_phase {
+  PHASE_SCAN,    /* checking a local mailbox */
+  PHASE_DNS,     /* resolving a server name */
+  PHASE_CONNECT, /* TCP connect */
+  PHASE_TLS,     /* TLS handshake */
+  PHASE_AUTH,    /* USER/PASS or LOGIN */
+  PHASE_STATUS,  /* STAT and LAST/UIDL, or STATUS (and LIST) per mailbox */
+  PHASE_COUNT
+};
+
+/* Causes of failed checks. */
+enum metric_error {
+  ERROR_OPEN,     /* local mailbox can't be read */
+  ERROR_CONFIG,   /* invalid rc file line or login information */
+  ERROR_DNS,
+  ERROR_CONNECT,
+  ERROR_TLS,
+  ERROR_AUTH,
+  ERROR_PROTOCOL, /* unexpected or negative server response */
+  ERROR_COUNT
+};
+
+enum metric_cache { CACHE_PLAN, CACHE_TLS, CACHE_DAEMON, CACHE_MH, CACHE_JMAP,
+                    CACHE_MBOX, CACHE_COUNT };
+
+/* Nothing is recorded unless a metrics file was given with -P.  All of these
+ * may be called from several threads. */
+void metrics_phase(int phase, long long ns);
+void metrics_error(int cause);
+void metrics_cache(int cache, int hit);
+void metrics_scanned(long long bytes, long entries);
+void metrics_mailbox(const struct mail_status *status);
+void metrics_mailbox_time(const char *path, long long ns);
+
+/* Start a run, or a round of daemon checks.  Counters and histograms keep
+ * growing for the life of the process. */
+void metrics_begin(void);
+
+/* Drop the figures of all mailboxes, when the rc file has changed. */
+void metrics_forget(void);
+
+/* Atomically replace the file given with -P.  Returns -1 on error. */
+int metrics_write(void);
+
+#endif /* _METRICS_H_ */
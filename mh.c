@@ -0,0 +1,299 @@
+/* mh.c -- check MH folders
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ */
+
+/* An MH folder is a directory of messages named by number, with the message
+ * sequences kept in .mh_sequences, one per line:
+ *
+ *   unseen: 3-5 8
+ *
+ * Messages in the "unseen" sequence are new, the others saved.  MH programs
+ * keep the sequences up to date, so when .mh_sequences is at least as new
+ * as the directory, the number of new messages can be read from it without
+ * listing the directory at all.  Otherwise the numeric names are read, and
+ * messages delivered after the sequences were last written (numbered above
+ * any message they mention) count as new, too.
+ *
+ * The result is cached in ~/.mailcheck/mh/, one file per folder, together
+ * with the modification times of the directory and of .mh_sequences.  If
+ * neither has changed, the cached result is used; if only the sequences
+ * have, the number of messages still is that of the cache. */
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mailcheck.h"
+#include "metrics.h"
+#include "probes.h"
+
+#define MH_MAGIC "MCMH1"
+#define UNSEEN "unseen"
+
+struct range {
+  long lo, hi;
+};
+
+/* The unseen sequence, and the highest message any sequence mentions. */
+struct sequences {
+  struct range *unseen;
+  int count;
+  int size;
+  long highest;
+};
+
+/* What ~/.mailcheck/mh/ remembers of a folder. */
+struct mh_cache {
+  struct timespec dir;  /* modification times when counted */
+  struct timespec seq;  /* 0 if there was no .mh_sequences */
+  int total;
+  int new;
+};
+
+static void add_range(struct sequences *s, long lo, long hi) {
+  struct range *r;
+
+  if (s->count == s->size) {
+    s->size = s->size ? 2 * s->size : 16;
+    if ((r = realloc(s->unseen, s->size * sizeof(*r))) == NULL) {
+      fprintf(stderr, "mailcheck: out of memory\n");
+      exit(1);
+    }
+    s->unseen = r;
+  }
+  s->unseen[s->count].lo = lo;
+  s->unseen[s->count++].hi = hi;
+}
+
+/* Read the message numbers and ranges in P.  Those of the unseen sequence
+ * are added to S if UNSEEN_SEQ is set. */
+static void parse_numbers(struct sequences *s, const char *p, int unseen_seq) {
+  char *end;
+  long lo, hi;
+
+  for (;;) {
+    p += strspn(p, " \t\r\n");
+    if (*p < '0' || *p > '9')
+      return;
+    lo = hi = strtol(p, &end, 10);
+    if (*end == '-')
+      hi = strtol(end + 1, &end, 10);
+    p = end;
+    if (hi < lo)
+      continue;
+    if (hi > s->highest)
+      s->highest = hi;
+    if (unseen_seq)
+      add_range(s, lo, hi);
+  }
+}
+
+/* Read the sequences file FILE into S.  Lines starting with white space
+ * continue the sequence of the line before.  Returns -1 if it can't be
+ * read. */
+static int read_sequences(const char *file, struct sequences *s) {
+  char line[BUF_SIZE], *colon;
+  int unseen_seq = 0;
+  FILE *fp;
+
+  if ((fp = fopen(file, "r")) == NULL)
+    return -1;
+  while (fgets(line, sizeof(line), fp)) {
+    if (line[0] == ' ' || line[0] == '\t') {
+      parse_numbers(s, line, unseen_seq);
+      continue;
+    }
+    if ((colon = strchr(line, ':')) == NULL) {
+      unseen_seq = 0;
+      continue;
+    }
+    *colon = '\0';
+    unseen_seq = strcmp(line, UNSEEN) == 0;
+    parse_numbers(s, colon + 1, unseen_seq);
+  }
+  fclose(fp);
+  return 0;
+}
+
+static int cmp_range(const void *a, const void *b) {
+  const struct range *x = a, *y = b;
+
+  return x->lo < y->lo ? -1 : x->lo > y->lo;
+}
+
+/* Sort the unseen ranges and merge those that overlap or touch. */
+static void merge_ranges(struct sequences *s) {
+  int i, n = 0;
+
+  if (s->count == 0)
+    return;
+  qsort(s->unseen, s->count, sizeof(*s->unseen), cmp_range);
+  for (i = 1; i < s->count; i++) {
+    if (s->unseen[i].lo <= s->unseen[n].hi + 1) {
+      if (s->unseen[i].hi > s->unseen[n].hi)
+        s->unseen[n].hi = s->unseen[i].hi;
+    } else {
+      s->unseen[++n] = s->unseen[i];
+    }
+  }
+  s->count = n + 1;
+}
+
+/* Is message N in the unseen sequence?  The ranges are merged. */
+static int is_unseen(const struct sequences *s, long n) {
+  int lo = 0, hi = s->count, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (s->unseen[mid].hi < n)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < s->count && s->unseen[lo].lo <= n;
+}
+
+/* Number of messages in the unseen sequence. */
+static long unseen_count(const struct sequences *s) {
+  long n = 0;
+  int i;
+
+  for (i = 0; i < s->count; i++)
+    n += s->unseen[i].hi - s->unseen[i].lo + 1;
+  return n;
+}
+
+/* Name of the cache file of the folder PATH. */
+static int cache_path(const char *path, char *buf, size_t len) {
+  return state_file(buf, len, "mh", path);
+}
+
+static int load_cache(const char *file, struct mh_cache *c) {
+  long long ds, dn, ss, sn;
+  FILE *fp;
+  int n;
+
+  if ((fp = fopen(file, "r")) == NULL)
+    return -1;
+  n = fscanf(fp, MH_MAGIC " %lld %lld %lld %lld %d %d", &ds, &dn, &ss, &sn,
+             &c->total, &c->new);
+  fclose(fp);
+  if (n != 6)
+    return -1;
+  c->dir.tv_sec = ds;
+  c->dir.tv_nsec = dn;
+  c->seq.tv_sec = ss;
+  c->seq.tv_nsec = sn;
+  return 0;
+}
+
+static void save_cache(const char *file, const struct mh_cache *c) {
+  char tmp[BUF_SIZE + 8];
+  FILE *fp;
+
+  if ((fp = state_create(file, tmp, sizeof(tmp))) == NULL)
+    return;
+  fprintf(fp, MH_MAGIC " %lld %lld %lld %lld %d %d\n",
+          (long long)c->dir.tv_sec, (long long)c->dir.tv_nsec,
+          (long long)c->seq.tv_sec, (long long)c->seq.tv_nsec, c->total,
+          c->new);
+  state_commit(fp, tmp, file, 0);
+}
+
+static int same_time(struct timespec a, struct timespec b) {
+  return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+/* Count the messages of the folder PATH, going by the sequences S if FRESH,
+ * and also by their number if not.  Returns -1 if PATH can't be read. */
+static int scan_folder(const char *path, const struct sequences *s, int fresh,
+                       int *total, int *new) {
+  struct dir_stream d;
+  struct dir_entry *entry;
+  const char *p;
+  long n;
+  long long t0 = probe_ns();
+
+  if (dir_open(&d, path) != 0)
+    return -1;
+  *total = *new = 0;
+  while ((entry = dir_read(&d))) {
+    for (p = entry->d_name; *p >= '0' && *p <= '9'; p++)
+      ;
+    if (p == entry->d_name || *p || entry->d_name[0] == '0')
+      continue;
+    if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_REG)
+      continue;
+    n = atol(entry->d_name);
+    (*total)++;
+    if (is_unseen(s, n) || (!fresh && n > s->highest))
+      (*new)++;
+  }
+  dir_close(&d);
+  PROBE4(dir_scan, probe_mailbox, path, *total, probe_ns() - t0);
+  metrics_scanned(0, *total);
+  return 0;
+}
+
+/* Count the messages in the MH folder PATH.  Returns -1 if it isn't one. */
+int check_mh(const char *path, int *new, int *saved) {
+  char seqfile[BUF_SIZE], file[BUF_SIZE];
+  struct sequences s = {NULL, 0, 0, 0};
+  struct mh_cache c, old;
+  struct stat dst, sst;
+  int have_seq, have_cache, hit, fresh, retval = 0;
+
+  if (stat(path, &dst) != 0 || !S_ISDIR(dst.st_mode))
+    return -1;
+  snprintf(seqfile, sizeof(seqfile), "%s/.mh_sequences", path);
+  if (!(have_seq = stat(seqfile, &sst) == 0)) {
+    if (errno != ENOENT)
+      return -1;
+    memset(&sst, 0, sizeof(sst));
+  }
+
+  c.dir = dst.st_mtim;
+  c.seq = sst.st_mtim;
+  if (cache_path(path, file, sizeof(file)) != 0)
+    file[0] = '\0';
+  have_cache =
+      *file && load_cache(file, &old) == 0 && same_time(old.dir, c.dir);
+  hit = have_cache && same_time(old.seq, c.seq);
+  PROBE2(cache, "mh", hit);
+  metrics_cache(CACHE_MH, hit);
+  if (hit) {
+    *new = old.new;
+    *saved = old.total - old.new;
+    return 0;
+  }
+
+  if (have_seq && read_sequences(seqfile, &s) != 0)
+    have_seq = 0;
+  merge_ranges(&s);
+  fresh = have_seq && (sst.st_mtim.tv_sec > dst.st_mtim.tv_sec ||
+                       (sst.st_mtim.tv_sec == dst.st_mtim.tv_sec &&
+                        sst.st_mtim.tv_nsec >= dst.st_mtim.tv_nsec));
+
+  if (fresh && have_cache) { /* the same messages, other sequences */
+    c.total = old.total;
+    c.new = unseen_count(&s) < old.total ? unseen_count(&s) : old.total;
+  } else if (scan_folder(path, &s, fresh, &c.total, &c.new) != 0 ||
+             (c.total == 0 && !have_seq)) {
+    retval = -1;
+  }
+  free(s.unseen);
+  if (retval == -1)
+    return -1;
+
+  if (*file)
+    save_cache(file, &c);
+  *new = c.new;
+  *saved = c.total - c.new;
+  return 0;
+}
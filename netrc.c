@@ -325,6 +325,25 @@ search_netrc (list, host, account)
 }
 
 
+/* Free LIST, as returned by parse_netrc. */
+void
+free_netrc (list)
+     netrc_entry *list;
+{
+  netrc_entry *next;
+
+  while (list)
+    {
+      next = list->next;
+      free (list->host);
+      free (list->account);
+      free (list->password);
+      free (list);
+      list = next;
+    }
+}
+
+
 #ifdef STANDALONE
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -0,0 +1,501 @@
+/* plan.c -- compile the rc file into a list of mailboxes to check
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ */
+
+/* Before anything is checked, the rc file is turned into a plan: every line
+ * is expanded and classified once, glob patterns in absolute local paths
+ * ('*', '?' and '[...]' in any component; a trailing '/' only matches
+ * directories) are replaced by the mailboxes they match, local mailboxes
+ * reached under several names (symlinks, hard links, repeated lines) are kept
+ * only once, and remote mailboxes of the same account are put next to each
+ * other, so that they can share one connection.
+ *
+ * The plan is cached in ~/.mailcheck/plan, together with what it depends
+ * on: the identity of the rc file (device, inode, size and modification
+ * time), the values of the environment variables it uses and the identity
+ * of every directory read to expand a pattern.  As long as none of them
+ * changes, the cache is used as it is, which costs a stat() per directory:
+ *
+ *   MCPLAN1\n
+ *   R <dev> <ino> <size> <mtime sec> <mtime nsec>\n
+ *   E <name>=<value>\n          (once per variable; "U <name>" if unset)
+ *   D <dev> <ino> <mtime sec> <mtime nsec> <path>\n   (once per directory)
+ *   B <type> <group> <dev> <ino> <path>\n   (once per mailbox)
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "mailcheck.h"
+#include "metrics.h"
+#include "probes.h"
+
+#define PLAN_MAGIC "MCPLAN1\n"
+
+/* Names read while expanding wildcards, until the rc file is parsed. */
+static struct arena glob_mem = ARENA_INITIALIZER(0);
+
+/* What the plan depends on, besides the rc file itself. */
+struct deps {
+  char *text;   /* "E", "U" and "D" lines of the cache file */
+  size_t len;
+  size_t size;
+  int unusable; /* something that can't be written to the cache */
+};
+
+static void deps_add(struct deps *deps, const char *line, int n) {
+  char *p;
+
+  if (n < 0 || n >= BUF_SIZE + 64 || strchr(line, '\n') != line + n - 1) {
+    deps->unusable = 1;
+    return;
+  }
+
+  /* once is enough */
+  for (p = deps->text; p && (p = strstr(p, line)) != NULL; p++)
+    if (p == deps->text || p[-1] == '\n')
+      return;
+
+  if (deps->len + n + 1 > deps->size) {
+    deps->size = (deps->len + n + 1) * 2;
+    if ((p = realloc(deps->text, deps->size)) == NULL) {
+      deps->unusable = 1;
+      return;
+    }
+    deps->text = p;
+  }
+  memcpy(deps->text + deps->len, line, n + 1);
+  deps->len += n;
+}
+
+static void env_note(struct deps *deps, const char *name,
+                     const char *value) {
+  char line[BUF_SIZE + 64];
+  int n;
+
+  if (value)
+    n = snprintf(line, sizeof(line), "E %s=%s\n", name, value);
+  else
+    n = snprintf(line, sizeof(line), "U %s\n", name);
+  deps_add(deps, line, n);
+}
+
+static void dir_note(struct deps *deps, const char *path,
+                     const struct stat *st) {
+  char line[BUF_SIZE + 64];
+  int n;
+
+  n = snprintf(line, sizeof(line), "D %llu %llu %lld %ld %s\n",
+               (unsigned long long)st->st_dev, (unsigned long long)st->st_ino,
+               (long long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec, path);
+  deps_add(deps, line, n);
+}
+
+/* Copy PATH to BUF, replacing every "$(NAME)" by the value of environment
+ * variable NAME, which is noted in DEPS unless that is NULL.  Output is
+ * truncated to LEN bytes. */
+void expand_path(const char *path, char *buf, size_t len,
+                        struct deps *deps) {
+  char name[256];
+  const char *end, *value;
+  size_t n = 0, vlen;
+
+  while (*path && n + 1 < len) {
+    if (path[0] != '$' || path[1] != '(' ||
+        (end = strchr(path + 2, ')')) == NULL) {
+      buf[n++] = *path++;
+      continue;
+    }
+
+    vlen = end - (path + 2);
+    if (vlen >= sizeof(name))
+      vlen = sizeof(name) - 1;
+    memcpy(name, path + 2, vlen);
+    name[vlen] = '\0';
+    value = getenv(name);
+    if (deps)
+      env_note(deps, name, value);
+
+    if (value) {
+      vlen = strlen(value);
+      if (vlen > len - 1 - n)
+        vlen = len - 1 - n;
+      memcpy(buf + n, value, vlen);
+      n += vlen;
+    }
+    path = end + 1;
+  }
+  buf[n] = '\0';
+}
+
+static struct mailbox *plan_add(struct plan *plan) {
+  struct mailbox *box;
+
+  if (plan->count == plan->size) {
+    plan->size = plan->size ? 2 * plan->size : 16;
+    box = realloc(plan->box, plan->size * sizeof(*box));
+    if (box == NULL) {
+      fprintf(stderr, "mailcheck: out of memory\n");
+      exit(1);
+    }
+    plan->box = box;
+  }
+  box = &plan->box[plan->count++];
+  memset(box, 0, sizeof(*box));
+  return box;
+}
+
+/* Remote mailboxes are grouped by the URL up to the mailbox name. */
+static int same_account(const char *a, const char *b) {
+  char pa[BUF_SIZE], pb[BUF_SIZE];
+
+  remote_prefix(a, pa, sizeof(pa));
+  remote_prefix(b, pb, sizeof(pb));
+  return strcmp(pa, pb) == 0;
+}
+
+/* Is BOX already part of the plan? */
+static int plan_has(const struct plan *plan, const struct mailbox *box) {
+  int i;
+
+  for (i = 0; i < plan->count; i++) {
+    const struct mailbox *b = &plan->box[i];
+
+    if (box->type == MB_MBOX || box->type == MB_MAILDIR) {
+      if (b->type == box->type && b->dev == box->dev && b->ino == box->ino)
+        return 1;
+    } else if (!strcmp(b->path, box->path) ||
+               (box->type == MB_POP3 && b->type == MB_POP3 &&
+                same_account(b->path, box->path))) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Add local mailbox PATH to ALL, unless it is there already.  With
+ * MATCHED set, PATH was found by a pattern and must exist (and be a
+ * directory, if DIRONLY is set). */
+static void plan_local(struct plan *all, const char *path, int matched,
+                       int dironly) {
+  struct mailbox *box;
+  struct stat st;
+
+  box = plan_add(all);
+  strncpy(box->path, path, sizeof(box->path) - 1);
+
+  if (stat(box->path, &st) != 0) {
+    box->type = MB_LOCAL; /* may turn up later */
+  } else {
+    box->type = S_ISREG(st.st_mode)   ? MB_MBOX
+                : S_ISDIR(st.st_mode) ? MB_MAILDIR
+                                      : MB_LOCAL;
+    box->dev = st.st_dev;
+    box->ino = st.st_ino;
+  }
+
+  all->count--;
+  if (matched && (box->type == MB_LOCAL || (dironly && box->type != MB_MAILDIR)))
+    return;
+  if (!plan_has(all, box))
+    all->count++;
+}
+
+static int cmp_name(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Expand the glob PATTERN relative to directory DIRFD, which is named PATH
+ * (LEN bytes, ending in '/').  Directories are opened relative to their
+ * parents and read once each; the mailboxes found are added to ALL in
+ * sorted order. */
+static void plan_glob(int dirfd, char *path, size_t len, const char *pattern,
+                      struct plan *all, struct deps *deps) {
+  char comp[256], **names = NULL;
+  const char *rest;
+  struct dirent *entry;
+  struct stat st;
+  size_t clen, n;
+  int i, fd, count = 0, size = 0;
+  DIR *dir;
+
+  while (*pattern == '/')
+    pattern++;
+  rest = strchr(pattern, '/');
+  clen = rest ? (size_t)(rest - pattern) : strlen(pattern);
+  if (clen >= sizeof(comp))
+    return;
+  memcpy(comp, pattern, clen);
+  comp[clen] = '\0';
+  if (rest) {
+    while (*rest == '/')
+      rest++;
+    if (!*rest)
+      rest = NULL; /* a trailing '/' only matches directories */
+  }
+
+  /* the directory has to be looked at again if it changes */
+  if (fstat(dirfd, &st) == 0)
+    dir_note(deps, path, &st);
+
+  if (!strpbrk(comp, "*?[")) {
+    /* nothing to match, but maybe further down */
+    if (len + clen + 2 > BUF_SIZE)
+      return;
+    memcpy(path + len, comp, clen + 1);
+    if (!rest) {
+      plan_local(all, path, 1, pattern[clen] == '/');
+    } else if ((fd = openat(dirfd, comp, O_RDONLY | O_DIRECTORY)) != -1) {
+      strcpy(path + len + clen, "/");
+      plan_glob(fd, path, len + clen + 1, rest, all, deps);
+      close(fd);
+    }
+    path[len] = '\0';
+    return;
+  }
+
+  if ((fd = dup(dirfd)) == -1)
+    return;
+  if ((dir = fdopendir(fd)) == NULL) {
+    close(fd);
+    return;
+  }
+
+  while ((entry = readdir(dir))) {
+    if (fnmatch(comp, entry->d_name, FNM_PERIOD) != 0)
+      continue;
+    if (count == size) {
+      names = arena_grow(&glob_mem, names, size * sizeof(*names),
+                         (size ? 2 * size : 16) * sizeof(*names));
+      size = size ? 2 * size : 16;
+    }
+    names[count++] =
+        arena_strndup(&glob_mem, entry->d_name, strlen(entry->d_name));
+  }
+  closedir(dir);
+  qsort(names, count, sizeof(*names), cmp_name);
+
+  for (i = 0; i < count; i++) {
+    n = strlen(names[i]);
+    if (len + n + 2 <= BUF_SIZE) {
+      memcpy(path + len, names[i], n + 1);
+      if (!rest) {
+        plan_local(all, path, 1, pattern[clen] == '/');
+      } else if ((fd = openat(dirfd, names[i], O_RDONLY | O_DIRECTORY)) !=
+                 -1) {
+        strcpy(path + len + n, "/");
+        plan_glob(fd, path, len + n + 1, rest, all, deps);
+        close(fd);
+      }
+    }
+  }
+  path[len] = '\0';
+}
+
+/* Parse RCFILE into PLAN. */
+static void plan_parse(FILE *rcfile, struct plan *plan, struct deps *deps) {
+  char buf[1024], *ptr;
+  char path[BUF_SIZE], dirpath[BUF_SIZE];
+  struct plan all = {NULL, 0, 0};
+  struct mailbox *box;
+  int i, j, head, fd;
+
+  while (fgets(buf, sizeof(buf), rcfile)) {
+    /* eliminate newline */
+    ptr = strchr(buf, '\n');
+    if (ptr)
+      *ptr = '\0';
+
+    /* If it's not a blank line or comment, it names a mailbox */
+    if (!strlen(buf) || *buf == '#')
+      continue;
+
+    expand_path(buf, path, sizeof(path), deps);
+
+    if (is_remote(path)) {
+      box = plan_add(&all);
+      strcpy(box->path, path);
+      box->type = remote_type(path);
+      all.count--;
+      if (!plan_has(&all, box))
+        all.count++;
+    } else if (*path != '/' || !strpbrk(path, "*?[")) {
+      plan_local(&all, path, 0, 0);
+    } else if ((fd = open("/", O_RDONLY | O_DIRECTORY)) != -1) {
+      strcpy(dirpath, "/");
+      plan_glob(fd, dirpath, 1, path, &all, deps);
+      close(fd);
+    }
+  }
+
+  /* Put the IMAP (or JMAP) mailboxes of each account together, where the
+   * first of them was listed. */
+  for (i = 0; i < all.count; i++) {
+    if (all.box[i].group < 0)
+      continue;
+    head = plan->count;
+    *plan_add(plan) = all.box[i];
+    plan->box[head].group = 1;
+    if (all.box[i].type != MB_IMAP && all.box[i].type != MB_JMAP)
+      continue;
+    for (j = i + 1; j < all.count; j++) {
+      if (all.box[j].type == all.box[i].type &&
+          same_account(all.box[i].path, all.box[j].path)) {
+        *plan_add(plan) = all.box[j];
+        plan->box[plan->count - 1].group = 0;
+        plan->box[head].group++;
+        all.box[j].group = -1;
+      }
+    }
+  }
+  free(all.box);
+  arena_reset(&glob_mem);
+}
+
+/* Is a dependency LINE of the cache still met? */
+static int dep_matches(char *line) {
+  unsigned long long dev, ino;
+  long long sec;
+  long nsec;
+  struct stat st;
+  char *eq, *value;
+  int n, ok;
+
+  if (line[0] == 'D')
+    return sscanf(line, "D %llu %llu %lld %ld %n", &dev, &ino, &sec, &nsec,
+                  &n) == 4 &&
+           stat(line + n, &st) == 0 && st.st_dev == dev && st.st_ino == ino &&
+           st.st_mtim.tv_sec == sec && st.st_mtim.tv_nsec == nsec;
+  if (line[0] == 'U')
+    return getenv(line + 2) == NULL;
+  if (line[0] != 'E' || (eq = strchr(line, '=')) == NULL)
+    return 0;
+  *eq = '\0';
+  value = getenv(line + 2);
+  ok = value && !strcmp(value, eq + 1);
+  *eq = '=';
+  return ok;
+}
+
+/* Read the cached plan, if it was made from the rc file described by ST.
+ * Returns -1 if it can't be used. */
+static int plan_read_cache(const char *file, const struct stat *st,
+                           struct plan *plan) {
+  char line[BUF_SIZE + 64], key[128];
+  struct mailbox *box;
+  unsigned long long dev, ino;
+  FILE *fp;
+  int n, ok = 0;
+
+  if ((fp = fopen(file, "r")) == NULL)
+    return -1;
+
+  snprintf(key, sizeof(key), "R %llu %llu %lld %lld %ld\n",
+           (unsigned long long)st->st_dev, (unsigned long long)st->st_ino,
+           (long long)st->st_size, (long long)st->st_mtim.tv_sec,
+           st->st_mtim.tv_nsec);
+  if (!fgets(line, sizeof(line), fp) || strcmp(line, PLAN_MAGIC) != 0 ||
+      !fgets(line, sizeof(line), fp) || strcmp(line, key) != 0)
+    goto out;
+
+  while (fgets(line, sizeof(line), fp)) {
+    if ((n = strlen(line)) == 0 || line[n - 1] != '\n')
+      goto out;
+    line[n - 1] = '\0';
+
+    if (line[0] == 'B') {
+      box = plan_add(plan);
+      if (sscanf(line, "B %d %d %llu %llu %n", &box->type, &box->group, &dev,
+                 &ino, &n) != 4)
+        goto out;
+      box->dev = dev;
+      box->ino = ino;
+      strncpy(box->path, line + n, sizeof(box->path) - 1);
+    } else if (!dep_matches(line)) {
+      goto out;
+    }
+  }
+  ok = 1;
+
+out:
+  fclose(fp);
+  if (!ok)
+    plan->count = 0;
+  return ok ? 0 : -1;
+}
+
+static void plan_write_cache(const char *file, const struct stat *st,
+                             const struct plan *plan,
+                             const struct deps *deps) {
+  char tmp[BUF_SIZE + 8];
+  FILE *fp;
+  int i;
+
+  if (deps->unusable || (fp = state_create(file, tmp, sizeof(tmp))) == NULL)
+    return;
+
+  fprintf(fp, "%sR %llu %llu %lld %lld %ld\n", PLAN_MAGIC,
+          (unsigned long long)st->st_dev, (unsigned long long)st->st_ino,
+          (long long)st->st_size, (long long)st->st_mtim.tv_sec,
+          st->st_mtim.tv_nsec);
+  if (deps->text)
+    fputs(deps->text, fp);
+  for (i = 0; i < plan->count; i++)
+    fprintf(fp, "B %d %d %llu %llu %s\n", plan->box[i].type,
+            plan->box[i].group, (unsigned long long)plan->box[i].dev,
+            (unsigned long long)plan->box[i].ino, plan->box[i].path);
+
+  state_commit(fp, tmp, file, 0);
+}
+
+struct plan *plan_load(void) {
+  char file[BUF_SIZE];
+  struct deps deps = {NULL, 0, 0, 0};
+  struct plan *plan;
+  struct stat st;
+  FILE *rcfile;
+  int i, cached;
+
+  if ((plan = calloc(1, sizeof(*plan))) == NULL) {
+    fprintf(stderr, "mailcheck: out of memory\n");
+    exit(1);
+  }
+
+  rcfile = open_rcfile();
+  cached = fstat(fileno(rcfile), &st) == 0 &&
+           state_path(file, sizeof(file), NULL, "plan") == 0;
+  if (!cached || plan_read_cache(file, &st, plan) != 0) {
+    PROBE2(cache, "plan", 0);
+    metrics_cache(CACHE_PLAN, 0);
+    plan_parse(rcfile, plan, &deps);
+    if (cached)
+      plan_write_cache(file, &st, plan, &deps);
+  } else {
+    PROBE2(cache, "plan", 1);
+    metrics_cache(CACHE_PLAN, 1);
+  }
+  fclose(rcfile);
+  free(deps.text);
+
+  for (i = 0; i < plan->count; i++)
+    plan->box[i].id = i;
+
+  return plan;
+}
+
+void plan_free(struct plan *plan) {
+  if (!plan)
+    return;
+  free(plan->box);
+  free(plan);
+}
@@ -0,0 +1,72 @@
+/* probes.h -- static tracepoints (USDT) for bpftrace, perf and systemtap
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ */
+
+/* The probes are compiled in when <sys/sdt.h> (systemtap-sdt-dev) is
+ * available, unless NO_PROBES is defined.  An unused probe is a single nop
+ * instruction.  All of them belong to provider "mailcheck"; see the
+ * bpftrace/ directory for examples.
+ *
+ *   mailbox_start(id, path, type)
+ *   mailbox_done(id, path, new, unread, saved, ns)
+ *   dir_scan(id, dir, entries, ns)
+ *   mbox_chunk(id, bytes, messages, ns)     every MBOX_CHUNK_LINES lines
+ *   dns_done(host, ns, error)
+ *   connect_done(host, port, fd, ns)
+ *   tls_handshake(host, port, resumed, ns)
+ *   command(host, port, bytes)
+ *   response(host, port, ok, ns)            ns since the last command
+ *   cache(name, hit)                        name is "plan", "tls" or
+ *                                           "daemon"
+ *
+ * `id' is the mailbox's position in the check plan, -1 outside a check.
+ * Durations are in nanoseconds, from CLOCK_MONOTONIC. */
+
+#ifndef _PROBES_H_
+#define _PROBES_H_ 1
+
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define HAVE_PROBES 1
+#endif
+#endif
+
+#include <time.h>
+
+#ifdef HAVE_PROBES
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(mailcheck, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(mailcheck, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(mailcheck, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(mailcheck, name, a, b, c, d)
+#define PROBE6(name, a, b, c, d, e, f)                                         \
+  DTRACE_PROBE6(mailcheck, name, a, b, c, d, e, f)
+#else
+/* Arguments are still "used", so that nothing is reported unused; without
+ * side effects they cost nothing. */
+#define PROBE1(name, a) ((void)(a))
+#define PROBE2(name, a, b) ((void)(a), (void)(b))
+#define PROBE3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+#define PROBE4(name, a, b, c, d) ((void)(a), (void)(b), (void)(c), (void)(d))
+#define PROBE6(name, a, b, c, d, e, f)                                         \
+  ((void)(a), (void)(b), (void)(c), (void)(d), (void)(e), (void)(f))
+#endif /* HAVE_PROBES */
+
+/* The durations are also needed for -P (see metrics.c), so the clock is read
+ * with or without probes. */
+static inline long long probe_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#define MBOX_CHUNK_LINES (4096)
+
+/* Mailbox being checked by this thread, for the probes. */
+extern __thread int probe_mailbox;
+
+#endif /* _PROBES_H_ */
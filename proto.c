@@ -0,0 +1,480 @@
+/* proto.c -- incremental tokenizer for IMAP and POP3 responses
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ *
+ * Compile with -DSTANDALONE to test this module: the test program runs
+ * fixed cases, a fuzzer and a throughput measurement.
+ */
+
+/* The tokenizer never blocks and never copies: it looks at what is in the
+ * receive buffer, and either returns a token pointing into it or TOK_MORE
+ * if the token isn't complete yet.  The caller reads more data and tries
+ * again, so the same code serves blocking and non-blocking connections.
+ *
+ * Only what mailcheck needs from RFC 3501 is distinguished: atoms, quoted
+ * strings, literals, parentheses, brackets and line ends.  Response text after
+ * OK/NO/BAD/BYE is free form and is fetched with imap_text(). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "proto.h"
+
+char *rbuf_reserve(struct rbuf *b, size_t *space) {
+  if (b->start == b->end) {
+    b->start = b->end = 0;
+  } else if (b->start > RBUF_SIZE - b->end) {
+    memmove(b->data, b->data + b->start, b->end - b->start);
+    b->end -= b->start;
+    b->start = 0;
+  }
+  *space = RBUF_SIZE - b->end;
+  return b->data + b->end;
+}
+
+void rbuf_commit(struct rbuf *b, size_t n) { b->end += n; }
+
+/* A token that fills the whole buffer can never be completed. */
+static int rbuf_full(const struct rbuf *b) {
+  return b->end - b->start == RBUF_SIZE;
+}
+
+/* Characters that end an atom.  '[' is included, so that response codes come
+ * out as separate tokens. */
+static int atom_special(unsigned char c) {
+  return c <= ' ' || c == 0x7f || c == '(' || c == ')' || c == '{' ||
+         c == '"' || c == '[' || c == ']';
+}
+
+int imap_lex(struct imap_lexer *lx, struct rbuf *b, struct token *t) {
+  const char *p, *q, *end;
+  size_t n;
+
+  t->ptr = NULL;
+  t->len = 0;
+  t->more = 0;
+
+  if (lx->literal) {
+    n = b->end - b->start;
+    if (n == 0)
+      return t->type = TOK_MORE;
+    if (n > lx->literal)
+      n = lx->literal;
+    t->ptr = b->data + b->start;
+    t->len = n;
+    lx->literal -= n;
+    t->more = lx->literal;
+    b->start += n;
+    return t->type = TOK_LITERAL;
+  }
+
+  while (b->start < b->end && b->data[b->start] == ' ')
+    b->start++;
+  p = b->data + b->start;
+  end = b->data + b->end;
+  if (p == end)
+    return t->type = TOK_MORE;
+
+  switch (*p) {
+  case '\r':
+    if (end - p < 2)
+      return t->type = TOK_MORE;
+    b->start++;
+    if (p[1] != '\n')
+      return t->type = TOK_ERROR;
+    b->start++;
+    return t->type = TOK_EOL;
+  case '\n':
+    b->start++;
+    return t->type = TOK_EOL;
+  case '(':
+    b->start++;
+    return t->type = TOK_LPAREN;
+  case ')':
+    b->start++;
+    return t->type = TOK_RPAREN;
+  case '[':
+    b->start++;
+    return t->type = TOK_LBRACKET;
+  case ']':
+    b->start++;
+    return t->type = TOK_RBRACKET;
+
+  case '"':
+    for (q = p + 1; q < end; q++) {
+      if (*q == '\\') {
+        if (++q == end)
+          break;
+      } else if (*q == '"') {
+        t->ptr = p + 1;
+        t->len = q - p - 1;
+        b->start = q + 1 - b->data;
+        return t->type = TOK_QUOTED;
+      } else if (*q == '\r' || *q == '\n') {
+        /* leave the line end for imap_skip_line() */
+        b->start = q - b->data;
+        return t->type = TOK_ERROR;
+      }
+    }
+    return t->type = rbuf_full(b) ? TOK_ERROR : TOK_MORE;
+
+  case '{':
+    n = 0;
+    for (q = p + 1; q < end && *q >= '0' && *q <= '9'; q++) {
+      n = n * 10 + (*q - '0');
+      if (n > 0x7fffffff)
+        goto bad_literal;
+    }
+    if (q < end && *q == '+') /* LITERAL+ */
+      q++;
+    if (q == end)
+      return t->type = TOK_MORE;
+    if (q == p + 1 || *q++ != '}')
+      goto bad_literal;
+    if (q == end || (*q == '\r' && q + 1 == end))
+      return t->type = TOK_MORE;
+    if (*q == '\r')
+      q++;
+    if (*q++ != '\n')
+      goto bad_literal;
+
+    b->start = q - b->data;
+    if (n == 0) {
+      t->ptr = q;
+      return t->type = TOK_LITERAL;
+    }
+    lx->literal = n;
+    return imap_lex(lx, b, t);
+
+  bad_literal:
+    b->start++;
+    return t->type = TOK_ERROR;
+
+  default:
+    for (q = p; q < end && !atom_special(*q); q++)
+      ;
+    if (q == p) { /* control character */
+      b->start++;
+      return t->type = TOK_ERROR;
+    }
+    if (q == end)
+      return t->type = rbuf_full(b) ? TOK_ERROR : TOK_MORE;
+    t->ptr = p;
+    t->len = q - p;
+    b->start = q - b->data;
+    return t->type = TOK_ATOM;
+  }
+}
+
+int imap_text(struct imap_lexer *lx, struct rbuf *b, struct token *t) {
+  const char *p, *nl;
+
+  if (lx->literal)
+    return t->type = TOK_ERROR;
+  while (b->start < b->end && b->data[b->start] == ' ')
+    b->start++;
+
+  p = b->data + b->start;
+  if ((nl = memchr(p, '\n', b->end - b->start)) == NULL)
+    return t->type = rbuf_full(b) ? TOK_ERROR : TOK_MORE;
+
+  t->ptr = p;
+  t->len = nl - p;
+  if (t->len && p[t->len - 1] == '\r')
+    t->len--;
+  t->more = 0;
+  b->start = nl + 1 - b->data;
+  return t->type = TOK_TEXT;
+}
+
+int imap_skip_line(struct imap_lexer *lx, struct rbuf *b) {
+  struct token t;
+  const char *nl;
+
+  while (!lx->raw) {
+    switch (imap_lex(lx, b, &t)) {
+    case TOK_EOL:
+    case TOK_MORE:
+      return t.type;
+    case TOK_ERROR:
+      /* no way to tokenize this, skip to the line end as plain bytes */
+      lx->raw = 1;
+      break;
+    }
+  }
+
+  nl = memchr(b->data + b->start, '\n', b->end - b->start);
+  if (nl == NULL) {
+    b->start = b->end;
+    return TOK_MORE;
+  }
+  b->start = nl + 1 - b->data;
+  lx->raw = 0;
+  return TOK_EOL;
+}
+
+int tok_is(const struct token *t, const char *s) {
+  return t->type == TOK_ATOM && strlen(s) == t->len &&
+         strncasecmp(t->ptr, s, t->len) == 0;
+}
+
+long tok_number(const struct token *t) {
+  long n = 0;
+  size_t i;
+
+  if (t->type != TOK_ATOM || t->len == 0 || t->len > 18)
+    return -1;
+  for (i = 0; i < t->len; i++) {
+    if (t->ptr[i] < '0' || t->ptr[i] > '9')
+      return -1;
+    n = n * 10 + (t->ptr[i] - '0');
+  }
+  return n;
+}
+
+void tok_append(const struct token *t, char *dst, size_t len, size_t *dlen) {
+  size_t i, j = *dlen;
+
+  for (i = 0; i < t->len && j + 1 < len; i++) {
+    if (t->type == TOK_QUOTED && t->ptr[i] == '\\' && i + 1 < t->len)
+      i++;
+    dst[j++] = t->ptr[i];
+  }
+  if (j < len)
+    dst[j] = '\0';
+  *dlen = j;
+}
+
+int pop3_line(struct rbuf *b, int multiline, struct token *t) {
+  const char *p, *nl;
+
+  p = b->data + b->start;
+  t->ptr = p;
+  t->more = 0;
+  if ((nl = memchr(p, '\n', b->end - b->start)) == NULL) {
+    if (!rbuf_full(b))
+      return t->type = TOK_MORE;
+    /* overlong line: hand it out in pieces */
+    t->len = b->end - b->start;
+    b->start = b->end;
+    return t->type = TOK_TEXT;
+  }
+
+  t->len = nl - p;
+  if (t->len && p[t->len - 1] == '\r')
+    t->len--;
+  b->start = nl + 1 - b->data;
+
+  if (multiline && t->len && p[0] == '.') {
+    if (t->len == 1)
+      return t->type = TOK_EOL;
+    t->ptr++;
+    t->len--;
+  }
+  return t->type = TOK_TEXT;
+}
+
+#ifdef STANDALONE
+#include <assert.h>
+#include <time.h>
+
+/* Tokenize INPUT, feeding it in chunks of random size up to MAXCHUNK (1 for
+ * byte-by-byte), and write a printable dump of the tokens to OUT. */
+static size_t tokenize(const char *input, size_t inlen, size_t maxchunk,
+                       unsigned *seed, char *out, size_t outlen) {
+  static struct rbuf b;
+  struct imap_lexer lx = {0};
+  struct token t;
+  size_t off = 0, o = 0, space, n;
+  int skipping = 0, continued = 0;
+  char *w;
+
+  b.start = b.end = 0;
+  for (;;) {
+    int type;
+
+    if (skipping) {
+      type = imap_skip_line(&lx, &b);
+      if (type == TOK_EOL)
+        skipping = 0;
+    } else {
+      type = imap_lex(&lx, &b, &t);
+      assert(t.len <= RBUF_SIZE);
+      assert(!t.len || (t.ptr >= b.data && t.ptr + t.len <= b.data + b.end));
+      if (type == TOK_ERROR)
+        skipping = 1;
+      /* literal chunks are dumped as one token */
+      if (type != TOK_MORE && o + t.len + 8 < outlen) {
+        if (continued)
+          o--;
+        else
+          o += snprintf(out + o, outlen - o, "%d:", type);
+        if (t.len)
+          memcpy(out + o, t.ptr, t.len);
+        o += t.len;
+        out[o++] = ' ';
+        continued = type == TOK_LITERAL && t.more;
+      }
+    }
+
+    if (type == TOK_MORE) {
+      if (off == inlen)
+        break;
+      w = rbuf_reserve(&b, &space);
+      assert(space > 0);
+      n = maxchunk == 1 ? 1 : 1 + rand_r(seed) % maxchunk;
+      if (n > space)
+        n = space;
+      if (n > inlen - off)
+        n = inlen - off;
+      memcpy(w, input + off, n);
+      rbuf_commit(&b, n);
+      off += n;
+    }
+  }
+  out[o] = '\0';
+  return o;
+}
+
+static const char *corpus[] = {
+    "* OK [CAPABILITY IMAP4rev1 LIST-STATUS] ready\r\n",
+    "* STATUS INBOX (MESSAGES 12 UNSEEN 3)\r\n",
+    "* STATUS \"Sent \\\"Items\\\"\" (UNSEEN 1 MESSAGES 4)\r\n",
+    "* STATUS {9}\r\nLists/foo (MESSAGES 0 UNSEEN 0)\r\n",
+    "* LIST (\\HasNoChildren \\Noselect) \"/\" \"a b\"\r\n",
+    "* LIST () NIL {3+}\r\nx\r\n\r\n",
+    "a003 OK [READ-ONLY] LIST completed\r\n",
+    "* 23 EXISTS\r\n+ go ahead\r\n",
+    "* BYE \"unbalanced\r\n",
+};
+
+static void test_cases(void) {
+  char all[4096], a[8192], b[8192];
+  unsigned seed = 1;
+  size_t i, len = 0;
+
+  for (i = 0; i < sizeof(corpus) / sizeof(*corpus); i++) {
+    strcpy(all + len, corpus[i]);
+    len += strlen(corpus[i]);
+  }
+
+  tokenize(corpus[3], strlen(corpus[3]), 4096, &seed, a, sizeof(a));
+  assert(strcmp(a, "2:* 2:STATUS 4:Lists/foo 5: 2:MESSAGES 2:0 2:UNSEEN "
+                   "2:0 6: 9: ") == 0);
+  tokenize(corpus[2], strlen(corpus[2]), 4096, &seed, a, sizeof(a));
+  assert(strstr(a, "3:Sent \\\"Items\\\" ") != NULL);
+
+  /* chunking must not change the result */
+  tokenize(all, len, 1 << 20, &seed, a, sizeof(a));
+  tokenize(all, len, 1, &seed, b, sizeof(b));
+  assert(strcmp(a, b) == 0);
+  for (i = 0; i < 1000; i++) {
+    tokenize(all, len, 1 + i % 17, &seed, b, sizeof(b));
+    assert(strcmp(a, b) == 0);
+  }
+  /* POP3 multi-line data with dot-stuffing */
+  {
+    static struct rbuf pb;
+    static const char data[] = "+OK\r\n..dotted\r\nplain\n.\r\n";
+    struct token t;
+
+    memcpy(pb.data, data, sizeof(data) - 1);
+    pb.start = 0;
+    pb.end = sizeof(data) - 1;
+    assert(pop3_line(&pb, 0, &t) == TOK_TEXT && t.len == 3);
+    assert(pop3_line(&pb, 1, &t) == TOK_TEXT && t.len == 7 &&
+           !strncmp(t.ptr, ".dotted", 7));
+    assert(pop3_line(&pb, 1, &t) == TOK_TEXT && t.len == 5);
+    assert(pop3_line(&pb, 1, &t) == TOK_EOL);
+    assert(pop3_line(&pb, 1, &t) == TOK_MORE);
+  }
+  printf("cases: ok\n");
+}
+
+static void test_fuzz(int rounds) {
+  static const char alphabet[] = " ()[]{}\"\\\r\n+*%0123456789aZ\x01\x7f";
+  char input[2048], a[65536], b[65536];
+  unsigned seed = 42;
+  size_t len, i, j;
+  int r;
+
+  for (r = 0; r < rounds; r++) {
+    /* start from a corpus entry, then mutate it */
+    len = 0;
+    for (j = 0; j < 4; j++) {
+      const char *s = corpus[rand_r(&seed) % (sizeof(corpus) / sizeof(*corpus))];
+      memcpy(input + len, s, strlen(s));
+      len += strlen(s);
+    }
+    for (j = rand_r(&seed) % 8; j > 0; j--) {
+      i = rand_r(&seed) % len;
+      if (rand_r(&seed) % 2)
+        input[i] = alphabet[rand_r(&seed) % (sizeof(alphabet) - 1)];
+      else
+        input[i] = rand_r(&seed) % 256;
+    }
+
+    tokenize(input, len, 1 << 20, &seed, a, sizeof(a));
+    tokenize(input, len, 1 + rand_r(&seed) % 32, &seed, b, sizeof(b));
+    if (strcmp(a, b) != 0) {
+      fprintf(stderr, "fuzz: chunking changed result in round %d\n", r);
+      exit(1);
+    }
+  }
+  printf("fuzz: %d rounds ok\n", rounds);
+}
+
+static void test_throughput(int folders) {
+  struct rbuf *b = malloc(sizeof(*b));
+  struct imap_lexer lx = {0};
+  struct timespec t0, t1;
+  struct token t;
+  char *input, *w;
+  size_t len = 0, off = 0, space, n;
+  long tokens = 0;
+  double secs;
+  int i;
+
+  input = malloc((size_t)folders * 128);
+  for (i = 0; i < folders; i++)
+    len += sprintf(input + len,
+                   "* LIST (\\HasNoChildren) \"/\" \"Folder %d\"\r\n"
+                   "* STATUS \"Folder %d\" (MESSAGES %d UNSEEN %d)\r\n",
+                   i, i, i * 7, i % 13);
+
+  b->start = b->end = 0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (;;) {
+    if (imap_lex(&lx, b, &t) != TOK_MORE) {
+      tokens++;
+      continue;
+    }
+    if (off == len)
+      break;
+    w = rbuf_reserve(b, &space);
+    n = len - off < 4096 ? len - off : 4096;
+    if (n > space)
+      n = space;
+    memcpy(w, input + off, n);
+    rbuf_commit(b, n);
+    off += n;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  printf("throughput: %zu bytes, %ld tokens in %.3f s, %.1f MB/s\n", len,
+         tokens, secs, len / secs / 1e6);
+  free(input);
+  free(b);
+}
+
+int main(int argc, char **argv) {
+  test_cases();
+  test_fuzz(argc > 1 ? atoi(argv[1]) : 100000);
+  test_throughput(argc > 2 ? atoi(argv[2]) : 200000);
+  return 0;
+}
+#endif /* STANDALONE */
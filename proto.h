@@ -0,0 +1,90 @@
+/* proto.h -- incremental tokenizer for IMAP and POP3 responses
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ */
+
+#ifndef _PROTO_H_
+#define _PROTO_H_ 1
+
+#include <stddef.h>
+
+#define RBUF_SIZE (16384)
+
+/* Receive buffer.  Unread data is data[start..end).  Space is made by sliding
+ * the unread data back to the front, so that a token never wraps and can be
+ * handed out in place. */
+struct rbuf {
+  size_t start;
+  size_t end;
+  char data[RBUF_SIZE];
+};
+
+/* Return a pointer to the free space at the end of B, sliding unread data to
+ * the front first if that makes more room, and store its size in *SPACE. */
+char *rbuf_reserve(struct rbuf *b, size_t *space);
+
+/* Append N bytes, just written to the space returned by rbuf_reserve(). */
+void rbuf_commit(struct rbuf *b, size_t n);
+
+/* Token types returned by imap_lex() */
+enum token_type {
+  TOK_MORE,     /* not enough data buffered, nothing consumed */
+  TOK_ERROR,    /* syntax error; call imap_skip_line() to resynchronize */
+  TOK_ATOM,     /* also NIL, numbers, tags, "*" and "+" */
+  TOK_QUOTED,   /* contents without the quotes, escapes still in place */
+  TOK_LITERAL,  /* contents of {n} literal, possibly in several chunks */
+  TOK_LPAREN,
+  TOK_RPAREN,
+  TOK_LBRACKET,
+  TOK_RBRACKET,
+  TOK_EOL,      /* end of a response line */
+  TOK_TEXT      /* rest of a line, see imap_text() */
+};
+
+/* A token points into the receive buffer and is only valid until the buffer
+ * is next refilled. */
+struct token {
+  int type;
+  const char *ptr;
+  size_t len;
+  size_t more; /* TOK_LITERAL: bytes of the literal still to come */
+};
+
+struct imap_lexer {
+  size_t literal; /* bytes left of the literal being delivered */
+  int raw;        /* imap_skip_line() is looking for the line end */
+};
+
+/* Get the next token from B.  Returns the token type, which is also stored in
+ * T->type. */
+int imap_lex(struct imap_lexer *lx, struct rbuf *b, struct token *t);
+
+/* Get the rest of the current line as a TOK_TEXT token (without the line
+ * end, which is consumed).  Used for human readable response text, which is
+ * not tokenized. */
+int imap_text(struct imap_lexer *lx, struct rbuf *b, struct token *t);
+
+/* Discard input up to and including the next line end.  Returns TOK_EOL when
+ * done, TOK_MORE if more input is needed. */
+int imap_skip_line(struct imap_lexer *lx, struct rbuf *b);
+
+/* Does atom T equal the (uppercase) keyword S, ignoring case? */
+int tok_is(const struct token *t, const char *s);
+
+/* Value of a numeric atom, or -1 if T isn't one. */
+long tok_number(const struct token *t);
+
+/* Copy the string value of an atom, quoted string or literal chunk to DST,
+ * removing quoted-string escapes, and append it to what DST already holds
+ * (*DLEN bytes).  Output is truncated to fit LEN bytes including the
+ * terminating NUL. */
+void tok_append(const struct token *t, char *dst, size_t len, size_t *dlen);
+
+/* Get one complete POP3 line (status line or multi-line data) from B,
+ * without the line end.  Returns TOK_TEXT, or TOK_MORE if the line is
+ * incomplete.  For multi-line data, pass MULTILINE = 1: the terminating "."
+ * is reported as TOK_EOL and dot-stuffing is undone. */
+int pop3_line(struct rbuf *b, int multiline, struct token *t);
+
+#endif /* _PROTO_H_ */
@@ -0,0 +1,1097 @@
+/* remote.c -- check mailboxes on POP3 and IMAP servers
+ *
+ * Copyright 2001 Rob Funk <rfunk@funknet.net>
+ *           2003, 2005 Tomas Hoger <thoger@pobox.sk>
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ */
+
+/* Server responses are taken apart with the tokenizer in proto.c rather than
+ * read line by line, so quoted and literal mailbox names, reordered STATUS
+ * items and unrelated untagged responses are all handled. */
+
+#include <ctype.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "conn.h"
+#include "mailcheck.h"
+#include "metrics.h"
+#include "netrc.h"
+#include "probes.h"
+#include "proto.h"
+#include "uidset.h"
+
+/* STATUS commands sent ahead of the replies read */
+#define IMAP_WINDOW (64)
+/* seconds of quiet after which a watching connection is kept alive */
+#define WATCH_NOOP (25 * 60)
+
+/* ~/.netrc as parsed last, and its modification time then. */
+static pthread_mutex_t netrc_lock = PTHREAD_MUTEX_INITIALIZER;
+static netrc_entry *netrc_list;
+static struct timespec netrc_mtime;
+
+/* Copy the password for given account on given host from ~/.netrc file to
+ * PASS, LEN bytes long.  The file is only parsed again when it changes, so
+ * that the daemon and bulk mode don't use more memory with every check.
+ * Returns -1 if there is no password. */
+static int getpw(const char *host, const char *account, char *pass,
+                 size_t len) {
+  char file[256];
+  struct stat sb;
+  netrc_entry *head, *a;
+  int retval = -1;
+
+  snprintf(file, sizeof(file), "%s/.netrc", Homedir);
+
+  if (stat(file, &sb))
+    return -1;
+
+  if (sb.st_mode & 077) {
+    static int issued_warning = 0;
+
+    if (!issued_warning++)
+      fprintf(stderr,
+              "mailcheck: WARNING! %s may be readable by other users.\n"
+              "mailcheck: Type \"chmod 0600 %s\" to correct the permissions.\n",
+              file, file);
+  }
+
+  pthread_mutex_lock(&netrc_lock);
+  if (!netrc_list || sb.st_mtim.tv_sec != netrc_mtime.tv_sec ||
+      sb.st_mtim.tv_nsec != netrc_mtime.tv_nsec) {
+    free_netrc(netrc_list);
+    netrc_list = parse_netrc(file);
+    netrc_mtime = sb.st_mtim;
+  }
+  head = netrc_list;
+  if (!head) {
+    static int issued_warning = 0;
+
+    if (!issued_warning++)
+      fprintf(stderr, "mailcheck: WARNING! %s could not be read.\n", file);
+  } else if (host && account) {
+    a = search_netrc(head, (char *)host, (char *)account);
+    if (a && a->password) {
+      strncpy(pass, a->password, len - 1);
+      retval = 0;
+    }
+  }
+  pthread_mutex_unlock(&netrc_lock);
+  return retval;
+}
+
+/* returns port number, or zero on error */
+/* returns hostname, box and user through pointers */
+/* sets *tls for the "imaps", "pop3s" and "jmap" protocols */
+int parse_url(const char *path, char *hostname, char *box, char *user,
+              int *tls) {
+  char buf[BUF_SIZE];
+  int port = 0;
+  char *p, *q, *h, *proto;
+
+  strncpy(buf, path, BUF_SIZE - 1);
+  buf[BUF_SIZE - 1] = '\0';
+  /* first separate "protocol:" part */
+  p = strchr(buf, ':');
+  if (!p)
+    return (0);
+  *p = '\0';
+  proto = buf;
+  h = p + 1;
+  *tls = 0;
+  if (!strcmp(proto, "pop3"))
+    port = 110;
+  else if (!strcmp(proto, "imap"))
+    port = 143;
+  else if (!strcmp(proto, "pop3s")) {
+    port = 995;
+    *tls = 1;
+  } else if (!strcmp(proto, "imaps")) {
+    port = 993;
+    *tls = 1;
+  } else if (!strcmp(proto, "jmap")) { /* always over HTTPS */
+    port = 443;
+    *tls = 1;
+  }
+  /* handle "pop3://hostname" form */
+  while (*h == '/')
+    h++;
+  /* change "hostname/" or "hostname/something" to "hostname" */
+  p = strchr(h, '/');
+  if (p) {
+    *p = '\0';
+    p++;
+    if (*p != '\0')
+      strncpy(box, p, BUF_SIZE - 1);
+    else
+      strcpy(box, "INBOX");
+  } else
+    strcpy(box, "INBOX");
+  /* determine username -- look for user@hostname, else use USER */
+  p = strrchr(h, '@');
+  if (p) {
+    *p = '\0';
+    p++;
+    q = h;
+    h = p;
+  } else {
+    /* default to getenv("USER") */
+    q = getenv("USER");
+    if (!q)
+      return (0);
+  }
+  strncpy(user, q, 127);
+  /* check for port specification */
+  p = strchr(h, ':');
+  if (p) {
+    *p = '\0';
+    p++;
+    if (isdigit(*p)) {
+      int n = atoi(p);
+      if (n > 0)
+        port = n;
+    }
+  }
+  strncpy(hostname, h, 127);
+
+  return (port);
+}
+
+/* Mailbox type of the remote mailbox URL PATH. */
+int remote_type(const char *path) {
+  if (strncmp(path, "pop3", 4) == 0)
+    return MB_POP3;
+  return strncmp(path, "jmap", 4) == 0 ? MB_JMAP : MB_IMAP;
+}
+
+/* like parse_url() for the URL of MB, and returns the password through
+ * pass */
+int getnetinfo(const struct mailbox *mb, char *hostname, char *box, char *user,
+               char *pass, int *tls) {
+  int port;
+
+  if ((port = parse_url(mb->path, hostname, box, user, tls)) == 0)
+    return (0);
+
+  /* a password from the bulk manifest, or from $HOME/.netrc */
+  if (mb->pass)
+    strncpy(pass, mb->pass, 127);
+  else
+    getpw(hostname, user, pass, 128);
+
+  return (port);
+}
+
+/* Copy the part of remote mailbox URL PATH that names the account, up to and
+ * including the '/' in front of the mailbox name, to BUF. */
+void remote_prefix(const char *path, char *buf, size_t len) {
+  char *p;
+
+  strncpy(buf, path, len - 1);
+  buf[len - 1] = '\0';
+  if ((p = strchr(buf, ':')) == NULL)
+    return;
+  p++;
+  while (*p == '/')
+    p++;
+  if ((p = strchr(p, '/')) != NULL)
+    p[1] = '\0';
+  else
+    strncat(buf, "/", len - strlen(buf) - 1);
+}
+
+/* Read a POP3 status line into BUF.  Returns 0 for "+OK", -1 otherwise. */
+static int pop3_status(struct conn *c, char *buf) {
+  struct token t;
+  size_t len = 0;
+
+  buf[0] = '\0';
+  while (pop3_line(&c->in, 0, &t) == TOK_MORE)
+    if (conn_fill(c) <= 0)
+      return -1;
+  tok_append(&t, buf, BUF_SIZE, &len);
+  PROBE4(response, c->host, c->port, buf[0] == '+', probe_ns() - c->sent);
+  return buf[0] == '+' ? 0 : -1;
+}
+
+/* Get the next line of a POP3 multi-line response.  Returns TOK_TEXT, or
+ * TOK_EOL at the terminating ".", or TOK_ERROR on EOF. */
+static int pop3_data(struct conn *c, struct token *t) {
+  while (pop3_line(&c->in, 1, t) == TOK_MORE)
+    if (conn_fill(c) <= 0)
+      return t->type = TOK_ERROR;
+  return t->type;
+}
+
+/* Upgrade a cleartext POP3 connection with STLS, if the server offers it. */
+static int pop3_starttls(struct conn *c, char *buf) {
+  struct token t;
+  int stls = 0;
+
+  conn_printf(c, "CAPA\r\n");
+  if (pop3_status(c, buf) == 0) {
+    while (pop3_data(c, &t) == TOK_TEXT) {
+      if (t.len == 4 && strncasecmp(t.ptr, "STLS", 4) == 0)
+        stls = 1;
+    }
+    if (t.type == TOK_ERROR)
+      return -1;
+  }
+  if (!stls)
+    return 0;
+
+  conn_printf(c, "STLS\r\n");
+  if (pop3_status(c, buf) != 0) {
+    fprintf(stderr, "mailcheck: STLS refused by '%s:%d'\n", c->host, c->port);
+    metrics_error(ERROR_TLS);
+    return -1;
+  }
+  return conn_starttls(c);
+}
+
+/* Path of the file with the ids seen of USER@HOST:PORT. */
+static int uidl_path(const char *user, const char *host, int port, char *buf,
+                     size_t len) {
+  char name[BUF_SIZE + 160];
+
+  snprintf(name, sizeof(name), "%s@%s:%d", user, host, port);
+  return state_file(buf, len, "uidl", name);
+}
+
+/* Count new messages by comparing the UIDL listing with the ids seen on
+ * earlier checks, kept in ~/.mailcheck/uidl/<user>@<host>:<port>.  The
+ * listing is streamed, so memory does not grow with the size of the drop
+ * beyond a bit per known message.  Returns -1 if UIDL isn't supported. */
+static int pop3_uidl(struct conn *c, const char *user, char *buf, int *new_p,
+                     int *cur_p) {
+  char file[BUF_SIZE], pending[BUF_SIZE + 8];
+  struct uidset *seen;
+  struct token t;
+  const char *p, *end;
+  int new = 0, cur = 0;
+
+  if (uidl_path(user, c->host, c->port, file, sizeof(file)) != 0 ||
+      (seen = uidset_open(file)) == NULL)
+    return -1;
+
+  conn_printf(c, "UIDL\r\n");
+  if (pop3_status(c, buf) != 0) {
+    uidset_close(seen);
+    return -1;
+  }
+  while (pop3_data(c, &t) == TOK_TEXT) {
+    /* "<msg> <uid>" */
+    end = t.ptr + t.len;
+    for (p = t.ptr; p < end && *p != ' '; p++)
+      ;
+    while (p < end && *p == ' ')
+      p++;
+    if (p == end)
+      continue;
+    if (uidset_check(seen, p, end - p))
+      cur++;
+    else
+      new++;
+  }
+  if (t.type == TOK_ERROR) {
+    uidset_close(seen);
+    return -1;
+  }
+
+  /* Messages stay new until mailcheck itself has reported them: -q only
+   * looks, and the daemon leaves the listing in <file>.pending for the
+   * client that reports its answer (see pop3_reported()). */
+  if (Options.daemon_mode) {
+    snprintf(pending, sizeof(pending), "%s.pending", file);
+    if (uidset_save(seen, pending) != 0)
+      fprintf(stderr, "mailcheck: couldn't save '%s'\n", pending);
+  } else if (!Options.any_mode && uidset_save(seen, file) != 0) {
+    fprintf(stderr, "mailcheck: couldn't save '%s'\n", file);
+  }
+  uidset_close(seen);
+
+  *new_p = new;
+  *cur_p = cur;
+  return 0;
+}
+
+/* The new messages of the pop3 mailbox PATH, as the daemon found them, have
+ * been reported: take the listing it left as the ids seen. */
+void pop3_reported(const char *path) {
+  char hostname[BUF_SIZE], box[BUF_SIZE], user[128] = "";
+  char file[BUF_SIZE], pending[BUF_SIZE + 8];
+  int port, tls = 0;
+
+  if ((port = parse_url(path, hostname, box, user, &tls)) == 0 ||
+      uidl_path(user, hostname, port, file, sizeof(file)) != 0)
+    return;
+  snprintf(pending, sizeof(pending), "%s.pending", file);
+  rename(pending, file);
+}
+
+/* Count mails in pop3 mailbox. */
+int check_pop3(const struct mailbox *mb, int *new_p, int *cur_p) {
+  int port;
+  int tls = 0;
+  struct conn *c;
+  char buf[BUF_SIZE];
+  char hostname[BUF_SIZE];
+  char box[BUF_SIZE]; /* not actually used for pop3 */
+  char user[128] = "";
+  char pass[128] = "";
+  int total = 0;
+  long long t0;
+
+  port = getnetinfo(mb, hostname, box, user, pass, &tls);
+
+  /* connect to host */
+  if ((c = conn_open(hostname, port, tls)) == NULL)
+    return 1;
+  pop3_status(c, buf);
+  if (!tls && pop3_starttls(c, buf) != 0) {
+    conn_close(c);
+    return 1;
+  }
+  t0 = probe_ns();
+  conn_printf(c, "USER %s\r\n", user);
+  if (pop3_status(c, buf) != 0) {
+    fprintf(stderr, "mailcheck: Invalid User Name '%s@%s:%d'\n", user, hostname,
+            port);
+#ifdef DEBUG_POP3
+    fprintf(stderr, "%s\n", buf);
+#endif
+    metrics_error(ERROR_AUTH);
+    conn_printf(c, "QUIT\r\n");
+    conn_close(c);
+    return 1;
+  };
+
+  conn_printf(c, "PASS %s\r\n", pass);
+  if (pop3_status(c, buf) != 0) {
+    fprintf(stderr, "mailcheck: Incorrect Password for user '%s@%s:%d'\n", user,
+            hostname, port);
+    fprintf(stderr, "mailcheck: Server said %s\n", buf);
+    metrics_error(ERROR_AUTH);
+    conn_printf(c, "QUIT\r\n");
+    conn_close(c);
+    return 1;
+  };
+  metrics_phase(PHASE_AUTH, probe_ns() - t0);
+
+  t0 = probe_ns();
+  conn_printf(c, "STAT\r\n");
+  if (pop3_status(c, buf) != 0) {
+    fprintf(stderr, "mailcheck: Error Receiving STAT '%s@%s:%d'\n", user,
+            hostname, port);
+    metrics_error(ERROR_PROTOCOL);
+    conn_close(c);
+    return 1;
+  } else {
+    sscanf(buf, "+OK %d", &total);
+  }
+
+  conn_printf(c, "LAST\r\n");
+  if (pop3_status(c, buf) != 0) {
+    /* Server does not support LAST.  Use the ids of messages seen before, or
+     * failing that assume total as new */
+    if (pop3_uidl(c, user, buf, new_p, cur_p) != 0) {
+      *new_p = total;
+      *cur_p = 0;
+    }
+  } else {
+    sscanf(buf, "+OK %d", cur_p);
+    *new_p = total - *cur_p;
+  }
+  metrics_phase(PHASE_STATUS, probe_ns() - t0);
+
+  conn_printf(c, "QUIT\r\n");
+  conn_close(c);
+
+  return 0;
+}
+
+/* State of an IMAP session while its responses are read. */
+struct imap {
+  struct conn *c;
+  struct imap_lexer lx;
+  int have_caps;              /* capabilities are known */
+  int list_status;            /* server supports LIST-STATUS */
+  int starttls;               /* server supports STARTTLS */
+  int notify;                 /* server supports NOTIFY */
+  int at_eol;                 /* the last token ended the line */
+  char text[BUF_SIZE];        /* text of the last tagged response */
+
+  /* untagged STATUS responses are passed to fn */
+  struct mail_status *status;
+  const char *prefix;         /* rc file URL up to the mailbox name */
+  status_fn fn;
+  void *arg;
+  int found;
+
+  /* untagged LIST responses are collected here, if names != NULL */
+  char **names;
+  int count;
+  int size;
+
+  /* while watching (see watch_imap()), the mailboxes or patterns wanted,
+   * and the names of those that changed without saying how */
+  const char **wanted;
+  int nwanted;
+  char **stale;
+  int nstale;
+  int stale_size;
+  int overflow;               /* the server gave up on notifications */
+};
+
+/* Get the next token from the server.  Returns -1 on EOF. */
+static int imap_next(struct imap *im, struct token *t) {
+  while (imap_lex(&im->lx, &im->c->in, t) == TOK_MORE)
+    if (conn_fill(im->c) <= 0)
+      return t->type = -1;
+  im->at_eol = t->type == TOK_EOL;
+  return t->type;
+}
+
+/* Skip the rest of the current response line.  Returns -1 on EOF. */
+static int imap_skip(struct imap *im) {
+  if (im->at_eol)
+    return 0;
+  while (imap_skip_line(&im->lx, &im->c->in) == TOK_MORE)
+    if (conn_fill(im->c) <= 0)
+      return -1;
+  im->at_eol = 1;
+  return 0;
+}
+
+/* Get the rest of the current response line as text.  Returns -1 on EOF. */
+static int imap_rest(struct imap *im, struct token *t) {
+  while (imap_text(&im->lx, &im->c->in, t) == TOK_MORE)
+    if (conn_fill(im->c) <= 0)
+      return -1;
+  im->at_eol = t->type == TOK_TEXT;
+  return t->type == TOK_TEXT ? 0 : -1;
+}
+
+/* Does the response text T start with a CAPABILITY response code listing
+ * capability CAP? */
+static int text_has_cap(const struct token *t, const char *cap) {
+  size_t caplen = strlen(cap), i, j;
+
+  if (t->len < 12 || strncasecmp(t->ptr, "[CAPABILITY ", 12) != 0)
+    return 0;
+  for (i = 11; i < t->len && t->ptr[i] != ']'; i = j) {
+    for (j = i + 1; j < t->len && t->ptr[j] != ' ' && t->ptr[j] != ']'; j++)
+      ;
+    if (j - i - 1 == caplen && strncasecmp(t->ptr + i + 1, cap, caplen) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+/* Read the string value of an astring or nstring whose first token is T
+ * into DST.  Literals may arrive in several chunks.  Returns -1 if T isn't a
+ * string. */
+static int imap_string(struct imap *im, struct token *t, char *dst,
+                       size_t len) {
+  size_t dlen = 0;
+
+  dst[0] = '\0';
+  if (t->type != TOK_ATOM && t->type != TOK_QUOTED && t->type != TOK_LITERAL)
+    return -1;
+  tok_append(t, dst, len, &dlen);
+  while (t->type == TOK_LITERAL && t->more) {
+    if (imap_next(im, t) != TOK_LITERAL)
+      return -1;
+    tok_append(t, dst, len, &dlen);
+  }
+  return 0;
+}
+
+/* Note the capabilities listed by a CAPABILITY response or response code, up
+ * to the line end or closing bracket. */
+static void imap_capabilities(struct imap *im) {
+  struct token t;
+
+  im->have_caps = 1;
+  im->list_status = im->starttls = im->notify = 0;
+  while (imap_next(im, &t) == TOK_ATOM) {
+    if (tok_is(&t, "LIST-STATUS"))
+      im->list_status = 1;
+    else if (tok_is(&t, "STARTTLS"))
+      im->starttls = 1;
+    else if (tok_is(&t, "NOTIFY"))
+      im->notify = 1;
+  }
+}
+
+/* Is NAME one of the mailboxes being watched?  LIST patterns are matched
+ * as if '%' were '*', the hierarchy delimiter not being known. */
+static int imap_wanted(const struct imap *im, const char *name) {
+  char pattern[BUF_SIZE], *p;
+  int i;
+
+  for (i = 0; i < im->nwanted; i++) {
+    if (!strpbrk(im->wanted[i], "*%")) {
+      if (!strcmp(im->wanted[i], name) ||
+          (!strcasecmp(name, "INBOX") && !strcasecmp(im->wanted[i], "INBOX")))
+        return 1;
+      continue;
+    }
+    snprintf(pattern, sizeof(pattern), "%s", im->wanted[i]);
+    for (p = pattern; (p = strchr(p, '%')) != NULL; p++)
+      *p = '*';
+    if (fnmatch(pattern, name, 0) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+/* Remember to ask for the counts of NAME. */
+static void imap_stale(struct imap *im, const char *name) {
+  char **stale;
+  int i;
+
+  for (i = 0; i < im->nstale; i++)
+    if (!strcmp(im->stale[i], name))
+      return;
+  if (im->nstale == im->stale_size) {
+    im->stale_size = im->stale_size ? 2 * im->stale_size : 8;
+    if ((stale = realloc(im->stale, im->stale_size * sizeof(*stale))) == NULL) {
+      fprintf(stderr, "mailcheck: out of memory\n");
+      exit(1);
+    }
+    im->stale = stale;
+  }
+  if ((im->stale[im->nstale] = strdup(name)) == NULL) {
+    fprintf(stderr, "mailcheck: out of memory\n");
+    exit(1);
+  }
+  im->nstale++;
+}
+
+/* Handle "STATUS mailbox (MESSAGES n UNSEEN m)", in any item order.  While
+ * watching, a STATUS response without both counts (a NOTIFY event) has the
+ * mailbox asked for them. */
+static void imap_status_response(struct imap *im) {
+  char name[BUF_SIZE];
+  struct token t;
+  long messages = -1, unseen = -1, value;
+  int item;
+
+  imap_next(im, &t);
+  if (imap_string(im, &t, name, sizeof(name)) != 0 ||
+      imap_next(im, &t) != TOK_LPAREN)
+    return;
+
+  while (imap_next(im, &t) == TOK_ATOM) {
+    item = tok_is(&t, "MESSAGES") ? 1 : tok_is(&t, "UNSEEN") ? 2 : 0;
+    imap_next(im, &t);
+    if ((value = tok_number(&t)) < 0)
+      return;
+    if (item == 1)
+      messages = value;
+    else if (item == 2)
+      unseen = value;
+  }
+  /* some servers volunteer STATUS while we only asked for a LIST */
+  if (t.type != TOK_RPAREN || im->names)
+    return;
+  if (im->wanted && !imap_wanted(im, name))
+    return;
+  if (messages < 0 || unseen < 0) {
+    if (im->wanted)
+      imap_stale(im, name);
+    return;
+  }
+
+  snprintf(im->status->path, sizeof(im->status->path), "%s%s", im->prefix,
+           name);
+  im->status->new = unseen;
+  im->status->saved = messages - unseen;
+  im->fn(im->status, im->arg);
+  im->found++;
+}
+
+/* Handle "LIST (flags) delimiter mailbox", remembering selectable mailboxes
+ * if asked to. */
+static void imap_list_response(struct imap *im) {
+  char name[BUF_SIZE];
+  struct token t;
+  char **names;
+  int selectable = 1;
+
+  if (!im->names || imap_next(im, &t) != TOK_LPAREN)
+    return;
+  while (imap_next(im, &t) == TOK_ATOM) {
+    if (tok_is(&t, "\\NOSELECT") || tok_is(&t, "\\NONEXISTENT"))
+      selectable = 0;
+  }
+  if (t.type != TOK_RPAREN)
+    return;
+
+  /* hierarchy delimiter, then the name */
+  imap_next(im, &t);
+  if (imap_string(im, &t, name, sizeof(name)) != 0)
+    return;
+  imap_next(im, &t);
+  if (imap_string(im, &t, name, sizeof(name)) != 0 || !selectable)
+    return;
+
+  if (im->count == im->size) {
+    im->size = im->size ? 2 * im->size : 16;
+    if ((names = realloc(im->names, im->size * sizeof(*names))) == NULL)
+      return;
+    im->names = names;
+  }
+  if ((im->names[im->count] = strdup(name)) != NULL)
+    im->count++;
+}
+
+/* Read one response line.  Returns 1 if it was the tagged completion of TAG
+ * (or any status response, if TAG is NULL), with its text in im->text, 0 for
+ * other responses and -1 on EOF. */
+static int imap_response(struct imap *im, const char *tag) {
+  struct token t;
+  size_t len = 0;
+  int done = 0;
+
+  do {
+    if (imap_next(im, &t) == -1)
+      return -1;
+  } while (t.type == TOK_EOL);
+
+  if (tok_is(&t, "*")) {
+    imap_next(im, &t);
+    if (tok_is(&t, "CAPABILITY"))
+      imap_capabilities(im);
+    else if (tok_is(&t, "STATUS"))
+      imap_status_response(im);
+    else if (tok_is(&t, "LIST"))
+      imap_list_response(im);
+    else if (!tag && (tok_is(&t, "OK") || tok_is(&t, "PREAUTH") ||
+                      tok_is(&t, "BYE")))
+      done = 1; /* greeting */
+    else if (im->wanted && tok_is(&t, "OK")) {
+      if (imap_rest(im, &t) != 0)
+        return -1;
+      if (t.len >= 22 && !strncasecmp(t.ptr, "[NOTIFICATIONOVERFLOW]", 22))
+        im->overflow = 1;
+    }
+  } else if (t.type == TOK_ATOM && tag && t.len == strlen(tag) &&
+             !strncmp(t.ptr, tag, t.len)) {
+    imap_next(im, &t);
+    done = 1;
+  }
+
+  if (done) {
+    /* "OK [CAPABILITY ...] text" */
+    tok_append(&t, im->text, sizeof(im->text), &len);
+    if (im->at_eol)
+      return 1;
+    if (imap_rest(im, &t) != 0)
+      return -1;
+    if (text_has_cap(&t, "IMAP4rev1")) {
+      im->have_caps = 1;
+      im->list_status = text_has_cap(&t, "LIST-STATUS");
+      im->starttls = text_has_cap(&t, "STARTTLS");
+      im->notify = text_has_cap(&t, "NOTIFY");
+    }
+    if (len + 1 < sizeof(im->text))
+      im->text[len++] = ' ';
+    tok_append(&t, im->text, sizeof(im->text), &len);
+    return 1;
+  }
+
+  return imap_skip(im) != 0 ? -1 : 0;
+}
+
+/* Read the responses to the command tagged TAG, which has been sent.
+ * Returns 0 if it completed with OK, -1 otherwise. */
+static int imap_complete(struct imap *im, const char *tag) {
+  int r;
+
+  while ((r = imap_response(im, tag)) == 0)
+    ;
+  if (r < 0) {
+    strcpy(im->text, "(connection closed)");
+    return -1;
+  }
+  PROBE4(response, im->c->host, im->c->port, !strncasecmp(im->text, "OK", 2),
+         probe_ns() - im->c->sent);
+  return strncasecmp(im->text, "OK", 2) ? -1 : 0;
+}
+
+/* Send a command and read its responses.  Returns 0 if it completed with
+ * OK, -1 otherwise. */
+static int imap_command(struct imap *im, const char *tag, const char *fmt,
+                        const char *arg) {
+  char cmd[BUF_SIZE];
+
+  snprintf(cmd, sizeof(cmd), fmt, arg);
+  if (conn_printf(im->c, "%s %s\r\n", tag, cmd) != 0) {
+    strcpy(im->text, "(connection closed)");
+    return -1;
+  }
+  return imap_complete(im, tag);
+}
+
+/* Write S to BUF as an IMAP quoted string. */
+static void imap_quote(char *buf, size_t len, const char *s) {
+  size_t i = 0;
+
+  buf[i++] = '"';
+  for (; *s && i + 3 < len; s++) {
+    if (*s == '"' || *s == '\\')
+      buf[i++] = '\\';
+    buf[i++] = *s;
+  }
+  buf[i++] = '"';
+  buf[i] = '\0';
+}
+
+/* Upgrade a cleartext IMAP connection with STARTTLS, if the server offers
+ * it. */
+static int imap_starttls(struct imap *im) {
+  if (!im->have_caps && imap_command(im, "a000", "CAPABILITY%s", "") != 0)
+    return -1;
+  if (!im->starttls)
+    return 0;
+
+  if (imap_command(im, "a000", "STARTTLS%s", "") != 0) {
+    fprintf(stderr, "mailcheck: STARTTLS refused by '%s:%d'\n", im->c->host,
+            im->c->port);
+    metrics_error(ERROR_TLS);
+    return -1;
+  }
+  memset(&im->lx, 0, sizeof(im->lx));
+  im->have_caps = 0; /* must not be trusted from before TLS */
+  return conn_starttls(im->c);
+}
+
+/* Check all mailboxes matching PATTERN without LIST-STATUS: LIST them first,
+ * then ask for the STATUS of each one. */
+static int imap_list_then_status(struct imap *im, const char *pattern) {
+  char quoted[BUF_SIZE];
+  char **names;
+  int i, count, retval;
+
+  imap_quote(quoted, sizeof(quoted), pattern);
+  im->names = malloc(sizeof(*im->names));
+  im->size = im->names ? 1 : 0;
+  retval = imap_command(im, "a003", "LIST \"\" %s", quoted);
+  names = im->names;
+  count = im->count;
+  im->names = NULL;
+
+  for (i = 0; i < count; i++) {
+    if (retval == 0) {
+      imap_quote(quoted, sizeof(quoted), names[i]);
+      retval = imap_command(im, "a004", "STATUS %s (MESSAGES UNSEEN)", quoted);
+    }
+    free(names[i]);
+  }
+  free(names);
+
+  return retval;
+}
+
+/* Check all mailboxes matching the LIST pattern BOX on a logged in
+ * connection. */
+static int imap_check_pattern(struct imap *im, const char *box) {
+  char quoted[BUF_SIZE];
+
+  if (!im->have_caps)
+    imap_command(im, "a002", "CAPABILITY%s", "");
+  if (!im->list_status)
+    return imap_list_then_status(im, box);
+
+  /* LIST and STATUS responses are handled one by one as they arrive */
+  imap_quote(quoted, sizeof(quoted), box);
+  return imap_command(im, "a003",
+                      "LIST \"\" %s RETURN (STATUS (MESSAGES UNSEEN))", quoted);
+}
+
+/* Mailbox (or LIST pattern) of line I of the COUNT imap mailboxes MB; the
+ * first one's is BOX, as getnetinfo() found it. */
+static const char *imap_box(const struct mailbox *mb, int i, const char *box,
+                            const char *prefix) {
+  const char *name = mb[i].path + strlen(prefix);
+
+  return i == 0 ? box : (*name ? name : "INBOX");
+}
+
+/* Check the COUNT imap mailboxes MB on a logged in connection.  The STATUS
+ * commands for plain mailboxes are sent without waiting for each other's
+ * replies, up to IMAP_WINDOW ahead so that neither side blocks on a full
+ * socket, and up to the next pattern, which is checked in turn. */
+static int imap_check_group(struct imap *im, const struct mailbox *mb,
+                            int count, const char *box, const char *user) {
+  char quoted[BUF_SIZE];
+  char tag[16];
+  const char *name, *next;
+  int i, found, retval, sent = 0, errors = 0;
+  long long t0;
+
+  t0 = probe_ns();
+  for (i = 0; i < count; i++) {
+    name = imap_box(mb, i, box, im->prefix);
+    found = im->found;
+    if (strpbrk(name, "*%")) {
+      retval = imap_check_pattern(im, name);
+      sent = i + 1;
+    } else {
+      for (; sent < count && sent < i + IMAP_WINDOW; sent++) {
+        next = imap_box(mb, sent, box, im->prefix);
+        if (strpbrk(next, "*%"))
+          break;
+        imap_quote(quoted, sizeof(quoted), next);
+        if (conn_printf(im->c, "s%03d STATUS %s (MESSAGES UNSEEN)\r\n", sent,
+                        quoted) != 0)
+          break;
+      }
+      snprintf(tag, sizeof(tag), "s%03d", i);
+      if (i < sent) {
+        retval = imap_complete(im, tag);
+      } else {
+        strcpy(im->text, "(connection closed)");
+        retval = -1;
+      }
+    }
+    if (retval < 0 || im->found == found) {
+      fprintf(stderr, "mailcheck: Error Receiving Stats '%s@%s:%d'\n\t%s\n",
+              user, im->c->host, im->c->port, im->text);
+      metrics_error(ERROR_PROTOCOL);
+      errors++;
+      if (i >= sent)
+        break;
+    }
+  }
+  metrics_phase(PHASE_STATUS, probe_ns() - t0);
+
+  return errors;
+}
+
+/* Connect to the server of the imap mailbox MB and log in.  Fills in
+ * HOSTNAME, BOX and USER as getnetinfo() does, and the port.  Returns 0, or
+ * -1 after saying why not. */
+static int imap_open(struct imap *im, const struct mailbox *mb,
+                     char *hostname, char *box, char *user, int *port) {
+  int tls = 0;
+  char login[BUF_SIZE];
+  char quoted[BUF_SIZE];
+  char pass[128] = "";
+  long long t0;
+
+  *port = getnetinfo(mb, hostname, box, user, pass, &tls);
+  if (*port == 0) {
+    fprintf(stderr, "mailcheck: Unable to get login information for %s\n",
+            mb->path);
+    metrics_error(ERROR_CONFIG);
+    return -1;
+  }
+
+  if ((im->c = conn_open(hostname, *port, tls)) == NULL)
+    return -1;
+
+  if (imap_response(im, NULL) != 1) {
+    metrics_error(ERROR_PROTOCOL);
+    conn_close(im->c);
+    return -1;
+  }
+  if (!tls && imap_starttls(im) != 0) {
+    conn_close(im->c);
+    return -1;
+  }
+
+  /* Login to the server */
+  imap_quote(login, sizeof(login), user);
+  imap_quote(quoted, sizeof(quoted), pass);
+  strncat(login, " ", sizeof(login) - strlen(login) - 1);
+  strncat(login, quoted, sizeof(login) - strlen(login) - 1);
+  im->have_caps = 0;
+  t0 = probe_ns();
+  if (imap_command(im, "a001", "LOGIN %s", login) != 0) {
+    metrics_error(ERROR_AUTH);
+    conn_printf(im->c, "a002 LOGOUT\r\n");
+    conn_close(im->c);
+    fprintf(stderr, "mailcheck: Unable to check IMAP mailbox '%s@%s:%d'\n",
+            user, hostname, *port);
+    fprintf(stderr, "mailcheck: Server said %s\n", im->text);
+    return -1;
+  };
+  metrics_phase(PHASE_AUTH, probe_ns() - t0);
+  return 0;
+}
+
+/* Count mails in the COUNT imap mailboxes MB, which all belong to the same
+ * account and are checked over one connection.  If the mailbox part of a
+ * path is a LIST pattern (containing '*' or '%'), all matching mailboxes are
+ * reported, in a single round trip if the server supports LIST-STATUS
+ * (RFC 5819).  STATUS is the template for the results passed to FN. */
+int check_imap(const struct mailbox *mb, int count, struct mail_status *status,
+               status_fn fn, void *arg) {
+  int port;
+  struct imap im;
+  char hostname[BUF_SIZE];
+  char box[BUF_SIZE];
+  char prefix[BUF_SIZE];
+  char user[128] = "";
+  int errors;
+
+  /* the results are named "<prefix><mailbox>" */
+  remote_prefix(mb->path, prefix, sizeof(prefix));
+
+  memset(&im, 0, sizeof(im));
+  im.status = status;
+  im.prefix = prefix;
+  im.fn = fn;
+  im.arg = arg;
+  if (imap_open(&im, mb, hostname, box, user, &port) != 0)
+    return 1;
+
+  errors = imap_check_group(&im, mb, count, box, user);
+
+  conn_printf(im.c, "a005 LOGOUT\r\n");
+  conn_close(im.c);
+
+  return errors ? 1 : 0;
+}
+
+/* Ask again for the counts of the mailboxes that NOTIFY said changed. */
+static int imap_requery(struct imap *im) {
+  char quoted[BUF_SIZE];
+  char tag[16];
+  char **stale = im->stale;
+  int i, n = im->nstale, retval = 0;
+
+  im->stale = NULL;
+  im->nstale = im->stale_size = 0;
+  for (i = 0; i < n && retval == 0; i++) {
+    imap_quote(quoted, sizeof(quoted), stale[i]);
+    snprintf(tag, sizeof(tag), "w%03d", i % 999); /* w999 is for waiting */
+    retval = imap_command(im, tag, "STATUS %s (MESSAGES UNSEEN)", quoted);
+  }
+  for (i = 0; i < n; i++)
+    free(stale[i]);
+  free(stale);
+  return retval;
+}
+
+/* Watch the COUNT imap mailboxes MB, which belong to one account, over a
+ * single connection with NOTIFY (RFC 5465): the server then says by itself
+ * when a mailbox changes, with a STATUS response, and FN is called with the
+ * new counts as they come, until *STOP is set.  Mailbox lists that are long
+ * or contain patterns are watched as "personal", and what is reported for
+ * other mailboxes ignored.  Returns 0 when stopped, 1 if the server doesn't
+ * support NOTIFY (so the mailboxes must be polled instead), -1 if the
+ * connection failed. */
+int watch_imap(const struct mailbox *mb, int count, struct mail_status *status,
+               status_fn fn, void *arg, const int *stop) {
+  int port;
+  struct imap im;
+  char hostname[BUF_SIZE];
+  char box[BUF_SIZE];
+  char prefix[BUF_SIZE];
+  char quoted[BUF_SIZE];
+  char set[BUF_SIZE];
+  char user[128] = "";
+  const char **wanted;
+  size_t len;
+  int i, r, personal = 0, retval = -1;
+  time_t last;
+
+  remote_prefix(mb->path, prefix, sizeof(prefix));
+
+  memset(&im, 0, sizeof(im));
+  im.status = status;
+  im.prefix = prefix;
+  im.fn = fn;
+  im.arg = arg;
+  if (imap_open(&im, mb, hostname, box, user, &port) != 0)
+    return -1;
+  if (!im.have_caps && imap_command(&im, "a002", "CAPABILITY%s", "") != 0)
+    goto out;
+  if (!im.notify) {
+    retval = 1;
+    goto out;
+  }
+
+  if ((wanted = calloc(count, sizeof(*wanted))) == NULL) {
+    fprintf(stderr, "mailcheck: out of memory\n");
+    exit(1);
+  }
+  strcpy(set, "(mailboxes");
+  len = strlen(set);
+  for (i = 0; i < count; i++) {
+    wanted[i] = imap_box(mb, i, box, prefix);
+    imap_quote(quoted, sizeof(quoted), wanted[i]);
+    if (strpbrk(wanted[i], "*%") || len + strlen(quoted) + 2 >= sizeof(set))
+      personal = 1;
+    else
+      len += snprintf(set + len, sizeof(set) - len, " %s", quoted);
+  }
+  if (personal)
+    strcpy(set, "(personal");
+  strcat(set, ")");
+
+  /* FlagChange tells about mails being read, but servers may not allow it
+   * for all mailboxes */
+  if (imap_command(&im, "a003", "NOTIFY SET %s"
+                   " (MessageNew MessageExpunge FlagChange)", set) != 0 &&
+      imap_command(&im, "a003", "NOTIFY SET %s"
+                   " (MessageNew MessageExpunge)", set) != 0) {
+    retval = 1;
+    goto out_wanted;
+  }
+  im.wanted = wanted;
+  im.nwanted = count;
+
+  /* the counts to start from; what changes meanwhile is announced */
+  if (imap_check_group(&im, mb, count, box, user) != 0 && !im.found)
+    goto out_wanted;
+
+  last = time(NULL);
+  while (!__atomic_load_n(stop, __ATOMIC_ACQUIRE)) {
+    if (im.overflow) /* start over, it's been too much to say */
+      goto out_wanted;
+    if (im.nstale) {
+      if (imap_requery(&im) != 0)
+        goto out_wanted;
+      last = time(NULL);
+    }
+    if ((r = conn_wait(im.c, 1000)) < 0)
+      goto out_wanted;
+    if (r > 0) {
+      if (imap_response(&im, "w999") < 0)
+        goto out_wanted;
+      last = time(NULL);
+    } else if (time(NULL) - last >= WATCH_NOOP) {
+      /* keep the connection from being dropped as idle */
+      if (imap_command(&im, "a004", "NOOP%s", "") != 0)
+        goto out_wanted;
+      last = time(NULL);
+    }
+  }
+  retval = 0;
+
+out_wanted:
+  im.wanted = NULL;
+  for (i = 0; i < im.nstale; i++)
+    free(im.stale[i]);
+  free(im.stale);
+  free(wanted);
+out:
+  if (retval >= 0)
+    conn_printf(im.c, "a005 LOGOUT\r\n");
+  conn_close(im.c);
+  return retval;
+}
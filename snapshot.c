@@ -0,0 +1,294 @@
+/* snapshot.c -- the latest results in a file for shell prompts
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ */
+
+/* The daemon, and any run with -w, leave their results in a small file of
+ * fixed layout (struct snapshot) next to the daemon socket.  A prompt that
+ * runs "mailcheck -S" only maps that file and prints what it finds: no rc
+ * file, no plan, no mailbox and no daemon is looked at.
+ *
+ * Writers update the file in place, one at a time under flock(), and
+ * readers don't lock at all.  Instead the file carries a sequence number
+ * that is odd while a write is under way and changes with each one; a
+ * reader copies the records, and if the number was odd or isn't the same
+ * afterwards, it tries again.
+ *
+ * If the results are older than the limit given to -S (twice -i by
+ * default), or there are none, a detached process gets new ones, while the
+ * prompt goes on with what there was: from the daemon if one answers, or
+ * else by checking the mailboxes itself.  A refresh that finds another one
+ * running (by the lock of the file with ".refresh" appended) leaves it to
+ * that one.  The snapshot itself is only locked to write the results, so
+ * that a slow check doesn't hold up the daemon. */
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mailcheck.h"
+
+#define SNAP_MAGIC "MCSNAP1\n"
+#define SNAP_RECORDS (64)
+#define SNAP_PATH (224)
+#define SNAP_RETRIES (1000)
+
+struct snap_record {
+  int32_t type;
+  int32_t counted;
+  int32_t new;
+  int32_t unread;
+  int32_t saved;
+  int32_t estimated;
+  int32_t new_margin;
+  int32_t unread_margin;
+  char path[SNAP_PATH]; /* truncated if need be */
+};
+
+struct snapshot {
+  char magic[8];
+  uint32_t seq;     /* odd while being written */
+  uint32_t count;   /* records in use */
+  int64_t updated;  /* seconds since the epoch */
+  struct snap_record rec[SNAP_RECORDS];
+};
+
+/* Find the path of the snapshot file.  Returns -1 if it does not fit. */
+static int snapshot_path(char *buf, size_t len) {
+  char *dir = getenv("XDG_RUNTIME_DIR");
+  int n;
+
+  if (dir && *dir)
+    n = snprintf(buf, len, "%s/mailcheck.snapshot", dir);
+  else
+    n = snprintf(buf, len, "%s/.mailcheck.snapshot", Homedir);
+
+  return (n < 0 || (size_t)n >= len) ? -1 : 0;
+}
+
+struct snapshot *snapshot_new(void) {
+  struct snapshot *s = calloc(1, sizeof(*s));
+
+  if (!s) {
+    fprintf(stderr, "mailcheck: out of memory\n");
+    exit(1);
+  }
+  return s;
+}
+
+void snapshot_clear(struct snapshot *s) { s->count = 0; }
+
+/* A status_fn that adds STATUS to the snapshot ARG.  Mailboxes beyond the
+ * first SNAP_RECORDS are left out. */
+void snapshot_status(const struct mail_status *status, void *arg) {
+  struct snapshot *s = arg;
+  struct snap_record *r;
+  size_t len = strnlen(status->path, SNAP_PATH - 1);
+
+  if (s->count == SNAP_RECORDS)
+    return;
+  r = &s->rec[s->count++];
+  r->type = status->type;
+  r->counted = status->counted;
+  r->new = status->new;
+  r->unread = status->unread;
+  r->saved = status->saved;
+  r->estimated = status->estimated;
+  r->new_margin = status->new_margin;
+  r->unread_margin = status->unread_margin;
+  memcpy(r->path, status->path, len);
+  r->path[len] = '\0';
+}
+
+/* Open the snapshot file for writing and lock it.  Returns -1 if it can't
+ * be opened. */
+static int open_locked(void) {
+  char file[BUF_SIZE];
+  struct stat st;
+  int fd;
+
+  if (snapshot_path(file, sizeof(file)) != 0 ||
+      (fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1)
+    return -1;
+  if (flock(fd, LOCK_EX) != 0 ||
+      fstat(fd, &st) != 0 ||
+      (st.st_size != sizeof(struct snapshot) &&
+       ftruncate(fd, sizeof(struct snapshot)) != 0)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Copy S into the snapshot file FD, which is locked. */
+static int publish(int fd, struct snapshot *s) {
+  struct snapshot *m;
+  uint32_t seq;
+
+  m = mmap(NULL, sizeof(*m), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (m == MAP_FAILED)
+    return -1;
+
+  /* a writer that died half way left the number odd */
+  seq = __atomic_load_n(&m->seq, __ATOMIC_RELAXED) | 1;
+  __atomic_store_n(&m->seq, seq, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  memcpy(m->magic, SNAP_MAGIC, sizeof(m->magic));
+  m->count = s->count;
+  m->updated = time(NULL);
+  memcpy(m->rec, s->rec, s->count * sizeof(*s->rec));
+
+  __atomic_store_n(&m->seq, seq + 1, __ATOMIC_RELEASE);
+  munmap(m, sizeof(*m));
+  return 0;
+}
+
+/* Replace the results in the snapshot file with S.  Returns -1 on error. */
+int snapshot_write(struct snapshot *s) {
+  int fd, retval;
+
+  if ((fd = open_locked()) == -1)
+    return -1;
+  retval = publish(fd, s);
+  close(fd);
+  return retval;
+}
+
+/* Take the lock of refreshing the snapshot, without waiting.  Returns the
+ * file descriptor that holds it, or -1 if somebody else has it. */
+static int lock_refresh(void) {
+  char file[BUF_SIZE + 8];
+  size_t n;
+  int fd;
+
+  if (snapshot_path(file, BUF_SIZE) != 0)
+    return -1;
+  n = strlen(file);
+  snprintf(file + n, sizeof(file) - n, ".refresh");
+  if ((fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1)
+    return -1;
+  if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Get new results in a detached process and write them, unless that is
+ * being done already. */
+static void refresh(void) {
+  struct snapshot *s;
+  struct plan *plan;
+  pid_t pid;
+  int null;
+
+  fflush(stdout);
+  fflush(stderr);
+  if ((pid = fork()) != 0) {
+    if (pid > 0)
+      waitpid(pid, NULL, 0);
+    return;
+  }
+
+  /* leave it to a grandchild, so that nobody has to wait for it */
+  setsid();
+  if (fork() != 0)
+    _exit(0);
+  if ((null = open("/dev/null", O_RDWR)) != -1) {
+    dup2(null, 0);
+    dup2(null, 1);
+    dup2(null, 2);
+  }
+  if (lock_refresh() == -1)
+    _exit(0);
+
+  /* A daemon knows already: checking here would also take over its part,
+   * the ids seen on POP3 servers and the history. */
+  s = snapshot_new();
+  if (query_daemon(snapshot_status, s) != 0) {
+    snapshot_clear(s);
+    plan = plan_load();
+    check_plan_jobs(plan, snapshot_status, s);
+  }
+  snapshot_write(s);
+  _exit(0);
+}
+
+/* Pass the results in the snapshot file to FN (-S), and have them
+ * refreshed if they are too old.  Returns -1 if there are none. */
+int read_snapshot(status_fn fn, void *arg) {
+  static struct snapshot s; /* the copy read */
+  struct mail_status status;
+  const struct snapshot *m;
+  char file[BUF_SIZE];
+  long long max_age;
+  uint32_t seq, count = 0, i;
+  struct stat st;
+  int fd, tries;
+
+  max_age = Options.snapshot_age > 0 ? Options.snapshot_age
+                                     : 2LL * Options.interval;
+  if (snapshot_path(file, sizeof(file)) != 0)
+    return -1;
+  if ((fd = open(file, O_RDONLY | O_CLOEXEC)) == -1) {
+    refresh();
+    return -1;
+  }
+  if (fstat(fd, &st) != 0 || st.st_size != sizeof(s) ||
+      (m = mmap(NULL, sizeof(s), PROT_READ, MAP_SHARED, fd, 0)) ==
+          MAP_FAILED) {
+    close(fd);
+    refresh();
+    return -1;
+  }
+  close(fd);
+
+  for (tries = 0; tries < SNAP_RETRIES; tries++) {
+    if ((seq = __atomic_load_n(&m->seq, __ATOMIC_ACQUIRE)) & 1) {
+      sched_yield();
+      continue;
+    }
+    memcpy(&s, m, offsetof(struct snapshot, rec));
+    count = s.count <= SNAP_RECORDS ? s.count : 0;
+    memcpy(s.rec, m->rec, count * sizeof(*s.rec));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&m->seq, __ATOMIC_RELAXED) == seq)
+      break;
+  }
+  munmap((void *)m, sizeof(s));
+
+  if (tries == SNAP_RETRIES || memcmp(s.magic, SNAP_MAGIC, 8) != 0) {
+    refresh();
+    return -1;
+  }
+
+  for (i = 0; i < count; i++) {
+    memset(&status, 0, sizeof(status));
+    status.size = -1;
+    status.type = s.rec[i].type;
+    status.counted = s.rec[i].counted;
+    status.new = s.rec[i].new;
+    status.unread = s.rec[i].unread;
+    status.saved = s.rec[i].saved;
+    status.estimated = s.rec[i].estimated;
+    status.new_margin = s.rec[i].new_margin;
+    status.unread_margin = s.rec[i].unread_margin;
+    memcpy(status.path, s.rec[i].path, SNAP_PATH);
+    fn(&status, arg);
+  }
+  if (time(NULL) - s.updated > max_age)
+    refresh();
+  return 0;
+}
@@ -21,40 +21,65 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <errno.h>
 #include <stdio.h>
+#include <string.h>
 
+#include "metrics.h"
+#include "probes.h"
 
+
+/* getaddrinfo() rather than gethostbyname(), which is not safe to call
+   from several threads at once.  Each address is tried in turn.  Returns
+   -2 if the name can't be resolved, -1 if no address could be connected
+   to, with errno set by the last connect(). */
 int
 sock_connect (char *hostname, int port)
 {
-  struct hostent *host;
-  struct sockaddr_in addr;
-  int fd, i;
+  struct addrinfo hints, *res, *ai;
+  char service[16];
+  int fd = -1, i;
+  long long t0 = probe_ns ();
 
-  host = gethostbyname (hostname);
-  if (host == NULL)
-    {
-      herror ("gethostbyname");
-      return (-1);
-    };
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf (service, sizeof (service), "%d", port);
 
-  fd = socket (PF_INET, SOCK_STREAM, IPPROTO_TCP);
-  if (fd == -1)
+  i = getaddrinfo (hostname, service, &hints, &res);
+  t0 = probe_ns () - t0;
+  PROBE3 (dns_done, hostname, t0, i);
+  metrics_phase (PHASE_DNS, t0);
+  if (i != 0)
     {
-      perror ("Error opening socket");
-      return (-1);
+      fprintf (stderr, "getaddrinfo: %s: %s\n", hostname, gai_strerror (i));
+      metrics_error (ERROR_DNS);
+      return (-2);
     };
 
-  addr.sin_family = AF_INET;
-  addr.sin_addr.s_addr = *(u_long *) host->h_addr_list[0];
-  addr.sin_port = htons (port);
-  i = connect (fd, (struct sockaddr *) &addr, sizeof (struct sockaddr));
-  if (i == -1)
+  t0 = probe_ns ();
+  for (ai = res; ai != NULL; ai = ai->ai_next)
     {
-      perror ("Error connecting");
+      fd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (fd == -1)
+	continue;
+      if (connect (fd, ai->ai_addr, ai->ai_addrlen) == 0)
+	break;
       close (fd);
-      return (-1);
+      fd = -1;
     };
+  t0 = probe_ns () - t0;
+  PROBE4 (connect_done, hostname, port, fd, t0);
+  metrics_phase (PHASE_CONNECT, t0);
+  if (fd == -1)
+    {
+      i = errno;
+      perror ("Error connecting");
+      metrics_error (ERROR_CONNECT);
+      errno = i;
+    }
+
+  freeaddrinfo (res);
   return (fd);
 }
 
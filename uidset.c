@@ -0,0 +1,271 @@
+/* uidset.c -- persistent set of POP3 unique ids
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ */
+
+/* Ids are not stored themselves, only a 40 bit hash of each.  With 50000
+ * messages on the server, the chance that a new message is mistaken for an
+ * old one is below 1 in 10^7.  The file holds the sorted hashes as
+ * variable length deltas, about 4 bytes per message:
+ *
+ *   "MCUIDL1\n" <count: 4 bytes, little endian> <LEB128 deltas>
+ *
+ * The file is mapped, and a sparse index with one entry per UIDSET_BLOCK
+ * hashes makes lookups cheap.  While a listing is checked, only a bit per
+ * stored hash and the hashes of new ids are kept in memory. */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "mailcheck.h"
+#include "uidset.h"
+
+#define UIDSET_MAGIC "MCUIDL1\n"
+#define UIDSET_HEADER (sizeof(UIDSET_MAGIC) - 1 + 4)
+#define UIDSET_BLOCK (128)
+#define HASH_MASK ((UINT64_C(1) << 40) - 1)
+
+struct uidset_block {
+  uint64_t first;  /* first hash of the block */
+  size_t next;     /* offset of the delta following it */
+};
+
+struct uidset {
+  unsigned char *map; /* the mapped file, or NULL */
+  size_t maplen;
+  uint32_t count;     /* hashes in the file */
+  struct uidset_block *index;
+  unsigned char *listed; /* bit per stored hash: seen in this listing */
+  uint64_t *fresh;    /* hashes not stored yet */
+  size_t nfresh;
+  size_t freshsize;
+};
+
+static uint64_t uid_hash(const char *uid, size_t len) {
+  uint64_t h = UINT64_C(14695981039346656037);
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char)uid[i];
+    h *= UINT64_C(1099511628211);
+  }
+  /* FNV-1a mixes the low bits poorly, finish it off */
+  h ^= h >> 33;
+  h *= UINT64_C(0xff51afd7ed558ccd);
+  h ^= h >> 33;
+  return h & HASH_MASK;
+}
+
+/* Decode one LEB128 delta at *POS.  Returns -1 at the end of the data. */
+static int get_delta(const struct uidset *s, size_t *pos, uint64_t *delta) {
+  uint64_t v = 0;
+  int shift = 0;
+
+  while (*pos < s->maplen && shift < 64) {
+    unsigned char c = s->map[(*pos)++];
+
+    v |= (uint64_t)(c & 0x7f) << shift;
+    if (!(c & 0x80)) {
+      *delta = v;
+      return 0;
+    }
+    shift += 7;
+  }
+  return -1;
+}
+
+static void put_delta(FILE *fp, uint64_t v) {
+  while (v >= 0x80) {
+    putc((v & 0x7f) | 0x80, fp);
+    v >>= 7;
+  }
+  putc(v, fp);
+}
+
+/* Map FILE and build the sparse index.  Damaged files are treated as empty,
+ * they will be rewritten by uidset_save(). */
+static void uidset_load(struct uidset *s, int fd) {
+  struct stat st;
+  uint64_t value = 0, delta;
+  size_t pos = UIDSET_HEADER;
+  uint32_t i, count;
+
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < UIDSET_HEADER)
+    return;
+  s->maplen = st.st_size;
+  s->map = mmap(NULL, s->maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (s->map == MAP_FAILED || memcmp(s->map, UIDSET_MAGIC, 8) != 0)
+    goto bad;
+
+  count = s->map[8] | s->map[9] << 8 | s->map[10] << 16 |
+          (uint32_t)s->map[11] << 24;
+  s->index = malloc((count / UIDSET_BLOCK + 1) * sizeof(*s->index));
+  s->listed = calloc(count / 8 + 1, 1);
+  if (!s->index || !s->listed)
+    goto bad;
+
+  for (i = 0; i < count; i++) {
+    if (get_delta(s, &pos, &delta) != 0)
+      goto bad;
+    value += delta;
+    if (i % UIDSET_BLOCK == 0) {
+      s->index[i / UIDSET_BLOCK].first = value;
+      s->index[i / UIDSET_BLOCK].next = pos;
+    }
+  }
+  s->count = count;
+  return;
+
+bad:
+  if (s->map != MAP_FAILED)
+    munmap(s->map, s->maplen);
+  s->map = NULL;
+  s->maplen = 0;
+  free(s->index);
+  free(s->listed);
+  s->index = NULL;
+  s->listed = NULL;
+}
+
+struct uidset *uidset_open(const char *file) {
+  struct uidset *s;
+  int fd;
+
+  if ((s = calloc(1, sizeof(*s))) == NULL)
+    return NULL;
+  if ((fd = open(file, O_RDONLY)) != -1) {
+    uidset_load(s, fd);
+    close(fd);
+  }
+  return s;
+}
+
+/* Find hash H among the stored ones.  Returns its ordinal, or -1. */
+static long uidset_find(const struct uidset *s, uint64_t h) {
+  size_t lo = 0, hi, mid, pos;
+  uint64_t value, delta;
+  long i, last;
+
+  if (s->count == 0)
+    return -1;
+
+  /* last block starting at or below h */
+  hi = (s->count - 1) / UIDSET_BLOCK + 1;
+  if (s->index[0].first > h)
+    return -1;
+  while (hi - lo > 1) {
+    mid = (lo + hi) / 2;
+    if (s->index[mid].first <= h)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  value = s->index[lo].first;
+  pos = s->index[lo].next;
+  i = lo * UIDSET_BLOCK;
+  last = i + UIDSET_BLOCK - 1;
+  if (last >= (long)s->count)
+    last = s->count - 1;
+  for (;;) {
+    if (value == h)
+      return i;
+    if (value > h || i == last || get_delta(s, &pos, &delta) != 0)
+      return -1;
+    value += delta;
+    i++;
+  }
+}
+
+int uidset_check(struct uidset *s, const char *uid, size_t len) {
+  uint64_t h = uid_hash(uid, len);
+  uint64_t *p;
+  long i;
+
+  if ((i = uidset_find(s, h)) >= 0) {
+    s->listed[i / 8] |= 1 << (i % 8);
+    return 1;
+  }
+
+  if (s->nfresh == s->freshsize) {
+    s->freshsize = s->freshsize ? 2 * s->freshsize : 64;
+    if ((p = realloc(s->fresh, s->freshsize * sizeof(*p))) == NULL)
+      return 0;
+    s->fresh = p;
+  }
+  s->fresh[s->nfresh++] = h;
+  return 0;
+}
+
+static int cmp_hash(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+int uidset_save(struct uidset *s, const char *file) {
+  char tmp[4096];
+  unsigned char header[UIDSET_HEADER];
+  uint64_t value = 0, prev = 0, delta;
+  size_t pos = UIDSET_HEADER, f = 0;
+  uint32_t i = 0, count = 0;
+  FILE *fp;
+  int have_old;
+
+  qsort(s->fresh, s->nfresh, sizeof(*s->fresh), cmp_hash);
+
+  if ((fp = state_create(file, tmp, sizeof(tmp))) == NULL)
+    return -1;
+  memset(header, 0, sizeof(header));
+  fwrite(header, 1, sizeof(header), fp); /* rewritten below */
+
+  /* merge the stored hashes that are still listed with the new ones */
+  have_old = s->count > 0 && get_delta(s, &pos, &value) == 0;
+  while (have_old || f < s->nfresh) {
+    uint64_t h;
+    int keep = 1;
+
+    if (have_old && (f == s->nfresh || value <= s->fresh[f])) {
+      h = value;
+      keep = s->listed[i / 8] & (1 << (i % 8));
+      have_old = ++i < s->count && get_delta(s, &pos, &delta) == 0;
+      if (have_old)
+        value += delta;
+    } else {
+      h = s->fresh[f++];
+    }
+    if (keep && (count == 0 || h != prev)) {
+      put_delta(fp, h - prev);
+      prev = h;
+      count++;
+    }
+  }
+
+  memcpy(header, UIDSET_MAGIC, 8);
+  header[8] = count;
+  header[9] = count >> 8;
+  header[10] = count >> 16;
+  header[11] = count >> 24;
+  return state_commit(fp, tmp, file,
+                      fseek(fp, 0, SEEK_SET) != 0 ||
+                          fwrite(header, 1, 12, fp) != 12);
+}
+
+void uidset_close(struct uidset *s) {
+  if (!s)
+    return;
+  if (s->map)
+    munmap(s->map, s->maplen);
+  free(s->index);
+  free(s->listed);
+  free(s->fresh);
+  free(s);
+}
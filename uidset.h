@@ -0,0 +1,29 @@
+/* uidset.h -- persistent set of POP3 unique ids
+ *
+ * This file may be copied under the terms of the GNU Public License
+ * version 2, incorporated herein by reference.
+ */
+
+#ifndef _UIDSET_H_
+#define _UIDSET_H_ 1
+
+#include <stddef.h>
+
+struct uidset;
+
+/* Open the set of seen ids stored in FILE.  A missing file gives an empty
+ * set.  Returns NULL if FILE exists but can't be used. */
+struct uidset *uidset_open(const char *file);
+
+/* Look up an id from the current listing.  Returns 1 if it was seen before,
+ * 0 if it is new.  Either way the id is part of the set written by
+ * uidset_save(). */
+int uidset_check(struct uidset *s, const char *uid, size_t len);
+
+/* Replace FILE with the ids passed to uidset_check(), so that ids which are
+ * no longer listed are forgotten.  Returns -1 on error. */
+int uidset_save(struct uidset *s, const char *file);
+
+void uidset_close(struct uidset *s);
+
+#endif /* _UIDSET_H_ */